@@ -0,0 +1,9 @@
+; Tight counting loop: 200 rounds of counting to 50000
+start:  mov y #200
+outer:  mov x #0
+inner:  add x, #1, x
+        cmp x, #50000
+        jne inner
+        sub y, #1, y
+        jnz outer
+        hlt
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "utils.h"
+
+// Compares the switch, threaded and JIT engines on a branch-heavy guest program:
+// a nested loop whose body walks a compare-and-branch ladder.
+
+#define ORIGIN 0xA000
+#define OUTER_ITERATIONS 2000
+#define INNER_ITERATIONS 1000
+#define RUNS 5
+
+char ram[65536];
+uint16_t here = ORIGIN;
+
+uint16_t emit(Instructions opId, Register r1, Register r2, Register r3, uint16_t data) {
+    Instruction instruction = { .r1 = r1, .r2 = r2, .r3 = r3, .data = data, .opId = opId };
+    uint32_t code = toMachineCode(&instruction);
+    uint16_t address = here;
+    ram[here++] = (code >> 24) & 0xFF;
+    ram[here++] = (code >> 16) & 0xFF;
+    ram[here++] = (code >> 8) & 0xFF;
+    ram[here++] = code & 0xFF;
+    return address;
+}
+
+void patch(uint16_t address, uint16_t target) {
+    ram[address+2] = (target >> 8) & 0xFF;
+    ram[address+3] = target & 0xFF;
+}
+
+void buildProgram() {
+    memset(ram, 0, sizeof(ram));
+    ram[0] = (ORIGIN >> 8) & 0xFF;
+    ram[1] = ORIGIN & 0xFF;
+
+    emit(MOV_R_V, REG_A, 0, 0, 0);
+    emit(MOV_R_V, REG_X, 0, 0, 0);
+    uint16_t outer = emit(MOV_R_V, REG_Y, 0, 0, 0);
+    uint16_t inner = emit(ADD_R_V_R, REG_Y, REG_Y, 0, 1);
+    emit(CMP_R_V, REG_Y, 0, 0, INNER_ITERATIONS / 4);
+    uint16_t toFirst = emit(JL_A, 0, 0, 0, 0);
+    emit(CMP_R_V, REG_Y, 0, 0, INNER_ITERATIONS / 2);
+    uint16_t toSecond = emit(JL_A, 0, 0, 0, 0);
+    emit(CMP_R_V, REG_Y, 0, 0, INNER_ITERATIONS / 4 * 3);
+    uint16_t toThird = emit(JLE_A, 0, 0, 0, 0);
+    emit(ADD_R_V_R, REG_A, REG_A, 0, 4);
+    uint16_t join1 = emit(JMP_A, 0, 0, 0, 0);
+    patch(toFirst, emit(ADD_R_V_R, REG_A, REG_A, 0, 1));
+    uint16_t join2 = emit(JMP_A, 0, 0, 0, 0);
+    patch(toSecond, emit(ADD_R_V_R, REG_A, REG_A, 0, 2));
+    uint16_t join3 = emit(JMP_A, 0, 0, 0, 0);
+    patch(toThird, emit(ADD_R_V_R, REG_A, REG_A, 0, 3));
+    uint16_t join = emit(CMP_R_V, REG_Y, 0, 0, INNER_ITERATIONS);
+    patch(join1, join);
+    patch(join2, join);
+    patch(join3, join);
+    emit(JNE_A, 0, 0, 0, inner);
+    emit(ADD_R_V_R, REG_X, REG_X, 0, 1);
+    emit(CMP_R_V, REG_X, 0, 0, OUTER_ITERATIONS);
+    emit(JNE_A, 0, 0, 0, outer);
+    emit(HLT, 0, 0, 0, 0);
+}
+
+double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+bool sameState(CPU* a, CPU* b) {
+    return memcmp(a->regs, b->regs, sizeof(a->regs)) == 0 &&
+           a->PC == b->PC && a->stackptr == b->stackptr && a->cycles == b->cycles &&
+           a->status == b->status && flagZero(a) == flagZero(b) && flagNeg(a) == flagNeg(b) &&
+           flagCarry(a) == flagCarry(b) && flagEqu(a) == flagEqu(b) && flagNeq(a) == flagNeq(b) &&
+           flagGr(a) == flagGr(b) && flagGe(a) == flagGe(b) && flagLs(a) == flagLs(b) &&
+           flagLe(a) == flagLe(b) && memcmp(a->ram, b->ram, 65536) == 0;
+}
+
+double benchmark(Engine engine, CPU** result) {
+    double best = 0;
+    for (int i = 0; i < RUNS; i++) {
+        CPU* cpu = initializeEmulator(ram);
+        double start = seconds();
+        runEngine(cpu, engine, UINT64_MAX);
+        double elapsed = seconds() - start;
+        double mips = (double)cpu->cycles / elapsed / 1e6;
+        if (mips > best) { best = mips; }
+        if (i == RUNS - 1) {
+            *result = cpu;
+        } else {
+            freeEmulator(cpu);
+        }
+    }
+    return best;
+}
+
+int main() {
+    buildProgram();
+
+    CPU* reference;
+    CPU* threaded;
+    CPU* jit;
+    double switchMips = benchmark(ENGINE_SWITCH, &reference);
+    double threadedMips = benchmark(ENGINE_THREADED, &threaded);
+    double jitMips = benchmark(ENGINE_JIT, &jit);
+
+    printf("Guest instructions - %llu\n", (unsigned long long)reference->cycles);
+    printf("switch - %.2f MIPS\n", switchMips);
+    printf("threaded - %.2f MIPS (%.2fx)\n", threadedMips, threadedMips / switchMips);
+    printf("jit - %.2f MIPS (%.2fx)\n", jitMips, jitMips / switchMips);
+
+    bool same = sameState(reference, threaded) && sameState(reference, jit);
+    if (!same) { printf(HI_RED "Engines disagree on the final CPU state!\n" COL_RESET); }
+    freeEmulator(reference);
+    freeEmulator(threaded);
+    freeEmulator(jit);
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
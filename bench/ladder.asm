@@ -0,0 +1,23 @@
+; Compare-and-branch ladder: sorts 1000 values into four buckets, 2000 times
+start:  mov x #0
+outer:  mov y #0
+inner:  add y, #1, y
+        cmp y, #250
+        jl first
+        cmp y, #500
+        jl second
+        cmp y, #750
+        jle third
+        add a, #4, a
+        jmp join
+first:  add a, #1, a
+        jmp join
+second: add a, #2, a
+        jmp join
+third:  add a, #3, a
+join:   cmp y, #1000
+        jne inner
+        add x, #1, x
+        cmp x, #2000
+        jne outer
+        hlt
@@ -0,0 +1,19 @@
+; Memory copy through [reg] indirects: fills 16 KiB at $1000, then copies it
+; to $5000 200 times
+start:  mov x #$1000
+fill:   mov [x], x
+        add x, #2, x
+        cmp x, #$5000
+        jne fill
+        mov y #200
+again:  mov x #$1000
+        mov ax #$5000
+copy:   mov a [x]
+        mov [ax], a
+        add x, #2, x
+        add ax, #2, ax
+        cmp x, #$5000
+        jne copy
+        sub y, #1, y
+        jnz again
+        hlt
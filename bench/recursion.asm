@@ -0,0 +1,17 @@
+; Deep call/ret recursion: sums 2000 down to 1 recursively, 500 times
+start:  mov y #500
+again:  mov x #2000
+        mov a #0
+        call sum
+        sub y, #1, y
+        jnz again
+        hlt
+; a += x + (x-1) + ... + 1
+sum:    cmp x, #0
+        je .done
+        add a, x, a
+        push x
+        sub x, #1, x
+        call sum
+        pop x
+.done:  ret
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "image.h"
+#include "utils.h"
+
+// Runs each guest program given on the command line on every engine and
+// assembles a generated source file, printing the results as JSON so runs can
+// be compared across commits. Each measurement is the best of RUNS.
+
+#define RUNS 5
+#define ASSEMBLER_RUNS 50
+// Fills the space from 0xA000 to the end of RAM with a little to spare
+#define GENERATED_INSTRUCTIONS 6000
+
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT "unknown"
+#endif
+
+char ram[65536];
+
+static const char* engineNames[] = { "switch", "threaded", "jit" };
+
+double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Program name without directory or extension
+void programName(const char* path, char* name, size_t size) {
+    const char* base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+    snprintf(name, size, "%s", base);
+    char* extension = strrchr(name, '.');
+    if (extension != NULL) { *extension = '\0'; }
+}
+
+// Best seconds over RUNS for one engine, with the instruction count of a run
+double benchmarkEngine(Engine engine, uint64_t* instructions, bool* halted) {
+    double best = 0;
+    for (int i = 0; i < RUNS; i++) {
+        CPU* cpu = initializeEmulator(ram);
+        double start = seconds();
+        runEngine(cpu, engine, UINT64_MAX);
+        double elapsed = seconds() - start;
+        if (i == 0 || elapsed < best) { best = elapsed; }
+        *instructions = cpu->cycles;
+        *halted = cpu->status == CPU_HALTED;
+        freeEmulator(cpu);
+    }
+    return best;
+}
+
+bool benchmarkProgram(const char* path, bool first) {
+    if (assembleFile(path, ram, NULL, false) != EXIT_SUCCESS) { return false; }
+    uint64_t instructions[3];
+    double elapsed[3];
+    for (int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; engine++) {
+        bool halted;
+        elapsed[engine] = benchmarkEngine((Engine)engine, &instructions[engine], &halted);
+        if (!halted) {
+            fprintf(stderr, HI_RED "%s did not halt on the %s engine!\n" COL_RESET, path, engineNames[engine]);
+            return false;
+        }
+    }
+
+    char name[64];
+    programName(path, name, sizeof(name));
+    printf("%s\n    {\"name\": \"%s\", \"engines\": {", first ? "" : ",", name);
+    for (int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; engine++) {
+        printf("%s\n      \"%s\": {\"instructions\": %llu, \"ns_per_instruction\": %.3f, \"mips\": %.2f}",
+            engine == ENGINE_SWITCH ? "" : ",", engineNames[engine], (unsigned long long)instructions[engine],
+            elapsed[engine] * 1e9 / (double)instructions[engine], (double)instructions[engine] / elapsed[engine] / 1e6);
+    }
+    printf("\n    }}");
+    return true;
+}
+
+// A source file as large as fits in RAM: labelled blocks of arithmetic,
+// memory accesses and branches to labels both behind and ahead, with comments
+char* generateSource(size_t* size, int* lines) {
+    char* text;
+    FILE* source = open_memstream(&text, size);
+    static const char* registers[] = { "a", "x", "y", "ax" };
+    uint32_t seed = 12345;
+    int blocks = GENERATED_INSTRUCTIONS / 8;
+    int lastBlock = -1;
+    *lines = 0;
+    for (int instruction = 0; instruction < GENERATED_INSTRUCTIONS; instruction++) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t random = seed >> 8;
+        const char* r1 = registers[random & 3];
+        const char* r2 = registers[(random >> 2) & 3];
+        int block = instruction / 8;
+        if (block != lastBlock) {
+            fprintf(source, "; block %d\n", block);
+            fprintf(source, "block%d:\n", block);
+            *lines += 2;
+            lastBlock = block;
+        }
+        switch ((random >> 4) % 8) {
+            case 0: fprintf(source, "        mov %s #%u\n", r1, random & 0xFFFF); break;
+            case 1: fprintf(source, "        add %s, #%u, %s\n", r1, (random >> 8) & 0xFF, r2); break;
+            case 2: fprintf(source, "        sub %s, %s, %s\n", r1, r2, r1); break;
+            case 3: fprintf(source, "        mov [%s], %s ; store\n", r1, r2); break;
+            case 4: fprintf(source, "        mov %s [%s]\n", r1, r2); break;
+            case 5: fprintf(source, "        cmp %s, #$%04X\n", r1, random & 0xFFFF); break;
+            case 6: fprintf(source, "        jne block%u\n", (random >> 8) % blocks); break;
+            default: fprintf(source, "        push %s\n        pop %s\n", r1, r2); instruction++; *lines += 1; break;
+        }
+        *lines += 1;
+    }
+    fprintf(source, "        hlt\n");
+    *lines += 1;
+    fclose(source);
+    return text;
+}
+
+bool benchmarkAssembler() {
+    size_t size;
+    int lines;
+    char* text = generateSource(&size, &lines);
+    double best = 0;
+    for (int i = 0; i < ASSEMBLER_RUNS; i++) {
+        FILE* source = fmemopen(text, size, "r");
+        double start = seconds();
+        int status = assembleStream(source, ram, 0xA000, NULL, false);
+        double elapsed = seconds() - start;
+        fclose(source);
+        if (status != EXIT_SUCCESS) {
+            fprintf(stderr, HI_RED "The generated source does not assemble!\n" COL_RESET);
+            printf("  \"assembler\": null\n");
+            free(text);
+            return false;
+        }
+        if (i == 0 || elapsed < best) { best = elapsed; }
+    }
+    printf("  \"assembler\": {\"lines\": %d, \"bytes\": %zu, \"lines_per_second\": %.0f, \"ns_per_line\": %.1f}\n",
+        lines, size, (double)lines / best, best * 1e9 / (double)lines);
+    free(text);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    printf("{\n  \"commit\": \"%s\",\n  \"runs\": %d,\n  \"programs\": [", BENCH_COMMIT, RUNS);
+    int failed = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!benchmarkProgram(argv[i], i - 1 == failed)) { failed++; }
+    }
+    printf("\n  ],\n");
+    bool assembled = benchmarkAssembler();
+    printf("}\n");
+    return failed == 0 && assembled ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,7 +6,9 @@
 #include <string.h>
 
 #include "utils.h"
+#include "emulator.h"
 #include "assembler.h"
+#include "symbols.h"
 
 void printToken(Token* token) {
     printf(
@@ -19,188 +21,298 @@ void printToken(Token* token) {
     );
 }
 
-void printMachineCode(uint32_t machineCode) {
+void printMachineCode(FILE* log, uint32_t machineCode) {
     // Printing machine code in binary format
     for(int i = 31; i >= 0; i--) {
-        printf("%d", (machineCode >> i) & 1);
+        fprintf(log, "%d", (machineCode >> i) & 1);
         if (i%8==0 && i!=0) {
-            printf(" ");
+            fprintf(log, " ");
         }
     }
 }
 
-int parseToken(const char* string, Token* token) {
+// True at the end of a token. A single trailing newline is accepted, the way
+// the old regex $ anchor accepted one.
+static inline bool atTokenEnd(const char* c) {
+    return c[0] == '\0' || (c[0] == '\n' && c[1] == '\0');
+}
+
+static inline bool isDecimalDigit(char c) { return c >= '0' && c <= '9'; }
+static inline bool isLabelStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+}
+static inline bool isLabelChar(char c) { return isLabelStart(c) || isDecimalDigit(c); }
+static inline bool isBinaryDigit(char c)  { return c == '0' || c == '1'; }
+static inline bool isHexDigit(char c) {
+    return isDecimalDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// Skips a run of at least one digit, returning NULL if the run is empty or
+// anything but the end of the token follows it
+static const char* skipDigits(const char* c, bool (*isDigit)(char)) {
+    const char* start = c;
+    while (isDigit(*c)) { c++; }
+    return c != start && atTokenEnd(c) ? c : NULL;
+}
+
+// Classifies an operand in one pass: A, X, Y, AX (any case, optionally in
+// brackets), then an optionally #-prefixed decimal, $hex or 0b binary literal
+// or label. A label's value is left at 0 for the caller to resolve.
+int parseToken(const char* string, Token* token, FILE* errors) {
     if (string == NULL) {
         return 1;
     }
-    char* current = (char*)string;
-    token->type = 2;
-
-    bool hasBrackets = matches(string, "^\\[.*\\]$");
+    token->label = NULL;
+    size_t length = strlen(string);
+    if (length > 0 && string[length-1] == '\n') { length--; }
+    bool hasBrackets = length >= 2 && string[0] == '[' && string[length-1] == ']';
 
-    if (matches(current, "^\\[?(AX|Ax|aX|ax)\\]?$")) {
+    const char* name = string + (string[0] == '[');
+    size_t nameLength = string + length - name;
+    if (nameLength > 0 && name[nameLength-1] == ']') { nameLength--; }
+    if (nameLength == 2 && (name[0] | 0x20) == 'a' && (name[1] | 0x20) == 'x') {
         token->type = hasBrackets ? INDIRECT_REGISTER : REGISTER;
         token->reg = REG_AX;
-    } else if (matches(current, "^\\[?(A|a)\\]?$")) {
-        token->type = hasBrackets ? INDIRECT_REGISTER : REGISTER;
-        token->reg = REG_A;
-    } else if (matches(current, "^\\[?(X|x)\\]?$")) {
-        token->type = hasBrackets ? INDIRECT_REGISTER : REGISTER;
-        token->reg = REG_X;
-    } else if (matches(current, "^\\[?(Y|y)\\]?$")) {
-        token->type = hasBrackets ? INDIRECT_REGISTER : REGISTER;
-        token->reg = REG_Y;
-    }
-
-    if (token->type != 2) {
         return 0;
     }
+    if (nameLength == 1) {
+        switch (name[0] | 0x20) {
+            case 'a': token->reg = REG_A; break;
+            case 'x': token->reg = REG_X; break;
+            case 'y': token->reg = REG_Y; break;
+            default: nameLength = 0; break;
+        }
+        if (nameLength == 1) {
+            token->type = hasBrackets ? INDIRECT_REGISTER : REGISTER;
+            return 0;
+        }
+    }
+
+    const char* current = string;
     token->reg = 0;
-    if (matches(current, "^#")) {
+    if (*current == '#') {
         token->type = IMMEDIATE;
         current++;
     } else {
         token->type = ADDRESS;
     }
 
-    if (matches(current, "^[[:digit:]]+$")) {
+    if (skipDigits(current, isDecimalDigit) != NULL) {
         token->value = (uint16_t)strtoul(current, NULL, 10);
         return 0;
-    } else if (matches(current, "^\\$[[:xdigit:]]+$")) {
+    } else if (current[0] == '$' && skipDigits(current+1, isHexDigit) != NULL) {
         token->value = (uint16_t)strtoul(current+1, NULL, 16);
         return 0;
-    } else if (matches(current, "^0b[01]+$")) {
+    } else if (current[0] == '0' && current[1] == 'b' && skipDigits(current+2, isBinaryDigit) != NULL) {
         token->value = (uint16_t)strtoul(current+2, NULL, 2);
         return 0;
+    } else if (isLabelStart(current[0])) {
+        const char* end = current;
+        while (isLabelChar(*end)) { end++; }
+        if (atTokenEnd(end) && end - current <= MAX_LABEL_LENGTH) {
+            token->value = 0;
+            token->label = current;
+            return 0;
+        }
     }
-    printf(HI_RED "Error parsing token! %s is not a valid value!\n" COL_RESET, current);
+    fprintf(errors, HI_RED "Error parsing token! %s is not a valid value!\n" COL_RESET, current);
     return 2;
 }
 
-int checkTokenCount(int desiredTokenCount, int tokenCount) {
-    if (tokenCount > desiredTokenCount) {
-        printf(HI_RED "Too many operands for instruction!\n" COL_RESET);
+// Operand signature of one instruction form: the operand count in the low two
+// bits, then two bits of TokenType per operand
+#define SIGNATURE(count, t1, t2, t3) ((count) | (t1)<<2 | (t2)<<4 | (t3)<<6)
+#define FORM0(opId)             { SIGNATURE(0, 0, 0, 0), opId }
+#define FORM1(opId, a)          { SIGNATURE(1, a, 0, 0), opId }
+#define FORM2(opId, a, b)       { SIGNATURE(2, a, b, 0), opId }
+#define FORM3(opId, a, b, c)    { SIGNATURE(3, a, b, c), opId }
+#define R REGISTER
+#define V IMMEDIATE
+#define A ADDRESS
+#define AR INDIRECT_REGISTER
+
+struct OperandForm {
+    uint8_t signature;
+    Instructions opId;
+}; typedef struct OperandForm OperandForm;
+
+struct MnemonicEntry {
+    char name[MNEMONIC_MAX_LENGTH + 1];
+    uint8_t formCount;
+    OperandForm forms[7];
+}; typedef struct MnemonicEntry MnemonicEntry;
+
+// Perfect hash over the mnemonic's first, second and last character and its
+// length, collision free for the whole ISA. Entries are placed at their hash by
+// the initializer below, so a new mnemonic that collides trips -Woverride-init.
+#define MNEMONIC_HASH(first, second, last, length) (((first)*3 + (second)*8 + (last)*11 + (length)) & 63)
+#define FORMS(...) sizeof((OperandForm[]){ __VA_ARGS__ }) / sizeof(OperandForm), { __VA_ARGS__ }
+#define MNEMONIC2(a, b, ...)       [MNEMONIC_HASH(a, b, b, 2)] = { { a, b }, FORMS(__VA_ARGS__) }
+#define MNEMONIC3(a, b, c, ...)    [MNEMONIC_HASH(a, b, c, 3)] = { { a, b, c }, FORMS(__VA_ARGS__) }
+#define MNEMONIC4(a, b, c, d, ...) [MNEMONIC_HASH(a, b, d, 4)] = { { a, b, c, d }, FORMS(__VA_ARGS__) }
+
+static const MnemonicEntry mnemonics[64] = {
+    MNEMONIC3('m','o','v', FORM2(MOV_R_R, R, R), FORM2(MOV_R_V, R, V), FORM2(MOV_R_A, R, A), FORM2(MOV_A_R, A, R),
+                           FORM2(MOV_AR_R, AR, R), FORM2(MOV_AR_V, AR, V), FORM2(MOV_R_AR, R, AR)),
+    MNEMONIC4('p','u','s','h', FORM1(PUSH_R, R), FORM1(PUSH_V, V)),
+    MNEMONIC3('p','o','p', FORM1(POP_R, R)),
+    MNEMONIC4('c','a','l','l', FORM1(CALL_A, A)),
+    MNEMONIC3('r','e','t', FORM0(RET)),
+    MNEMONIC3('c','m','p', FORM2(CMP_R_V, R, V), FORM2(CMP_V_R, V, R), FORM2(CMP_R_R, R, R)),
+    MNEMONIC2('j','z', FORM1(JZ_A, A)),
+    MNEMONIC3('j','n','z', FORM1(JNZ_A, A)),
+    MNEMONIC2('j','n', FORM1(JN_A, A)),
+    MNEMONIC3('j','n','n', FORM1(JNN_A, A)),
+    MNEMONIC3('j','m','p', FORM1(JMP_A, A)),
+    MNEMONIC2('j','e', FORM1(JE_A, A)),
+    MNEMONIC3('j','n','e', FORM1(JNE_A, A)),
+    MNEMONIC2('j','l', FORM1(JL_A, A)),
+    MNEMONIC3('j','l','e', FORM1(JLE_A, A)),
+    MNEMONIC2('j','g', FORM1(JG_A, A)),
+    MNEMONIC3('j','g','e', FORM1(JGE_A, A)),
+    MNEMONIC3('a','d','d', FORM3(ADD_R_V_R, R, V, R), FORM3(ADD_R_R_R, R, R, R)),
+    MNEMONIC3('a','d','c', FORM3(ADC_R_V_R, R, V, R), FORM3(ADC_R_R_R, R, R, R)),
+    MNEMONIC3('s','u','b', FORM3(SUB_R_V_R, R, V, R), FORM3(SUB_V_R_R, V, R, R), FORM3(SUB_R_R_R, R, R, R)),
+    MNEMONIC3('s','b','b', FORM3(SBB_R_V_R, R, V, R), FORM3(SBB_V_R_R, V, R, R), FORM3(SBB_R_R_R, R, R, R)),
+    MNEMONIC3('m','u','l', FORM3(MUL_R_V_R, R, V, R), FORM3(MUL_R_R_R, R, R, R)),
+    MNEMONIC4('i','m','u','l', FORM3(IMUL_R_V_R, R, V, R), FORM3(IMUL_R_R_R, R, R, R)),
+    MNEMONIC3('d','i','v', FORM3(DIV_R_V_R, R, V, R), FORM3(DIV_V_R_R, V, R, R), FORM3(DIV_R_R_R, R, R, R)),
+    MNEMONIC4('i','d','i','v', FORM3(IDIV_R_V_R, R, V, R), FORM3(IDIV_V_R_R, V, R, R), FORM3(IDIV_R_R_R, R, R, R)),
+    MNEMONIC4('p','a','s','s', FORM1(PASS_R, R)),
+    MNEMONIC3('h','l','t', FORM0(HLT)),
+};
+
+#undef R
+#undef V
+#undef A
+#undef AR
+
+static const MnemonicEntry* findMnemonic(const char* name) {
+    size_t length = strlen(name);
+    if (length < 2 || length > MNEMONIC_MAX_LENGTH) { return NULL; }
+    const MnemonicEntry* entry = &mnemonics[MNEMONIC_HASH(name[0], name[1], name[length-1], length)];
+    return strcmp(entry->name, name) == 0 ? entry : NULL;
+}
+
+// Writes instruction back as assembly source, with values in hex
+void disassemble(const Instruction* instruction, char* text, size_t size) {
+    static const char* registerNames[4] = { "a", "x", "y", "ax" };
+    const Register regs[3] = { instruction->r1, instruction->r2, instruction->r3 };
+    for (int i = 0; i < 64; i++) {
+        for (int form = 0; form < mnemonics[i].formCount; form++) {
+            if (mnemonics[i].forms[form].opId != (uint8_t)instruction->opId) { continue; }
+            uint8_t signature = mnemonics[i].forms[form].signature;
+            int length = snprintf(text, size, "%s", mnemonics[i].name);
+            int reg = 0;
+            for (int operand = 0; operand < (signature & 3) && length < (int)size; operand++) {
+                const char* separator = operand == 0 ? " " : ", ";
+                switch ((signature >> (2 + 2*operand)) & 3) {
+                    case REGISTER:
+                        length += snprintf(text + length, size - length, "%s%s", separator, registerNames[regs[reg++] & 3]);
+                        break;
+                    case INDIRECT_REGISTER:
+                        length += snprintf(text + length, size - length, "%s[%s]", separator, registerNames[regs[reg++] & 3]);
+                        break;
+                    case IMMEDIATE:
+                        length += snprintf(text + length, size - length, "%s#$%04X", separator, instruction->data);
+                        break;
+                    case ADDRESS:
+                        length += snprintf(text + length, size - length, "%s$%04X", separator, instruction->data);
+                        break;
+                }
+            }
+            return;
+        }
+    }
+    snprintf(text, size, "invalid opcode %u", (uint8_t)instruction->opId);
+}
+
+int checkTokenCount(const MnemonicEntry* entry, int operandCount, FILE* errors) {
+    int fewest = 3;
+    int most = 0;
+    for (int i = 0; i < entry->formCount; i++) {
+        int count = entry->forms[i].signature & 3;
+        fewest = count < fewest ? count : fewest;
+        most = count > most ? count : most;
+    }
+    if (operandCount > most) {
+        fprintf(errors, HI_RED "Too many operands for instruction!\n" COL_RESET);
         return 1;
     }
-    if (tokenCount < desiredTokenCount) {
-        printf(HI_RED "Too few valid operands for instruction!\n" COL_RESET);
+    if (operandCount < fewest) {
+        fprintf(errors, HI_RED "Too few valid operands for instruction!\n" COL_RESET);
         return 1;
     }
     return 0;
 }
-int parseLine(const char* string, Instruction* instruction, int line) {
-    char* tokens[4];
-    char current[100];
-    strncpy(current, string, strlen(string)+1);
-    if (matches(current, "^[[:space:]]*$")) {
+
+// Registers fill r1, r2, r3 in the order they appear, a value goes to data
+void encodeOperands(Token* operands, int operandCount, Instruction* instruction) {
+    Register* regs[3] = { &instruction->r1, &instruction->r2, &instruction->r3 };
+    int reg = 0;
+    for (int i = 0; i < operandCount; i++) {
+        if (operands[i].type == REGISTER || operands[i].type == INDIRECT_REGISTER) {
+            *regs[reg++] = operands[i].reg;
+        } else {
+            instruction->data = operands[i].value;
+        }
+    }
+}
+
+// Parses one instruction. If its value operand is a label, the label's name is
+// copied to label (MAX_LABEL_LENGTH + 1 bytes), otherwise label is left empty.
+int parseLine(const char* string, Instruction* instruction, int line, char* label, FILE* errors) {
+    char* tokens[MAX_OPERANDS + 2];
+    char current[MAX_LINE_LENGTH + 1];
+    if (strlen(string) > MAX_LINE_LENGTH) {
+        fprintf(errors, HI_RED "%d: Line is longer than %d characters!\n" COL_RESET, line+1, MAX_LINE_LENGTH);
+        return 2;
+    }
+    strcpy(current, string);
+    label[0] = '\0';
+    if (current[strspn(current, " \t\n\v\f\r")] == '\0') {
         return 3;
     }
+    char* rest;
     int i = 0;
-    tokens[i] = strtok(current, " \t,");
-    while (tokens[i] != NULL) {
+    tokens[i] = strtok_r(current, " \t,", &rest);
+    while (tokens[i] != NULL && i <= MAX_OPERANDS) {
         i++;
-        tokens[i] = strtok(NULL, ", \t");
+        tokens[i] = strtok_r(NULL, ", \t", &rest);
     }
 
     char* opcode = tokens[0];
     if (opcode == NULL) { return 1; }
-    int tokenCount = i;
-    Token t1;
-    if (tokenCount > 1) { parseToken(tokens[1], &t1); }
-    Token t2;
-    if (tokenCount > 2) { parseToken(tokens[2], &t2); }
-    Token t3;
-    if (tokenCount > 3) { parseToken(tokens[3], &t3); }
-
-    if (strcmp(opcode, "mov") == 0) {
-        if (checkTokenCount(3, tokenCount)) { return 2; }
-        if (t1.type == REGISTER && t2.type == REGISTER) {
-            instruction->opId = MOV_R_R;
-            instruction->r1 = t1.reg;
-            instruction->r2 = t2.reg;
-            return 0;
-        } else if (t1.type == REGISTER && t2.type == IMMEDIATE) {
-            instruction->opId = MOV_R_V;
-            instruction->r1 = t1.reg;
-            instruction->data = t2.value;
-            return 0;
-        } else if (t1.type == REGISTER && t2.type == ADDRESS) {
-            instruction->opId = MOV_R_A;
-            instruction->r1 = t1.reg;
-            instruction->data = t2.value;
-            return 0;
-        } else if (t1.type == ADDRESS && t2.type == REGISTER) {
-            instruction->opId = MOV_A_R;
-            instruction->r1 = t2.reg;
-            instruction->data = t1.value;
-            return 0;
-        }else if (t1.type == INDIRECT_REGISTER && t2.type == REGISTER) {
-            instruction->opId = MOV_AR_R;
-            instruction->r1 = t1.reg;
-            instruction->r2 = t2.reg;
-            return 0;
-        } else if (t1.type == INDIRECT_REGISTER && t2.type == IMMEDIATE) {
-            instruction->opId = MOV_AR_V;
-            instruction->r1 = t1.reg;
-            instruction->data = t2.value;
-            return 0;
-        } else if (t1.type == REGISTER && t2.type == INDIRECT_REGISTER) {
-            instruction->opId = MOV_R_AR;
-            instruction->r1 = t1.reg;
-            instruction->r2 = t2.reg;
-            return 0;
-        }
-    } else if (strcmp(opcode, "push") == 0) {
-        if (checkTokenCount(2, tokenCount)) { return 2; }
-        if (t1.type == REGISTER) {
-            instruction->opId = PUSH_R;
-            instruction->r1 = t1.reg;
-            return 0;
-        } else if (t1.type == IMMEDIATE) {
-            instruction->opId = PUSH_V;
-            instruction->data = t1.value;
-            return 0;
-        }
-    } else if (strcmp(opcode, "pop") == 0) {
-        if (checkTokenCount(2, tokenCount)) { return 2; }
-        if (t1.type == REGISTER) {
-            instruction->opId = POP_R;
-            instruction->r1 = t1.reg;
-            return 0;
-        }
-    } else if (strcmp(opcode, "call") == 0) {
-        if (checkTokenCount(2, tokenCount)) { return 2; }
-        if (t1.type == ADDRESS) {
-            instruction->opId = CALL_A;
-            instruction->data = t1.value;
-            return 0;
-        }
-    } else if (strcmp(opcode, "ret") == 0) {
-        if (checkTokenCount(1, tokenCount)) { return 2; }
-        instruction->opId = RET;
-        instruction->data = 0;
-        instruction->r1 = 0;
-        return 0;
-    } else if (strcmp(opcode, "cmp") == 0) {
-        if (checkTokenCount(3, tokenCount)) { return 2; }
-        if (t1.type == REGISTER && t2.type == IMMEDIATE) {
-            instruction->opId = CMP_R_V;
-            instruction->r1 = t1.reg;
-            instruction->data = t2.value;
-            return 0;
-        } else if (t1.type == IMMEDIATE && t2.type == REGISTER) {
-            instruction->opId = CMP_V_R;
-            instruction->r1 = t2.reg;
-            instruction->data = t1.value;
-            return 0;
-        } else if (t1.type == REGISTER && t2.type == REGISTER) {
-            instruction->opId = CMP_R_R;
-            instruction->r1 = t1.reg;
-            instruction->r2 = t2.reg;
+    // A token left over when the loop stopped is one operand too many
+    int operandCount = tokens[i] != NULL ? i : i - 1;
+    const MnemonicEntry* entry = findMnemonic(opcode);
+    if (entry == NULL) {
+        fprintf(errors, HI_RED "%d: %s is not recognized!\n" COL_RESET, line+1, string);
+        return 1;
+    }
+    if (checkTokenCount(entry, operandCount, errors)) { return 2; }
+
+    Token operands[MAX_OPERANDS];
+    uint8_t signature = operandCount;
+    for (int operand = 0; operand < operandCount; operand++) {
+        if (parseToken(tokens[operand + 1], &operands[operand], errors) != 0) { return 2; }
+        signature |= operands[operand].type << (2 + 2*operand);
+    }
+
+    for (int form = 0; form < entry->formCount; form++) {
+        if (entry->forms[form].signature == signature) {
+            *instruction = (Instruction){0};
+            instruction->opId = entry->forms[form].opId;
+            encodeOperands(operands, operandCount, instruction);
+            for (int operand = 0; operand < operandCount; operand++) {
+                if (operands[operand].label != NULL) {
+                    strcpy(label, operands[operand].label);
+                }
+            }
             return 0;
         }
-    } 
-    printf(HI_RED "%d: %s is not recognized!\n" COL_RESET, line+1, string);
+    }
+    fprintf(errors, HI_RED "%d: %s is not recognized!\n" COL_RESET, line+1, string);
     return 1;
 }
 
@@ -212,47 +324,185 @@ uint32_t toMachineCode(Instruction* instruction) {
     return byte4 | byte3<<8 | byte2<<16 | byte1<<24;
 }
 
-int assembleIntoRAM(char* src, char* ram, const uint16_t startVector) {
-    uint32_t instructions[65536];
-    FILE* file = fmemopen(src, strlen(src), "r");
-    char string[100];
-    int line = 0;
-    while (fgets(string, sizeof(string), file) != NULL) {
-        if (string[strlen(string)-1] == '\n') {
-            string[strlen(string)-1] = '\0';
+// Defines label at offset, returning false if it is a register or already defined
+static bool defineLabel(SymbolTable* symbols, const char* label, uint16_t offset, int line, FILE* errors) {
+    Token token;
+    if (parseToken(label, &token, errors) == 0 && token.label == NULL) {
+        fprintf(errors, HI_RED "%d: %s is a register and cannot be a label!\n" COL_RESET, line+1, label);
+        return false;
+    }
+    int index = internSymbol(symbols, label);
+    Symbol* symbol = &symbols->symbols[index];
+    if (symbol->defined) {
+        fprintf(errors, HI_RED "%d: Label %s is already defined!\n" COL_RESET, line+1, label);
+        return false;
+    }
+    symbol->defined = true;
+    symbol->address = offset;
+    return true;
+}
+
+void patchData(char* code, uint16_t offset, uint16_t value) {
+    code[offset+2] = (char)(value >> 8);
+    code[offset+3] = (char)(value & 0xFF);
+}
+
+void addRelocation(ObjectModule* module, Relocation relocation) {
+    if (module->relocationCount == module->relocationCapacity) {
+        module->relocationCapacity = module->relocationCapacity == 0 ? 64 : module->relocationCapacity * 2;
+        module->relocations = realloc(module->relocations, module->relocationCapacity * sizeof(Relocation));
+    }
+    module->relocations[module->relocationCount++] = relocation;
+}
+
+void freeObjectModule(ObjectModule* module) {
+    if (module->symbols != NULL) { freeSymbolTable(module->symbols); }
+    free(module->relocations);
+    free(module->lines);
+    module->symbols = NULL;
+    module->relocations = NULL;
+    module->lines = NULL;
+    module->relocationCount = module->relocationCapacity = 0;
+    module->lineCount = module->lineCapacity = 0;
+}
+
+// Assembles source line by line straight into module->code, as a section
+// starting at offset 0. A label defined as "name:" at the start of a line can
+// be used wherever an address or (#-prefixed) immediate can; every use becomes
+// a relocation against the symbol, patched once the section's final address is
+// known. Only the current line, the symbol table and the relocations are held
+// in memory. Everything after a ';' is a comment.
+int assembleModule(FILE* source, ObjectModule* module, FILE* log) {
+    FILE* errors = module->errors != NULL ? module->errors : stdout;
+    module->size = 0;
+    module->symbols = createSymbolTable();
+    module->relocations = NULL;
+    module->relocationCount = module->relocationCapacity = 0;
+    if (module->peephole != NULL) {
+        module->peephole->removed = 0;
+        resetPeephole(module->peephole);
+    }
+    char* string = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int status = EXIT_SUCCESS;
+
+    for (int line = 0; status == EXIT_SUCCESS && (length = getline(&string, &capacity, source)) != -1; line++) {
+        if (length > 0 && string[length-1] == '\n') {
+            string[--length] = '\0';
+        }
+        SourceLine* record = NULL;
+        if (module->recordLines) {
+            if (module->lineCount == module->lineCapacity) {
+                module->lineCapacity = module->lineCapacity == 0 ? 256 : module->lineCapacity * 2;
+                module->lines = realloc(module->lines, module->lineCapacity * sizeof(SourceLine));
+            }
+            record = &module->lines[module->lineCount++];
+            *record = (SourceLine){ fnv1a(2166136261u, (const uint8_t*)string, length), -1, false };
+        }
+        string[strcspn(string, ";")] = '\0';
+
+        char* current = string + strspn(string, " \t");
+        char* end = current;
+        while (isLabelChar(*end)) { end++; }
+        if (end != current && *end == ':') {
+            *end = '\0';
+            if (end - current > MAX_LABEL_LENGTH || !isLabelStart(*current)) {
+                fprintf(errors, HI_RED "%d: %s is not a valid label!\n" COL_RESET, line+1, current);
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (!defineLabel(module->symbols, current, (uint16_t)module->size, line, errors)) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (record != NULL) { record->label = true; }
+            if (module->peephole != NULL) { resetPeephole(module->peephole); }
+            current = end + 1;
         }
+
         Instruction instruction;
-        int status;
-        if ((status = parseLine(string, &instruction, line)) != 0) {
-            if (status == 3) {
+        char label[MAX_LABEL_LENGTH + 1];
+        int parsed = parseLine(current, &instruction, line, label, errors);
+        if (parsed == 3) {
+            continue;
+        } else if (parsed != 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (module->peephole != NULL) {
+            int action = peepholeInstruction(module->peephole, &instruction, label);
+            if (action & PEEPHOLE_RETRACT) {
+                if (log != NULL) { fprintf(log, "Optimizing %d: previous instruction folded into %s\n", line+1, current); }
+                module->size -= 4;
+                if (module->relocationCount > 0 && module->relocations[module->relocationCount-1].offset == module->size) {
+                    module->relocationCount--;
+                }
+            }
+            if (!(action & PEEPHOLE_EMIT)) {
+                if (log != NULL) { fprintf(log, "Optimizing %d: %s   removed\n", line+1, current); }
                 continue;
-            } return EXIT_FAILURE;
+            }
         }
-        printf("Assembling %d: %s   output: ", line+1, string);
-        instructions[line] = toBigEndian(toMachineCode(&instruction));
-        printMachineCode(toBigEndian(instructions[line]));
-        printf("\n");
-        line++;
+        if (module->size + 4 > module->capacity) {
+            fprintf(errors, HI_RED "%d: Program does not fit in memory!\n" COL_RESET, line+1);
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (label[0] != '\0') {
+            addRelocation(module, (Relocation){ (uint16_t)module->size, internSymbol(module->symbols, label), line });
+        }
+
+        uint32_t machineCode = toMachineCode(&instruction);
+        char* code = module->code + module->size;
+        code[0] = (char)(machineCode >> 24);
+        code[1] = (char)(machineCode >> 16);
+        code[2] = (char)(machineCode >> 8);
+        code[3] = (char)machineCode;
+        if (log != NULL) {
+            fprintf(log, "Assembling %d: %s   output: ", line+1, current);
+            printMachineCode(log, machineCode);
+            fprintf(log, "\n");
+        }
+        if (record != NULL) { record->offset = (int32_t)module->size; }
+        module->size += 4;
     }
 
-    uint16_t org = startVector;
-    switchPtrEndianess(&org);
-    memcpy(ram, &org, 2);
-    switchPtrEndianess(&org);
-    char buffer[(int)org-2];
-    memset(buffer, 0, (int)org-2);
-    memcpy(ram+2, buffer, sizeof(buffer));
-    int i = 0;
-    while (i < line) {
-        ram[i*4+org] = (char)(instructions[i] & 0x000000ff);
-        ram[i*4+org+1] = (char)((instructions[i] & 0x0000ff00) >> 8);
-        ram[i*4+org+2] = (char)((instructions[i] & 0x00ff0000) >> 16);
-        ram[i*4+org+3] = (char)((instructions[i] & 0xff000000) >> 24);
-        i++; 
+    free(string);
+    return status;
+}
+
+// Patches every relocation of a module placed at base
+int relocateModule(ObjectModule* module, uint16_t base) {
+    FILE* errors = module->errors != NULL ? module->errors : stdout;
+    for (int i = 0; i < module->relocationCount; i++) {
+        Relocation* relocation = &module->relocations[i];
+        Symbol* symbol = &module->symbols->symbols[relocation->symbol];
+        if (!symbol->defined) {
+            fprintf(errors, HI_RED "%d: Label %s is never defined!\n" COL_RESET, relocation->line+1, symbol->name);
+            return EXIT_FAILURE;
+        }
+        patchData(module->code, relocation->offset, base + symbol->address);
     }
-    uint16_t size = org+i*4;
-    char buffer1[65536-(int)size];
-    memset(buffer1, 0, sizeof(buffer1));
-    memcpy(ram+size, buffer1, sizeof(buffer1));
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+// Assembles a whole program into ram at startVector, resolving every label.
+// With optimize set the -O peephole pass runs over it.
+int assembleStream(FILE* source, char* ram, const uint16_t startVector, FILE* log, bool optimize) {
+    memset(ram, 0, RAM_SIZE);
+    ram[0] = (char)(startVector >> 8);
+    ram[1] = (char)(startVector & 0xFF);
+
+    Peephole peephole;
+    ObjectModule module = { .code = ram + startVector, .capacity = RAM_SIZE - startVector, .peephole = optimize ? &peephole : NULL };
+    int status = assembleModule(source, &module, log);
+    if (status == EXIT_SUCCESS) {
+        status = relocateModule(&module, startVector);
+    }
+    if (status == EXIT_SUCCESS && optimize) {
+        printf(HI_GREEN "Optimizer removed %d instructions\n" COL_RESET, peephole.removed);
+    }
+    freeObjectModule(&module);
+    return status;
+}
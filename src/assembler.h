@@ -1,8 +1,16 @@
+#include <stdio.h>
+#include <stdbool.h>
 #include "utils.h"
+#include "symbols.h"
+#include "peephole.h"
 
 #ifndef ASSEMBLER_H
 #define ASSEMBLER_H
 
+#define MAX_OPERANDS 3
+#define MNEMONIC_MAX_LENGTH 4
+#define MAX_LINE_LENGTH 1024
+
 enum TokenType {
     REGISTER,
     IMMEDIATE,
@@ -14,16 +22,65 @@ struct Token {
     TokenType type;
     uint16_t value;
     Register reg;
+    const char *label;
 }; typedef struct Token Token;
 
+// A use of a symbol in the data field of the instruction at offset
+struct Relocation {
+    uint16_t offset;
+    int symbol;
+    int line;
+}; typedef struct Relocation Relocation;
+
+// What one source line assembled to: the FNV-1a of its text, the offset of its
+// instruction (-1 if it has none) and whether it defines a label
+struct SourceLine {
+    uint32_t hash;
+    int32_t offset;
+    bool label;
+}; typedef struct SourceLine SourceLine;
+
+// One assembled section: code, the symbols it defines or references (defined
+// ones hold their section offset) and the relocations still to be patched.
+// Diagnostics go to errors, or stdout when it is NULL. With recordLines set,
+// a SourceLine is kept for every line read. With a peephole set, the -O pass
+// runs over the instructions as they are parsed.
+struct ObjectModule {
+    char *code;
+    uint32_t size;
+    uint32_t capacity;
+    SymbolTable *symbols;
+    Relocation *relocations;
+    int relocationCount;
+    int relocationCapacity;
+    FILE *errors;
+    bool recordLines;
+    SourceLine *lines;
+    int lineCount;
+    int lineCapacity;
+    Peephole *peephole;
+}; typedef struct ObjectModule ObjectModule;
+
 void printToken(Token* token);
 
-int parseToken(const char *string, Token* token);
+int parseToken(const char *string, Token* token, FILE *errors);
 
-int parseLine(const char* string, Instruction* instruction, int line);
+int parseLine(const char* string, Instruction* instruction, int line, char* label, FILE *errors);
 
 uint32_t toMachineCode(Instruction *instruction);
 
-int assembleIntoRAM(char *src, char *ram, const uint16_t startVector);
+void disassemble(const Instruction *instruction, char *text, size_t size);
+
+void patchData(char *code, uint16_t offset, uint16_t value);
+
+void addRelocation(ObjectModule *module, Relocation relocation);
+
+void freeObjectModule(ObjectModule *module);
+
+int assembleModule(FILE *source, ObjectModule *module, FILE *log);
+
+int relocateModule(ObjectModule *module, uint16_t base);
+
+int assembleStream(FILE *source, char *ram, const uint16_t startVector, FILE *log, bool optimize);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "emulator.h"
+#include "image.h"
+#include "batch.h"
+#include "utils.h"
+
+// Runs every image listed in a manifest headless, one CPU per job, on a pool of
+// worker threads. Each worker owns a deque of job indices; it pops from its own
+// tail and steals from the head of the others once it runs dry.
+
+struct BatchJob {
+    char *path;
+    bool loaded;
+    uint16_t regs[4];
+    uint16_t PC;
+    uint16_t stackptr;
+    uint64_t cycles;
+    StopReason reason;
+    uint32_t checksum;
+}; typedef struct BatchJob BatchJob;
+
+struct WorkQueue {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;
+    int tail;
+}; typedef struct WorkQueue WorkQueue;
+
+struct BatchPool {
+    BatchJob *jobs;
+    WorkQueue *queues;
+    int workerCount;
+    Engine engine;
+    uint64_t maxCycles;
+}; typedef struct BatchPool BatchPool;
+
+struct Worker {
+    BatchPool *pool;
+    int id;
+}; typedef struct Worker Worker;
+
+bool popJob(WorkQueue* queue, int* job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->tail;
+    if (found) { *job = queue->jobs[--queue->tail]; }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+bool stealJob(WorkQueue* queue, int* job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->tail;
+    if (found) { *job = queue->jobs[queue->head++]; }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+bool hasSuffix(const char* string, const char* suffix) {
+    size_t length = strlen(string);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(string + length - suffixLength, suffix) == 0;
+}
+
+void runJob(BatchPool* pool, BatchJob* job) {
+    CPU* cpu;
+    if (hasSuffix(job->path, ".asm")) {
+        char* ram = malloc(RAM_SIZE);
+        int status = assembleFile(job->path, ram, NULL, false);
+        cpu = status == EXIT_FAILURE ? NULL : initializeEmulator(ram);
+        free(ram);
+    } else {
+        cpu = initializeEmulator(NULL);
+        if (loadRAMFile(job->path, cpu) == EXIT_FAILURE) {
+            freeEmulator(cpu);
+            cpu = NULL;
+        }
+    }
+    if (cpu == NULL) { return; }
+
+    job->reason = runEngine(cpu, pool->engine, pool->maxCycles);
+    memcpy(job->regs, cpu->regs, sizeof(job->regs));
+    job->PC = cpu->PC;
+    job->stackptr = cpu->stackptr;
+    job->cycles = cpu->cycles;
+    job->checksum = ramChecksum(cpu);
+    job->loaded = true;
+    freeEmulator(cpu);
+}
+
+void* workerMain(void* argument) {
+    Worker* worker = argument;
+    BatchPool* pool = worker->pool;
+    int job;
+    while (true) {
+        bool found = popJob(&pool->queues[worker->id], &job);
+        for (int i = 1; !found && i < pool->workerCount; i++) {
+            found = stealJob(&pool->queues[(worker->id + i) % pool->workerCount], &job);
+        }
+        // Jobs are only added up front, so empty queues everywhere means we are done
+        if (!found) { return NULL; }
+        runJob(pool, &pool->jobs[job]);
+    }
+}
+
+int readManifest(const char* manifestPath, BatchJob** jobs) {
+    FILE* file = fopen(manifestPath, "r");
+    if (file == NULL) {
+        printf(HI_RED "Fatal error! Cannot find manifest %s\n" COL_RESET, manifestPath);
+        return -1;
+    }
+    int count = 0;
+    int capacity = 16;
+    *jobs = malloc(capacity * sizeof(BatchJob));
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* path = line;
+        while (*path == ' ' || *path == '\t') { path++; }
+        if (*path == '\0' || *path == '#') { continue; }
+        if (count == capacity) {
+            capacity *= 2;
+            *jobs = realloc(*jobs, capacity * sizeof(BatchJob));
+        }
+        memset(&(*jobs)[count], 0, sizeof(BatchJob));
+        (*jobs)[count].path = strdup(path);
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+int runBatch(const char* manifestPath, Engine engine, uint64_t maxCycles, int threads) {
+    BatchJob* jobs;
+    int jobCount = readManifest(manifestPath, &jobs);
+    if (jobCount < 0) { return EXIT_FAILURE; }
+
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+    if (threads > jobCount) { threads = jobCount > 0 ? jobCount : 1; }
+
+    BatchPool pool = {
+        .jobs = jobs,
+        .queues = calloc(threads, sizeof(WorkQueue)),
+        .workerCount = threads,
+        .engine = engine,
+        .maxCycles = maxCycles
+    };
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].jobs = malloc((jobCount / threads + 1) * sizeof(int));
+    }
+    for (int i = 0; i < jobCount; i++) {
+        WorkQueue* queue = &pool.queues[i % threads];
+        queue->jobs[queue->tail++] = i;
+    }
+
+    pthread_t* handles = malloc(threads * sizeof(pthread_t));
+    Worker* workers = malloc(threads * sizeof(Worker));
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){ .pool = &pool, .id = i };
+        pthread_create(&handles[i], NULL, workerMain, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < jobCount; i++) {
+        BatchJob* job = &jobs[i];
+        if (!job->loaded) {
+            printf("%s error=load-failed\n", job->path);
+            failures++;
+        } else {
+            printf(
+                "%s A=%u X=%u Y=%u AX=%u PC=%u SP=%u cycles=%llu stop=%s checksum=%08x\n",
+                job->path, job->regs[REG_A], job->regs[REG_X], job->regs[REG_Y], job->regs[REG_AX],
+                job->PC, job->stackptr, (unsigned long long)job->cycles, stopReasonName(job->reason), job->checksum
+            );
+        }
+        free(job->path);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].jobs);
+    }
+    free(pool.queues);
+    free(handles);
+    free(workers);
+    free(jobs);
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,9 @@
+#include <stdint.h>
+#include "emulator.h"
+
+#ifndef BATCH_H
+#define BATCH_H
+
+int runBatch(const char *manifestPath, Engine engine, uint64_t maxCycles, int threads);
+
+#endif
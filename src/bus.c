@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emulator.h"
+#include "bus.h"
+#include "scheduler.h"
+
+// loadWord and storeWord look the page up in cpu->busPages and only come here
+// for device pages and for the RAM page just below one, whose last byte starts
+// a word that ends in the device. Such a straddling access keeps its RAM half
+// and sees 0 for the device half; an access starting in a device page goes to
+// the device whole.
+
+static uint16_t consoleRead(Bus* bus, const CPU* cpu, uint8_t offset) {
+    (void)bus;
+    (void)cpu;
+    (void)offset;
+    return 0;
+}
+
+static void consoleWrite(Bus* bus, CPU* cpu, uint8_t offset, uint16_t value) {
+    (void)cpu;
+    if (offset == CONSOLE_OUT) {
+        fputc(value & 0xFF, bus->out);
+        if ((value & 0xFF) == '\n') { fflush(bus->out); }
+    }
+}
+
+static uint16_t keyboardRead(Bus* bus, const CPU* cpu, uint8_t offset) {
+    (void)cpu;
+    if (offset != KEYBOARD_IN) { return 0; }
+    int c = fgetc(bus->in);
+    return c == EOF ? 0xFFFF : (uint16_t)c;
+}
+
+static uint16_t clockRead(Bus* bus, const CPU* cpu, uint8_t offset) {
+    switch (offset) {
+        case CLOCK_LOW:
+            bus->clockHigh = (uint16_t)(cpu->cycles >> 16);
+            return (uint16_t)cpu->cycles;
+        case CLOCK_HIGH:
+            return bus->clockHigh;
+        case TIMER_PERIOD:
+            return bus->timerPeriod;
+        case TIMER_VECTOR:
+            return bus->timerVector;
+        case TIMER_CONTROL:
+            return bus->timerControl;
+        default:
+            return 0;
+    }
+}
+
+static void timerInterrupt(CPU* cpu, void* context) {
+    Bus* bus = context;
+    storeWord(cpu, cpu->stackptr - 1, cpu->PC);
+    cpu->stackptr -= 2;
+    cpu->PC = bus->timerVector;
+    if ((bus->timerControl & TIMER_REPEAT) && bus->timerPeriod != 0) {
+        scheduleEvent(cpu, cpu->cycles + bus->timerPeriod, timerInterrupt, bus);
+    }
+}
+
+static void clockWrite(Bus* bus, CPU* cpu, uint8_t offset, uint16_t value) {
+    switch (offset) {
+        case TIMER_PERIOD:
+            bus->timerPeriod = value;
+            break;
+        case TIMER_VECTOR:
+            bus->timerVector = value;
+            break;
+        case TIMER_CONTROL:
+            bus->timerControl = value;
+            cancelEvents(cpu, timerInterrupt, bus);
+            if ((value & TIMER_ENABLE) && bus->timerPeriod != 0) {
+                scheduleEvent(cpu, cpu->cycles + bus->timerPeriod, timerInterrupt, bus);
+            }
+            break;
+    }
+}
+
+static uint16_t dmaRead(Bus* bus, const CPU* cpu, uint8_t offset) {
+    (void)cpu;
+    switch (offset) {
+        case DMA_SOURCE:
+            return bus->dmaSource;
+        case DMA_DEST:
+            return bus->dmaDest;
+        default:
+            return 0;
+    }
+}
+
+static inline bool isDevicePage(const CPU* cpu, uint16_t address) {
+    uint8_t entry = cpu->busPages[address >> 8];
+    return entry != 0 && entry != BUS_EDGE;
+}
+
+// A RAM byte written the way storeWord writes it
+static void storeRAMByte(CPU* cpu, uint16_t address, char value) {
+    cpu->ram[address] = value;
+    if (address == 0) { cpu->ram[RAM_SIZE] = value; }
+    cpu->dirtyPages[address >> 14] |= 1ull << ((address >> 8) & 63);
+    if (cpu->codePages[address >> 8]) { invalidateCode(cpu, address, 1); }
+}
+
+// Copies ascending byte by byte, so an overlapping copy to a higher address
+// repeats the start of the source like a fill
+static void dmaCopy(Bus* bus, CPU* cpu, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        uint16_t source = (uint16_t)(bus->dmaSource + i);
+        uint16_t dest = (uint16_t)(bus->dmaDest + i);
+        if (isDevicePage(cpu, dest)) { continue; }
+        storeRAMByte(cpu, dest, isDevicePage(cpu, source) ? 0 : cpu->ram[source]);
+    }
+}
+
+static void dmaWrite(Bus* bus, CPU* cpu, uint8_t offset, uint16_t value) {
+    switch (offset) {
+        case DMA_SOURCE:
+            bus->dmaSource = value;
+            break;
+        case DMA_DEST:
+            bus->dmaDest = value;
+            break;
+        case DMA_LENGTH:
+            dmaCopy(bus, cpu, value);
+            break;
+    }
+}
+
+static const Device devices[] = {
+    { "console",  CONSOLE_PAGE,  consoleRead,  consoleWrite },
+    { "keyboard", KEYBOARD_PAGE, keyboardRead, NULL },
+    { "clock",    CLOCK_PAGE,    clockRead,    clockWrite },
+    { "dma",      DMA_PAGE,      dmaRead,      dmaWrite },
+};
+
+uint16_t busLoad(const CPU* cpu, uint16_t address) {
+    uint8_t entry = cpu->busPages[address >> 8];
+    if (entry == BUS_EDGE) {
+        uint16_t high = (uint16_t)((uint8_t)cpu->ram[address] << 8);
+        return (address & 0xFF) == 0xFF ? high : high | (uint8_t)cpu->ram[address + 1];
+    }
+    return devices[entry - 1].read(cpu->bus, cpu, address & 0xFF);
+}
+
+void busStore(CPU* cpu, uint16_t address, uint16_t value) {
+    uint8_t entry = cpu->busPages[address >> 8];
+    if (entry == BUS_EDGE) {
+        storeRAMByte(cpu, address, (char)(value >> 8));
+        if ((address & 0xFF) != 0xFF) { storeRAMByte(cpu, address + 1, (char)(value & 0xFF)); }
+        return;
+    }
+    const Device* device = &devices[entry - 1];
+    if (device->write != NULL) { device->write(cpu->bus, cpu, address & 0xFF, value); }
+}
+
+// Maps the devices into cpu's address space. The RAM underneath them stays in
+// cpu->ram but is no longer reachable through loads and stores.
+void attachDevices(CPU* cpu, FILE* out, FILE* in) {
+    free(cpu->bus);
+    cpu->bus = calloc(1, sizeof(Bus));
+    cpu->bus->out = out;
+    cpu->bus->in = in;
+    freeScheduler(cpu->scheduler);
+    cpu->scheduler = createScheduler();
+    for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+        cpu->busPages[devices[i].page] = (uint8_t)(i + 1);
+    }
+    for (int page = 1; page < 256; page++) {
+        if (cpu->busPages[page - 1] == 0 && isDevicePage(cpu, (uint16_t)(page << 8))) {
+            cpu->busPages[page - 1] = BUS_EDGE;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "emulator.h"
+
+#ifndef BUS_H
+#define BUS_H
+
+// busPages entries: 0 is plain RAM, BUS_EDGE a RAM page followed by a device
+// page, anything else the index of the device plus one
+#define BUS_EDGE 0xFF
+
+// Device pages, mapped at the top of the address space by attachDevices. Every
+// register is a word at an even offset into its page.
+#define CONSOLE_PAGE 0xFC
+#define KEYBOARD_PAGE 0xFD
+#define CLOCK_PAGE 0xFE
+#define DMA_PAGE 0xFF
+
+// Console: a write prints the low byte
+#define CONSOLE_OUT 0x00
+// Keyboard: a read returns the next byte of input, or $FFFF at its end
+#define KEYBOARD_IN 0x00
+// Clock: reading the low word of the cycle counter latches the high word
+#define CLOCK_LOW 0x00
+#define CLOCK_HIGH 0x02
+// Timer, on the clock page: writing the control word restarts it, interrupting
+// period cycles later (and every period cycles after that with TIMER_REPEAT)
+// by pushing PC and jumping to the vector like CALL_A. The handler returns
+// with RET and saves any registers and flags it changes itself.
+#define TIMER_PERIOD 0x04
+#define TIMER_VECTOR 0x06
+#define TIMER_CONTROL 0x08
+#define TIMER_ENABLE 0x01
+#define TIMER_REPEAT 0x02
+// DMA: writing a length copies that many bytes from source to destination
+#define DMA_SOURCE 0x00
+#define DMA_DEST 0x02
+#define DMA_LENGTH 0x04
+
+struct Bus;
+
+struct Device {
+    const char *name;
+    uint8_t page;
+    uint16_t (*read)(struct Bus *bus, const CPU *cpu, uint8_t offset);
+    void (*write)(struct Bus *bus, CPU *cpu, uint8_t offset, uint16_t value);
+}; typedef struct Device Device;
+
+struct Bus {
+    FILE *out;
+    FILE *in;
+    uint16_t clockHigh;
+    uint16_t timerPeriod;
+    uint16_t timerVector;
+    uint16_t timerControl;
+    uint16_t dmaSource;
+    uint16_t dmaDest;
+}; typedef struct Bus Bus;
+
+void attachDevices(CPU *cpu, FILE *out, FILE *in);
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emulator.h"
+#include "timeline.h"
+#include "debugger.h"
+#include "scheduler.h"
+
+void setWatchpoint(Debugger* debugger, uint16_t address, uint8_t mode) {
+    if (testAddress(debugger->watchpoints, address) != (mode != 0)) { debugger->watchCount += mode != 0 ? 1 : -1; }
+    setAddress(debugger->watchpoints, address, mode != 0);
+    debugger->watchModes[address] = mode;
+}
+
+// The word instruction is about to load or store, if any. Every access is a
+// 16 bit word, so a watchpoint on either of its bytes is hit.
+static inline bool memoryAccess(const CPU* cpu, const Instruction* instruction, uint16_t* address, uint8_t* mode) {
+    switch (instruction->opId) {
+        case MOV_R_A:
+            *address = instruction->data;
+            *mode = WATCH_READ;
+            return true;
+        case MOV_R_AR:
+            *address = cpu->regs[instruction->r2];
+            *mode = WATCH_READ;
+            return true;
+        case POP_R:
+        case RET:
+            *address = (uint16_t)(cpu->stackptr + 1);
+            *mode = WATCH_READ;
+            return true;
+        case MOV_A_R:
+            *address = instruction->data;
+            *mode = WATCH_WRITE;
+            return true;
+        case MOV_AR_R:
+        case MOV_AR_V:
+            *address = cpu->regs[instruction->r1];
+            *mode = WATCH_WRITE;
+            return true;
+        case PUSH_R:
+        case PUSH_V:
+        case CALL_A:
+            *address = (uint16_t)(cpu->stackptr - 1);
+            *mode = WATCH_WRITE;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the instruction at PC touches a watched address in a watched mode
+static bool watchHit(Debugger* debugger, CPU* cpu, const Instruction* instruction) {
+    uint16_t address;
+    uint8_t mode;
+    if (!memoryAccess(cpu, instruction, &address, &mode)) { return false; }
+    for (int byte = 0; byte < 2; byte++) {
+        uint16_t at = (uint16_t)(address + byte);
+        if (testAddress(debugger->watchpoints, at) && (debugger->watchModes[at] & mode)) {
+            debugger->hitAddress = at;
+            debugger->hitMode = mode;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline const Instruction* instructionAt(CPU* cpu, uint16_t address) {
+    DecodedInstruction* decoded = &cpu->decoded[address];
+    return decoded->valid ? &decoded->instruction : &decodeAt(cpu, address)->instruction;
+}
+
+// Runs until a breakpoint is reached or a watched address is accessed, taking
+// checkpoints on the way. A breakpoint at the starting PC does not stop it, so
+// continuing from a breakpoint moves on. A watchpoint stops after the access.
+// Events and checkpoints are handled between batches that end at the earlier of
+// the two, so a batch only tests breakpoints and, if any are set, watchpoints.
+DebugStop continueDebugger(Debugger* debugger, CPU* cpu, Timeline* timeline) {
+    Scheduler* scheduler = cpu->scheduler;
+    bool watching = debugger->watchCount > 0;
+    bool first = true;
+    while (cpu->status == CPU_RUNNING) {
+        if (scheduler != NULL && scheduler->next <= cpu->cycles) { runEvents(cpu); }
+        // An event scheduled during the batch lowers the limit
+        cpu->limit = scheduler != NULL && scheduler->next < timeline->due ? scheduler->next : timeline->due;
+        while (cpu->cycles < cpu->limit && cpu->status == CPU_RUNNING) {
+            uint16_t pc = cpu->PC;
+            if (!first && testAddress(debugger->breakpoints, pc)) {
+                debugger->hitAddress = pc;
+                return DEBUG_BREAKPOINT;
+            }
+            first = false;
+            bool watched = watching && pc != 0 && watchHit(debugger, cpu, instructionAt(cpu, pc));
+            tickComputer(cpu, false);
+            if (watched && cpu->status != CPU_FAULT) {
+                if (cpu->cycles >= timeline->due) { recordTimeline(timeline, cpu); }
+                return DEBUG_WATCHPOINT;
+            }
+        }
+        if (cpu->cycles >= timeline->due) { recordTimeline(timeline, cpu); }
+    }
+    return cpu->status == CPU_HALTED ? DEBUG_HALT : DEBUG_FAULT;
+}
+
+// TimelineStop for rcontinue: a breakpoint at PC or a watched access by the
+// instruction there
+bool debuggerStop(CPU* cpu, void* context) {
+    Debugger* debugger = context;
+    if (testAddress(debugger->breakpoints, cpu->PC)) {
+        debugger->hitAddress = cpu->PC;
+        debugger->hitMode = 0;
+        return true;
+    }
+    return watchHit(debugger, cpu, instructionAt(cpu, cpu->PC));
+}
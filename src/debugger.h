@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "emulator.h"
+#include "timeline.h"
+
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+// Watchpoint modes
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+
+enum DebugStop {
+    DEBUG_BREAKPOINT,
+    DEBUG_WATCHPOINT,
+    DEBUG_HALT,
+    DEBUG_FAULT
+}; typedef enum DebugStop DebugStop;
+
+// One bit per address for breakpoints and one for watchpoints, so the check
+// per instruction is a bit test on PC and on the address it accesses. The
+// mode of a watchpoint is only looked at once its bit is set, and without any
+// watchpoint continue skips the access check altogether.
+struct Debugger {
+    uint64_t breakpoints[RAM_SIZE / 64];
+    uint64_t watchpoints[RAM_SIZE / 64];
+    uint8_t watchModes[RAM_SIZE];
+    int watchCount;
+    uint16_t hitAddress;
+    uint8_t hitMode;
+}; typedef struct Debugger Debugger;
+
+static inline bool testAddress(const uint64_t *bitmap, uint16_t address) {
+    return (bitmap[address >> 6] >> (address & 63)) & 1;
+}
+
+static inline void setAddress(uint64_t *bitmap, uint16_t address, bool value) {
+    if (value) {
+        bitmap[address >> 6] |= 1ull << (address & 63);
+    } else {
+        bitmap[address >> 6] &= ~(1ull << (address & 63));
+    }
+}
+
+void setWatchpoint(Debugger *debugger, uint16_t address, uint8_t mode);
+
+DebugStop continueDebugger(Debugger *debugger, CPU *cpu, Timeline *timeline);
+
+bool debuggerStop(CPU *cpu, void *debugger);
+
+#endif
@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "snapshot.h"
+#include "image.h"
+#include "bus.h"
+#include "scheduler.h"
+#include "differential.h"
+#include "utils.h"
+
+// Runs the reference switch interpreter and a candidate engine side by side in
+// slices of interval cycles, comparing the architectural state after each one.
+// When a slice ends in disagreement both are rewound to the state after the
+// last slice that agreed and single stepped, so the report names the first
+// instruction whose result differs. The lockstep candidate is a single lane of
+// the sweep interpreter, whose vector paths are the same for every lane.
+//
+// With devices each CPU prints into its own buffer and reads the same input,
+// and the consoles are compared along with the state. Bus and scheduler state
+// cannot be rewound, so both runs are replayed from the start instead.
+
+struct FlagCheck {
+    const char* name;
+    bool (*flag)(const CPU*);
+}; typedef struct FlagCheck FlagCheck;
+
+static const FlagCheck flagChecks[] = {
+    { "zero", flagZero }, { "neg", flagNeg }, { "carry", flagCarry }, { "equ", flagEqu }, { "neq", flagNeq },
+    { "gr", flagGr }, { "ge", flagGe }, { "ls", flagLs }, { "le", flagLe }
+};
+
+static bool differs(Divergence* divergence, const char* field, uint32_t expected, uint32_t actual) {
+    if (expected == actual) { return false; }
+    divergence->field = field;
+    divergence->expected = expected;
+    divergence->actual = actual;
+    return true;
+}
+
+// Finds the first field that differs, in the order a reader would check them
+static bool findDifference(CPU* reference, CPU* candidate, Divergence* divergence) {
+    static const char* registerNames[4] = { "A", "X", "Y", "AX" };
+    divergence->cycle = reference->cycles;
+    if (differs(divergence, "status", reference->status, candidate->status)) { return true; }
+    if (differs(divergence, "cycles", (uint32_t)reference->cycles, (uint32_t)candidate->cycles)) { return true; }
+    if (differs(divergence, "PC", reference->PC, candidate->PC)) { return true; }
+    for (int reg = 0; reg < 4; reg++) {
+        if (differs(divergence, registerNames[reg], reference->regs[reg], candidate->regs[reg])) { return true; }
+    }
+    if (differs(divergence, "stackptr", reference->stackptr, candidate->stackptr)) { return true; }
+    if (reference->scheduler != NULL &&
+        differs(divergence, "next event", (uint32_t)reference->scheduler->next, (uint32_t)candidate->scheduler->next)) { return true; }
+    for (size_t i = 0; i < sizeof(flagChecks) / sizeof(flagChecks[0]); i++) {
+        if (differs(divergence, flagChecks[i].name, flagChecks[i].flag(reference), flagChecks[i].flag(candidate))) { return true; }
+    }
+    // A plain compare of both copies is cheaper than hashing them and exact
+    if (memcmp(reference->ram, candidate->ram, RAM_SIZE) == 0) { return false; }
+    int address = 0;
+    while (reference->ram[address] == candidate->ram[address]) { address++; }
+    divergence->address = (uint16_t)address;
+    divergence->expectedDigest = ramChecksum(reference);
+    divergence->actualDigest = ramChecksum(candidate);
+    return differs(divergence, "ram", (uint8_t)reference->ram[address], (uint8_t)candidate->ram[address]);
+}
+
+// The devices of one side of a run: its own console output, and the keyboard
+// input both sides read
+struct Console {
+    FILE* out;
+    FILE* in;
+    char* text;
+    size_t length;
+}; typedef struct Console Console;
+
+struct InputReader {
+    DeviceInput* input;
+    size_t position;
+}; typedef struct InputReader InputReader;
+
+// Hands out the shared input, pulling from stdin only once the reader is
+// ahead of every other one
+static ssize_t readInput(void* cookie, char* buffer, size_t size) {
+    InputReader* reader = cookie;
+    DeviceInput* input = reader->input;
+    if (reader->position == input->size && !input->ended) {
+        int c = getchar();
+        if (c == EOF) {
+            input->ended = true;
+        } else {
+            if (input->size == input->capacity) {
+                input->capacity = input->capacity ? input->capacity * 2 : 4096;
+                input->data = realloc(input->data, input->capacity);
+            }
+            input->data[input->size++] = (char)c;
+        }
+    }
+    size_t length = input->size - reader->position < size ? input->size - reader->position : size;
+    memcpy(buffer, input->data + reader->position, length);
+    reader->position += length;
+    return (ssize_t)length;
+}
+
+static int closeInput(void* cookie) {
+    free(cookie);
+    return 0;
+}
+
+static CPU* startRun(const char* ram, const DeviceInput* input, Console* console) {
+    CPU* cpu = initializeEmulator((char*)ram);
+    if (input != NULL) {
+        console->text = NULL;
+        console->out = open_memstream(&console->text, &console->length);
+        InputReader* reader = calloc(1, sizeof(InputReader));
+        reader->input = (DeviceInput*)input;
+        console->in = fopencookie(reader, "r", (cookie_io_functions_t){ .read = readInput, .close = closeInput });
+        setvbuf(console->in, NULL, _IONBF, 0);
+        attachDevices(cpu, console->out, console->in);
+    }
+    return cpu;
+}
+
+static void endRun(CPU* cpu, const DeviceInput* input, Console* console) {
+    freeEmulator(cpu);
+    if (input != NULL) {
+        fclose(console->out);
+        fclose(console->in);
+        free(console->text);
+    }
+}
+
+// Compares what both consoles printed so far
+static bool consoleDiffers(Console* reference, Console* candidate, Divergence* divergence) {
+    fflush(reference->out);
+    fflush(candidate->out);
+    size_t length = reference->length < candidate->length ? reference->length : candidate->length;
+    for (size_t i = 0; i < length; i++) {
+        if (differs(divergence, "console byte", (uint8_t)reference->text[i], (uint8_t)candidate->text[i])) { return true; }
+    }
+    return differs(divergence, "console length", (uint32_t)reference->length, (uint32_t)candidate->length);
+}
+
+static bool stateDiffers(CPU* reference, CPU* candidate, const DeviceInput* input, Console* consoles, Divergence* divergence) {
+    if (findDifference(reference, candidate, divergence)) { return true; }
+    return input != NULL && consoleDiffers(&consoles[0], &consoles[1], divergence);
+}
+
+static CPU* resumeAt(const char* ram, const char* state) {
+    CPU* cpu = initializeEmulator((char*)ram);
+    memcpy(cpu, state, SNAPSHOT_STATE_SIZE);
+    return cpu;
+}
+
+// Steps both from the state after the last agreement one instruction at a time
+static bool narrowDivergence(CPU* reference, CPU* subject, Engine candidate, uint64_t interval,
+                             const DeviceInput* input, Console* consoles, Divergence* divergence) {
+    bool found = false;
+    for (uint64_t step = 0; step <= interval && !found && reference->status == CPU_RUNNING; step++) {
+        // A reset is not a cycle, so it runs together with the first instruction
+        uint16_t pc = reference->PC == 0 ? loadWord(reference, 0) : reference->PC;
+        uint32_t code = (uint32_t)(uint8_t)reference->ram[pc] << 24 | (uint32_t)(uint8_t)reference->ram[(uint16_t)(pc + 1)] << 16 |
+                        (uint32_t)(uint8_t)reference->ram[(uint16_t)(pc + 2)] << 8 | (uint8_t)reference->ram[(uint16_t)(pc + 3)];
+        runEngine(reference, ENGINE_SWITCH, 1);
+        runEngine(subject, candidate, 1);
+        if (stateDiffers(reference, subject, input, consoles, divergence)) {
+            divergence->pc = pc;
+            divergence->instruction = parseBytes(code);
+            found = true;
+        }
+    }
+    return found;
+}
+
+static uint64_t sliceLength(const CPU* reference, uint64_t maxCycles, uint64_t interval) {
+    return maxCycles - reference->cycles < interval ? maxCycles - reference->cycles : interval;
+}
+
+// Returns true when the candidate agrees with the reference for the whole run.
+// input attaches devices reading it, NULL runs without.
+bool runDifferential(char* ram, Engine candidate, uint64_t maxCycles, uint64_t interval, const DeviceInput* input,
+                     Divergence* divergence) {
+    Console consoles[2];
+    CPU* reference = startRun(ram, input, &consoles[0]);
+    CPU* subject = startRun(ram, input, &consoles[1]);
+    char* agreedRam = malloc(RAM_SIZE);
+    char referenceState[SNAPSHOT_STATE_SIZE];
+    char candidateState[SNAPSHOT_STATE_SIZE];
+    memcpy(agreedRam, ram, RAM_SIZE);
+    memcpy(referenceState, reference, SNAPSHOT_STATE_SIZE);
+    memcpy(candidateState, subject, SNAPSHOT_STATE_SIZE);
+
+    bool agreed = true;
+    uint64_t slices = 0;
+    while (reference->status == CPU_RUNNING && reference->cycles < maxCycles) {
+        uint64_t slice = sliceLength(reference, maxCycles, interval);
+        runEngine(reference, ENGINE_SWITCH, slice);
+        runEngine(subject, candidate, slice);
+        if (stateDiffers(reference, subject, input, consoles, divergence)) {
+            agreed = false;
+            // Reported as is should the replay not reproduce it
+            divergence->pc = 0;
+            divergence->instruction = (Instruction){0};
+            Divergence replayed = *divergence;
+            Console replayConsoles[2];
+            CPU* replayReference;
+            CPU* replaySubject;
+            if (input == NULL) {
+                replayReference = resumeAt(agreedRam, referenceState);
+                replaySubject = resumeAt(agreedRam, candidateState);
+            } else {
+                replayReference = startRun(ram, input, &replayConsoles[0]);
+                replaySubject = startRun(ram, input, &replayConsoles[1]);
+                for (uint64_t i = 0; i < slices; i++) {
+                    uint64_t length = sliceLength(replayReference, maxCycles, interval);
+                    runEngine(replayReference, ENGINE_SWITCH, length);
+                    runEngine(replaySubject, candidate, length);
+                }
+            }
+            if (narrowDivergence(replayReference, replaySubject, candidate, slice, input, replayConsoles, &replayed)) {
+                *divergence = replayed;
+            }
+            endRun(replayReference, input, &replayConsoles[0]);
+            endRun(replaySubject, input, &replayConsoles[1]);
+            break;
+        }
+        slices++;
+        if (input == NULL) {
+            memcpy(agreedRam, reference->ram, RAM_SIZE);
+            memcpy(referenceState, reference, SNAPSHOT_STATE_SIZE);
+            memcpy(candidateState, subject, SNAPSHOT_STATE_SIZE);
+        }
+    }
+    free(agreedRam);
+    endRun(reference, input, &consoles[0]);
+    endRun(subject, input, &consoles[1]);
+    return agreed;
+}
+
+void printDivergence(FILE* out, const Divergence* divergence, Engine candidate) {
+    fprintf(out, HI_RED "%s diverges from switch at cycle %llu", engineName(candidate), (unsigned long long)divergence->cycle);
+    // Instructions never execute at 0, so pc 0 means the replay found nothing
+    if (divergence->pc != 0) {
+        char text[64];
+        disassemble(&divergence->instruction, text, sizeof(text));
+        fprintf(out, " after $%04X: %s", divergence->pc, text);
+    }
+    fprintf(out, "\n");
+    if (strcmp(divergence->field, "ram") == 0) {
+        fprintf(out, "   ram[$%04X] - expected $%02X, got $%02X (digest %08X vs %08X)\n" COL_RESET, divergence->address,
+            divergence->expected, divergence->actual, divergence->expectedDigest, divergence->actualDigest);
+    } else {
+        fprintf(out, "   %s - expected %u, got %u\n" COL_RESET, divergence->field, divergence->expected, divergence->actual);
+    }
+}
+
+static uint32_t nextRandom(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Random program of length instructions at 0xA000 over the whole Instructions
+// enum plus one invalid opcode. Jumps and calls land on instructions, and a
+// third of the other addresses point into the program so stores rewrite code.
+void generateProgram(char* ram, uint32_t seed, int length) {
+    uint32_t state = seed * 2654435761u + 1;
+    if (state == 0) { state = 1; }
+    const uint16_t origin = 0xA000;
+    memset(ram, 0, RAM_SIZE);
+    ram[0] = (char)(origin >> 8);
+    ram[1] = (char)(origin & 0xFF);
+    for (int i = 0; i < length; i++) {
+        int opId = (int)(nextRandom(&state) % (HLT + 2));
+        // Branches are what the faster engines treat specially, so favour them
+        if (nextRandom(&state) % 4 == 0) { opId = JZ_A + (int)(nextRandom(&state) % (JGE_A - JZ_A + 1)); }
+        uint16_t data;
+        if ((opId >= JZ_A && opId <= JGE_A) || opId == CALL_A) {
+            data = (uint16_t)(origin + 4 * (nextRandom(&state) % length));
+        } else if (nextRandom(&state) % 3 == 0) {
+            data = (uint16_t)(origin + nextRandom(&state) % (4 * length));
+        } else {
+            data = (uint16_t)nextRandom(&state);
+        }
+        if (nextRandom(&state) % 20 == 0) { data = 0xFFFF; }
+        char* word = ram + origin + 4 * i;
+        word[0] = (char)(nextRandom(&state) & 0x3F);
+        word[1] = (char)opId;
+        word[2] = (char)(data >> 8);
+        word[3] = (char)(data & 0xFF);
+    }
+}
+
+// --diff: checks one image against the candidate, or every faster engine when
+// the candidate is the reference itself
+int runDiff(char* ram, Engine engine, uint64_t maxCycles, uint64_t interval, bool devices) {
+    DeviceInput* input = devices ? calloc(1, sizeof(DeviceInput)) : NULL;
+    int status = EXIT_SUCCESS;
+    for (int candidate = ENGINE_THREADED; candidate <= ENGINE_LOCKSTEP; candidate++) {
+        if (engine != ENGINE_SWITCH && candidate != (int)engine) { continue; }
+        if (devices && candidate == ENGINE_LOCKSTEP) {
+            printf(HI_YELLOW "lockstep skipped, sweeps run without devices\n" COL_RESET);
+            continue;
+        }
+        Divergence divergence;
+        if (runDifferential(ram, (Engine)candidate, maxCycles, interval, input, &divergence)) {
+            printf(HI_GREEN "%s matches switch\n" COL_RESET, engineName((Engine)candidate));
+        } else {
+            printDivergence(stdout, &divergence, (Engine)candidate);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (input != NULL) {
+        free(input->data);
+        free(input);
+    }
+    return status;
+}
+
+static void printFuzzUsage() {
+    printf(HI_YELLOW
+        "Usage: lol16 fuzz [--engine threaded|jit|lockstep] [--iterations N] [--seed N] [--length N] [--max-cycles N]\n"
+        "                  [--interval N] [--save image]\n"
+        COL_RESET);
+}
+
+static bool parseFuzzCount(const char* string, uint64_t* count) {
+    char* end;
+    *count = strtoull(string, &end, 0);
+    return *end == '\0' && end != string && string[0] != '-' && *count > 0;
+}
+
+// lol16 fuzz: random programs through runDifferential until one diverges.
+// Iteration i uses seed + i, so a failure is replayed with --seed and
+// --iterations 1, and --save writes the failing program out as an image.
+int runFuzzTool(int argc, char const* argv[]) {
+    Engine engine = ENGINE_SWITCH;
+    uint64_t iterations = 1000, seed = 1, length = FUZZ_DEFAULT_LENGTH;
+    uint64_t maxCycles = FUZZ_DEFAULT_CYCLES, interval = FUZZ_DEFAULT_INTERVAL;
+    const char* savePath = NULL;
+    for (int i = 2; i < argc; i++) {
+        bool valid = i + 1 < argc;
+        if (valid && strcmp(argv[i], "--engine") == 0) {
+            valid = parseEngine(argv[++i], &engine);
+        } else if (valid && strcmp(argv[i], "--iterations") == 0) {
+            valid = parseFuzzCount(argv[++i], &iterations);
+        } else if (valid && strcmp(argv[i], "--seed") == 0) {
+            valid = parseFuzzCount(argv[++i], &seed);
+        } else if (valid && strcmp(argv[i], "--length") == 0) {
+            valid = parseFuzzCount(argv[++i], &length) && length <= (RAM_SIZE - 0xA000) / 4;
+        } else if (valid && strcmp(argv[i], "--max-cycles") == 0) {
+            valid = parseFuzzCount(argv[++i], &maxCycles);
+        } else if (valid && strcmp(argv[i], "--interval") == 0) {
+            valid = parseFuzzCount(argv[++i], &interval);
+        } else if (valid && strcmp(argv[i], "--save") == 0) {
+            savePath = argv[++i];
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            printFuzzUsage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    char* ram = malloc(RAM_SIZE);
+    uint64_t runs = 0, halted = 0, faulted = 0;
+    int status = EXIT_SUCCESS;
+    for (uint64_t i = 0; i < iterations && status == EXIT_SUCCESS; i++) {
+        uint32_t programSeed = (uint32_t)(seed + i);
+        generateProgram(ram, programSeed, (int)length);
+        for (int candidate = ENGINE_THREADED; candidate <= ENGINE_LOCKSTEP; candidate++) {
+            if (engine != ENGINE_SWITCH && candidate != (int)engine) { continue; }
+            Divergence divergence;
+            if (runDifferential(ram, (Engine)candidate, maxCycles, interval, NULL, &divergence)) { continue; }
+            printf(HI_RED "Iteration %llu (seed %u): " COL_RESET, (unsigned long long)i, programSeed);
+            printDivergence(stdout, &divergence, (Engine)candidate);
+            if (savePath != NULL && writeImageFile(savePath, ram) == EXIT_SUCCESS) {
+                printf(HI_YELLOW "Program saved to %s\n" COL_RESET, savePath);
+            }
+            status = EXIT_FAILURE;
+            break;
+        }
+        // How the reference run ended, to show what the programs exercise
+        CPU* cpu = initializeEmulator(ram);
+        runEmulator(cpu, maxCycles);
+        runs++;
+        halted += cpu->status == CPU_HALTED;
+        faulted += cpu->status == CPU_FAULT;
+        freeEmulator(cpu);
+    }
+    free(ram);
+    printf("%s%llu programs, %llu halted, %llu faulted, %llu hit the cycle limit\n" COL_RESET,
+        status == EXIT_SUCCESS ? HI_GREEN : HI_RED, (unsigned long long)runs, (unsigned long long)halted,
+        (unsigned long long)faulted, (unsigned long long)(runs - halted - faulted));
+    return status;
+}
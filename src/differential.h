@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "emulator.h"
+
+#ifndef DIFFERENTIAL_H
+#define DIFFERENTIAL_H
+
+#define DIFFERENTIAL_DEFAULT_INTERVAL 10000
+#define FUZZ_DEFAULT_LENGTH 96
+#define FUZZ_DEFAULT_CYCLES 5000
+#define FUZZ_DEFAULT_INTERVAL 64
+
+// The first state at which a candidate engine disagrees with the reference.
+// instruction is the one executed at pc to get there; address is only set
+// when field is "ram".
+struct Divergence {
+    uint64_t cycle;
+    uint16_t pc;
+    Instruction instruction;
+    const char *field;
+    uint32_t expected;
+    uint32_t actual;
+    uint16_t address;
+    uint32_t expectedDigest;
+    uint32_t actualDigest;
+}; typedef struct Divergence Divergence;
+
+// Keyboard input of a run with devices, read from stdin as the CPUs ask for
+// it and replayed to every one of them
+struct DeviceInput {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool ended;
+}; typedef struct DeviceInput DeviceInput;
+
+bool runDifferential(char *ram, Engine candidate, uint64_t maxCycles, uint64_t interval, const DeviceInput *input,
+                     Divergence *divergence);
+
+void printDivergence(FILE *out, const Divergence *divergence, Engine candidate);
+
+void generateProgram(char *ram, uint32_t seed, int length);
+
+int runDiff(char *ram, Engine engine, uint64_t maxCycles, uint64_t interval, bool devices);
+
+int runFuzzTool(int argc, char const *argv[]);
+
+#endif
@@ -3,18 +3,43 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <math.h>
 #include "emulator.h"
+#include "threaded.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "scheduler.h"
 #include "utils.h"
 
+_Static_assert(offsetof(CPU, codePages) <= 64, "hot CPU state must fit in one cache line");
+
 CPU* initializeEmulator(char* ram) {
-    CPU* cpu = malloc(sizeof(CPU));
+    CPU* cpu = aligned_alloc(64, sizeof(CPU));
     memset(cpu, 0, sizeof(CPU));
-    memcpy(cpu->ram, ram, sizeof(cpu->ram));
+    cpu->ram = aligned_alloc(RAM_PAGE_ALIGNMENT, RAM_SIZE + RAM_PAGE_ALIGNMENT);
+    memset(cpu->ram + RAM_SIZE, 0, RAM_PAGE_ALIGNMENT);
+    // Without ram the caller fills cpu->ram itself, as loadRAMFile does
+    if (ram != NULL) {
+        memcpy(cpu->ram, ram, RAM_SIZE);
+        cpu->ram[RAM_SIZE] = cpu->ram[0];
+    }
     cpu->PC = 0;
+    cpu->decoded = calloc(65536, sizeof(DecodedInstruction));
+    cpu->log = stdout;
     return cpu;
 }
 
+void freeEmulator(CPU* cpu) {
+    free(cpu->decoded);
+    free(cpu->threaded);
+    freeJit(cpu);
+    free(cpu->bus);
+    freeScheduler(cpu->scheduler);
+    free(cpu->ram);
+    free(cpu);
+}
+
 Instruction parseBytes(uint32_t data) {
     Instruction instruction = {0};
     char regs = (data >> 24) & 0xFF;
@@ -28,38 +53,37 @@ Instruction parseBytes(uint32_t data) {
     return instruction;
 }
 
-uint16_t getRegister(Register reg, CPU* cpu) {
-    switch (reg) {
-        case REG_A:
-            return cpu->regA;
-        case REG_X:
-            return cpu->regX;
-        case REG_Y:
-            return cpu->regY;
-        case REG_AX:
-            return cpu->regAX;
-    }
-    return 0;
+static inline uint16_t getRegister(Register reg, CPU* cpu) {
+    return cpu->regs[reg];
 }
-void setRegister(Register reg, uint16_t value, CPU* cpu) {
-    switch (reg) {
-        case REG_A:
-            cpu->regA = value;
-            break;
-        case REG_X:
-            cpu->regX = value;
-            break;
-        case REG_Y:
-            cpu->regY = value;
-            break;
-        case REG_AX:
-            cpu->regAX = value;
-            break;
+static inline void setRegister(Register reg, uint16_t value, CPU* cpu) {
+    cpu->regs[reg] = value;
+}
+
+// Drops every predecoded instruction overlapping [address, address+length)
+void invalidateCode(CPU* cpu, uint16_t address, uint16_t length) {
+    for (uint16_t i = 0; i < length + 3; i++) {
+        cpu->decoded[(uint16_t)(address - 3 + i)].valid = false;
     }
+    if (cpu->threaded != NULL) { invalidateThreaded(cpu, address, length); }
+    if (cpu->jit != NULL) { invalidateJit(cpu, address, length); }
+}
+
+DecodedInstruction* decodeAt(CPU* cpu, uint16_t address) {
+    uint32_t bytes = ((uint32_t)cpu->ram[address                ] & 0xFF)<<24 |
+                     ((uint32_t)cpu->ram[(uint16_t)(address + 1)] & 0xFF)<<16 |
+                     ((uint32_t)cpu->ram[(uint16_t)(address + 2)] & 0xFF)<<8  |
+                     ((uint32_t)cpu->ram[(uint16_t)(address + 3)] & 0xFF);
+    DecodedInstruction* decoded = &cpu->decoded[address];
+    decoded->instruction = parseBytes(bytes);
+    decoded->valid = true;
+    cpu->codePages[address>>8] = true;
+    cpu->codePages[(uint16_t)(address + 3)>>8] = true;
+    return decoded;
 }
 
 void printCPUState(CPU* cpu) {
-    printf(
+    fprintf(cpu->log,
         HI_GREEN 
         "\n"
         "   |- A - %u\n"
@@ -75,38 +99,172 @@ void printCPUState(CPU* cpu) {
         "   |- ge - %u\n"
         "   |- ls - %u\n"
         "   |- le - %u\n"
-        "   \\- stackptr - %u\n"
-        COL_RESET, cpu->regA, cpu->regX, cpu->regY, cpu->regAX, cpu->PC,
-        cpu->zero, cpu->neg, cpu->equ, cpu->neq, cpu->gr, cpu->ge, cpu->ls, cpu->le, cpu->stackptr
+        "   |- carry - %u\n"
+        "   |- stackptr - %u\n"
+        "   \\- cycles - %llu\n"
+        COL_RESET, cpu->regs[REG_A], cpu->regs[REG_X], cpu->regs[REG_Y], cpu->regs[REG_AX], cpu->PC,
+        flagZero(cpu), flagNeg(cpu), flagEqu(cpu), flagNeq(cpu), flagGr(cpu), flagGe(cpu), flagLs(cpu), flagLe(cpu), flagCarry(cpu),
+        cpu->stackptr, (unsigned long long)cpu->cycles
     );
 }
 
 void tickComputer(CPU* cpu, bool verbose) {
+    if (cpu->status != CPU_RUNNING) { return; }
     if (cpu->PC == 0) {
-        cpu->PC = ((uint16_t)cpu->ram[0]<<8) | ((uint16_t)cpu->ram[1]);
+        cpu->PC = loadWord(cpu, 0);
         cpu->stackptr = cpu->PC - 1;
-        printf(HI_YELLOW "\nCPU: " COL_RESET);
-        printCPUState(cpu);
-        printf("\n");
+        if (cpu->PC == 0) { cpu->status = CPU_FAULT; }
+        if (verbose) { fprintf(cpu->log, HI_YELLOW "\nCPU: " COL_RESET); }
+        if (verbose) { printCPUState(cpu); }
+        if (verbose) { fprintf(cpu->log, "\n"); }
         return;
     }
-    uint32_t bytes = ((uint32_t)cpu->ram[cpu->PC  ] & 0xFF)<<24 |
-                     ((uint32_t)cpu->ram[cpu->PC+1] & 0xFF)<<16 |
-                     ((uint32_t)cpu->ram[cpu->PC+2] & 0xFF)<<8  |
-                     ((uint32_t)cpu->ram[cpu->PC+3] & 0xFF);
-    Instruction instruction = parseBytes(bytes);
-    if (verbose) { printInstructionStruct(&instruction); }
+    DecodedInstruction* decoded = &cpu->decoded[cpu->PC];
+    if (!decoded->valid) { decoded = decodeAt(cpu, cpu->PC); }
+    Instruction instruction = decoded->instruction;
+    if (verbose) { printInstructionStruct(cpu->log, &instruction); }
     cpu->PC += 4;
     executeInstruction(instruction, cpu, verbose);
+    if (cpu->status == CPU_FAULT) {
+        cpu->PC -= 4;
+        return;
+    }
+    cpu->cycles++;
+}
+
+StopReason stopReason(CPU* cpu) {
+    switch (cpu->status) {
+        case CPU_HALTED:
+            return STOP_HALT;
+        case CPU_FAULT:
+            return STOP_FAULT;
+        default:
+            return STOP_CYCLE_LIMIT;
+    }
+}
+
+StopReason runEmulator(CPU* cpu, uint64_t maxCycles) {
+    cpu->limit = maxCycles > UINT64_MAX - cpu->cycles ? UINT64_MAX : cpu->cycles + maxCycles;
+    while (cpu->status == CPU_RUNNING && cpu->cycles < cpu->limit) {
+        tickComputer(cpu, false);
+    }
+    return stopReason(cpu);
+}
+
+static StopReason runBatch(CPU* cpu, Engine engine, uint64_t maxCycles) {
+    switch (engine) {
+        case ENGINE_THREADED:
+            return runThreaded(cpu, maxCycles);
+        case ENGINE_JIT:
+            return runJit(cpu, maxCycles);
+        case ENGINE_LOCKSTEP:
+            runLockstep(&cpu, 1, maxCycles);
+            return stopReason(cpu);
+        default:
+            return runEmulator(cpu, maxCycles);
+    }
+}
+
+// Runs the engine in batches up to the next event, so the engines themselves
+// never look at the scheduler
+StopReason runEngine(CPU* cpu, Engine engine, uint64_t maxCycles) {
+    Scheduler* scheduler = cpu->scheduler;
+    if (scheduler == NULL) { return runBatch(cpu, engine, maxCycles); }
+    uint64_t limit = maxCycles > UINT64_MAX - cpu->cycles ? UINT64_MAX : cpu->cycles + maxCycles;
+    while (cpu->status == CPU_RUNNING && cpu->cycles < limit) {
+        if (scheduler->next <= cpu->cycles) {
+            runEvents(cpu);
+            continue;
+        }
+        uint64_t deadline = scheduler->next < limit ? scheduler->next : limit;
+        runBatch(cpu, engine, deadline - cpu->cycles);
+    }
+    return stopReason(cpu);
+}
+
+bool parseEngine(const char* name, Engine* engine) {
+    if (strcmp(name, "switch") == 0) {
+        *engine = ENGINE_SWITCH;
+    } else if (strcmp(name, "threaded") == 0) {
+        *engine = ENGINE_THREADED;
+    } else if (strcmp(name, "jit") == 0) {
+        *engine = ENGINE_JIT;
+    } else if (strcmp(name, "lockstep") == 0) {
+        *engine = ENGINE_LOCKSTEP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* engineName(Engine engine) {
+    switch (engine) {
+        case ENGINE_SWITCH:
+            return "switch";
+        case ENGINE_THREADED:
+            return "threaded";
+        case ENGINE_JIT:
+            return "jit";
+        case ENGINE_LOCKSTEP:
+            return "lockstep";
+    }
+    return "unknown";
+}
+
+// FNV-1a over the whole address space, used to compare final memory between runs
+uint32_t ramChecksum(CPU* cpu) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < RAM_SIZE; i++) {
+        hash = (hash ^ (uint8_t)cpu->ram[i]) * 16777619u;
+    }
+    return hash;
+}
+
+const char* stopReasonName(StopReason reason) {
+    switch (reason) {
+        case STOP_HALT:
+            return "halted";
+        case STOP_CYCLE_LIMIT:
+            return "cycle limit reached";
+        case STOP_FAULT:
+            return "fault";
+    }
+    return "unknown";
 }
 
 void compare(uint16_t num1, uint16_t num2, CPU* cpu) {
-    cpu->equ = (num1 == num2);
-    cpu->neq = (num1 != num2);
-    cpu->gr = (num1 > num2);
-    cpu->ge = (num1 >= num2);
-    cpu->ls = (num1 < num2);
-    cpu->le = (num1 <= num2);
+    cpu->cmpLhs = num1;
+    cpu->cmpRhs = num2;
+    cpu->flags = (cpu->flags & ~FLAGS_CMP_MASK) | (FLAGS_UNSIGNED << FLAGS_CMP_SHIFT);
+}
+
+// Records a 32 bit intermediate result for zero/neg/carry and returns the 16 bit result
+uint16_t arithmetic(uint32_t result, CPU* cpu) {
+    cpu->aluResult = result;
+    cpu->flags = (cpu->flags & ~FLAGS_ALU_MASK) | FLAGS_UNSIGNED;
+    return (uint16_t)result;
+}
+
+uint16_t signedArithmetic(int32_t result, CPU* cpu) {
+    cpu->aluResult = (uint32_t)result;
+    cpu->flags = (cpu->flags & ~FLAGS_ALU_MASK) | FLAGS_SIGNED;
+    return (uint16_t)result;
+}
+
+void divide(uint16_t num1, uint16_t num2, Register dest, CPU* cpu) {
+    if (num2 == 0) {
+        cpu->status = CPU_FAULT;
+        return;
+    }
+    setRegister(dest, arithmetic(num1 / num2, cpu), cpu);
+}
+
+void signedDivide(uint16_t num1, uint16_t num2, Register dest, CPU* cpu) {
+    if (num2 == 0 || ((int16_t)num1 == INT16_MIN && (int16_t)num2 == -1)) {
+        cpu->status = CPU_FAULT;
+        return;
+    }
+    setRegister(dest, signedArithmetic((int16_t)num1 / (int16_t)num2, cpu), cpu);
 }
 
 void executeInstruction(Instruction instruction, CPU* cpu, bool verbose) {
@@ -117,52 +275,46 @@ void executeInstruction(Instruction instruction, CPU* cpu, bool verbose) {
     uint16_t address = instruction.data;
     switch (instruction.opId) {
         case MOV_R_R: 
-            setRegister(getRegister(r2, cpu), r1, cpu);
+            setRegister(r1, getRegister(r2, cpu), cpu);
             break;
         case MOV_R_V:
             setRegister(r1, value, cpu);
             break;
         case MOV_R_A:
-            setRegister(r1, ((uint16_t)cpu->ram[address])<<8 | (uint16_t)cpu->ram[address+1], cpu);
+            setRegister(r1, loadWord(cpu, address), cpu);
             break;
         case MOV_A_R:
-            cpu->ram[address] = highByte(getRegister(r1, cpu));
-            cpu->ram[address+1] = lowByte(getRegister(r1, cpu));
+            storeWord(cpu, address, getRegister(r1, cpu));
             break;
         case MOV_AR_R:
-            cpu->ram[getRegister(r1, cpu)+1] = lowByte(getRegister(r2, cpu));
-            cpu->ram[getRegister(r1, cpu)] = highByte(getRegister(r2, cpu));
+            storeWord(cpu, getRegister(r1, cpu), getRegister(r2, cpu));
             break;
         case MOV_AR_V:
-            cpu->ram[getRegister(r1, cpu)+1] = lowByte(value);
-            cpu->ram[getRegister(r1, cpu)] = highByte(value);
+            storeWord(cpu, getRegister(r1, cpu), value);
             break;
         case MOV_R_AR:
-            setRegister(r1, cpu->ram[getRegister(r2, cpu)+1] + (cpu->ram[getRegister(r2, cpu)]<<8), cpu);
+            setRegister(r1, loadWord(cpu, getRegister(r2, cpu)), cpu);
             break;
         case PUSH_R:
-            cpu->ram[cpu->stackptr-1] = highByte(r1);
-            cpu->ram[cpu->stackptr] = lowByte(r1);
+            storeWord(cpu, cpu->stackptr - 1, getRegister(r1, cpu));
             cpu->stackptr -= 2;
             break;
         case PUSH_V:
-            cpu->ram[cpu->stackptr-1] = highByte(value);
-            cpu->ram[cpu->stackptr] = lowByte(value);
+            storeWord(cpu, cpu->stackptr - 1, value);
             cpu->stackptr -= 2;
             break;
         case POP_R:
             cpu->stackptr += 2;
-            setRegister(r1, cpu->ram[cpu->stackptr] + (cpu->ram[cpu->stackptr-1]<<8), cpu);
+            setRegister(r1, loadWord(cpu, cpu->stackptr - 1), cpu);
             break;
         case CALL_A:
-            cpu->ram[cpu->stackptr-1] = highByte(cpu->PC);
-            cpu->ram[cpu->stackptr] = lowByte(cpu->PC);
+            storeWord(cpu, cpu->stackptr - 1, cpu->PC);
             cpu->stackptr -= 2;
             cpu->PC = address;
             break;
         case RET:
             cpu->stackptr += 2;
-            cpu->PC = cpu->ram[cpu->stackptr] | (cpu->ram[cpu->stackptr-1]<<8);
+            cpu->PC = loadWord(cpu, cpu->stackptr - 1);
             break;
         case CMP_R_V:
             compare(getRegister(r1, cpu), value, cpu);
@@ -173,9 +325,110 @@ void executeInstruction(Instruction instruction, CPU* cpu, bool verbose) {
         case CMP_R_R:
             compare(getRegister(r1, cpu), getRegister(r2, cpu), cpu);
             break;
-        
+        case JZ_A:
+            if (flagZero(cpu)) { cpu->PC = address; }
+            break;
+        case JNZ_A:
+            if (!flagZero(cpu)) { cpu->PC = address; }
+            break;
+        case JN_A:
+            if (flagNeg(cpu)) { cpu->PC = address; }
+            break;
+        case JNN_A:
+            if (!flagNeg(cpu)) { cpu->PC = address; }
+            break;
+        case JMP_A:
+            cpu->PC = address;
+            break;
+        case JE_A:
+            if (flagEqu(cpu)) { cpu->PC = address; }
+            break;
+        case JNE_A:
+            if (flagNeq(cpu)) { cpu->PC = address; }
+            break;
+        case JL_A:
+            if (flagLs(cpu)) { cpu->PC = address; }
+            break;
+        case JLE_A:
+            if (flagLe(cpu)) { cpu->PC = address; }
+            break;
+        case JG_A:
+            if (flagGr(cpu)) { cpu->PC = address; }
+            break;
+        case JGE_A:
+            if (flagGe(cpu)) { cpu->PC = address; }
+            break;
+        case ADD_R_V_R:
+            setRegister(r2, arithmetic((uint32_t)getRegister(r1, cpu) + value, cpu), cpu);
+            break;
+        case ADD_R_R_R:
+            setRegister(r3, arithmetic((uint32_t)getRegister(r1, cpu) + getRegister(r2, cpu), cpu), cpu);
+            break;
+        case ADC_R_V_R:
+            setRegister(r2, arithmetic((uint32_t)getRegister(r1, cpu) + value + flagCarry(cpu), cpu), cpu);
+            break;
+        case ADC_R_R_R:
+            setRegister(r3, arithmetic((uint32_t)getRegister(r1, cpu) + getRegister(r2, cpu) + flagCarry(cpu), cpu), cpu);
+            break;
+        case SUB_R_V_R:
+            setRegister(r2, arithmetic((uint32_t)getRegister(r1, cpu) - value, cpu), cpu);
+            break;
+        case SUB_V_R_R:
+            setRegister(r2, arithmetic((uint32_t)value - getRegister(r1, cpu), cpu), cpu);
+            break;
+        case SUB_R_R_R:
+            setRegister(r3, arithmetic((uint32_t)getRegister(r1, cpu) - getRegister(r2, cpu), cpu), cpu);
+            break;
+        case SBB_R_V_R:
+            setRegister(r2, arithmetic((uint32_t)getRegister(r1, cpu) - value - flagCarry(cpu), cpu), cpu);
+            break;
+        case SBB_V_R_R:
+            setRegister(r2, arithmetic((uint32_t)value - getRegister(r1, cpu) - flagCarry(cpu), cpu), cpu);
+            break;
+        case SBB_R_R_R:
+            setRegister(r3, arithmetic((uint32_t)getRegister(r1, cpu) - getRegister(r2, cpu) - flagCarry(cpu), cpu), cpu);
+            break;
+        case MUL_R_V_R:
+            setRegister(r2, arithmetic((uint32_t)getRegister(r1, cpu) * value, cpu), cpu);
+            break;
+        case MUL_R_R_R:
+            setRegister(r3, arithmetic((uint32_t)getRegister(r1, cpu) * getRegister(r2, cpu), cpu), cpu);
+            break;
+        case IMUL_R_V_R:
+            setRegister(r2, signedArithmetic((int16_t)getRegister(r1, cpu) * (int16_t)value, cpu), cpu);
+            break;
+        case IMUL_R_R_R:
+            setRegister(r3, signedArithmetic((int16_t)getRegister(r1, cpu) * (int16_t)getRegister(r2, cpu), cpu), cpu);
+            break;
+        case DIV_R_V_R:
+            divide(getRegister(r1, cpu), value, r2, cpu);
+            break;
+        case DIV_V_R_R:
+            divide(value, getRegister(r1, cpu), r2, cpu);
+            break;
+        case DIV_R_R_R:
+            divide(getRegister(r1, cpu), getRegister(r2, cpu), r3, cpu);
+            break;
+        case IDIV_R_V_R:
+            signedDivide(getRegister(r1, cpu), value, r2, cpu);
+            break;
+        case IDIV_V_R_R:
+            signedDivide(value, getRegister(r1, cpu), r2, cpu);
+            break;
+        case IDIV_R_R_R:
+            signedDivide(getRegister(r1, cpu), getRegister(r2, cpu), r3, cpu);
+            break;
+        case PASS_R:
+            arithmetic(getRegister(r1, cpu), cpu);
+            break;
+        case HLT:
+            cpu->status = CPU_HALTED;
+            break;
+        default:
+            cpu->status = CPU_FAULT;
+            break;
     }
-    if (verbose) { printf(HI_YELLOW "\nCPU: " COL_RESET); }
+    if (verbose) { fprintf(cpu->log, HI_YELLOW "\nCPU: " COL_RESET); }
     if (verbose) { printCPUState(cpu); }
-    if (verbose) { printf("\n"); }
+    if (verbose) { fprintf(cpu->log, "\n"); }
 }
\ No newline at end of file
@@ -1,30 +1,174 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include "utils.h"
 
 #ifndef EMULATOR_H
 #define EMULATOR_H
 
+#define RAM_SIZE 65536
+// RAM is page aligned and over-allocated so a 16 bit access at 0xFFFF stays in
+// bounds; ram[RAM_SIZE] always mirrors ram[0]
+#define RAM_PAGE_ALIGNMENT 4096
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define guestToHost16(x) (x)
+#else
+#define guestToHost16(x) __builtin_bswap16(x)
+#endif
+
+enum CPUStatus {
+    CPU_RUNNING,
+    CPU_HALTED,
+    CPU_FAULT
+}; typedef enum CPUStatus CPUStatus;
+
+enum StopReason {
+    STOP_HALT,
+    STOP_CYCLE_LIMIT,
+    STOP_FAULT
+}; typedef enum StopReason StopReason;
+
+// One predecoded entry per possible PC, filled on first execution
+struct DecodedInstruction {
+    Instruction instruction;
+    bool valid;
+}; typedef struct DecodedInstruction DecodedInstruction;
+
+// Flags are not stored, only the last ALU result and the last compared operands.
+// The predicates below derive a flag when a jump or the state dump asks for it.
+// The kind of each record is packed into the CPU flags byte.
+enum FlagKind {
+    FLAGS_NONE,
+    FLAGS_UNSIGNED,
+    FLAGS_SIGNED
+}; typedef enum FlagKind FlagKind;
+
+#define FLAGS_ALU_MASK 0x03
+#define FLAGS_CMP_SHIFT 2
+#define FLAGS_CMP_MASK 0x0C
+
+enum Engine {
+    ENGINE_SWITCH,
+    ENGINE_THREADED,
+    ENGINE_JIT,
+    // A single lane of the sweep interpreter, so --diff can check it
+    ENGINE_LOCKSTEP
+}; typedef enum Engine Engine;
+
+struct ThreadedInstruction;
+struct JitState;
+struct Bus;
+struct Scheduler;
+
+// Everything the interpreter touches per instruction lives in the first cache line
 struct CPU {
-    uint16_t regA;
-    uint16_t regX;
-    uint16_t regY;
-    uint16_t regAX;
+    uint16_t regs[4];
     uint16_t PC;
-    bool zero;
-    bool neg;
-    bool equ;
-    bool neq;
-    bool gr;
-    bool ge;
-    bool ls;
-    bool le;
-    char ram[65536];
     uint16_t stackptr;
-}; typedef struct CPU CPU;
+    uint16_t cmpLhs;
+    uint16_t cmpRhs;
+    uint32_t aluResult;
+    uint8_t flags;
+    CPUStatus status;
+    uint64_t cycles;
+    // Where the running engine stops; scheduleEvent lowers it
+    uint64_t limit;
+    char *ram;
+    bool codePages[256];
+    // One bit per 256 byte page written since the last snapshot
+    uint64_t dirtyPages[4];
+    DecodedInstruction *decoded;
+    struct ThreadedInstruction *threaded;
+    struct JitState *jit;
+    FILE *log;
+    struct Bus *bus;
+    // Nonzero for pages loads and stores must route through the bus
+    uint8_t busPages[256];
+    struct Scheduler *scheduler;
+} __attribute__((aligned(64))); typedef struct CPU CPU;
+
+static inline FlagKind aluKind(const CPU *cpu) {
+    return cpu->flags & FLAGS_ALU_MASK;
+}
+
+static inline FlagKind cmpKind(const CPU *cpu) {
+    return (cpu->flags & FLAGS_CMP_MASK) >> FLAGS_CMP_SHIFT;
+}
+
+static inline bool flagZero(const CPU *cpu) {
+    return aluKind(cpu) != FLAGS_NONE && (cpu->aluResult & 0xFFFF) == 0;
+}
+
+static inline bool flagNeg(const CPU *cpu) {
+    return aluKind(cpu) != FLAGS_NONE && (cpu->aluResult & 0x8000) != 0;
+}
+
+static inline bool flagCarry(const CPU *cpu) {
+    switch (aluKind(cpu)) {
+        case FLAGS_UNSIGNED:
+            return cpu->aluResult > 0xFFFF;
+        case FLAGS_SIGNED:
+            return (int32_t)cpu->aluResult < INT16_MIN || (int32_t)cpu->aluResult > INT16_MAX;
+        default:
+            return false;
+    }
+}
+
+static inline bool flagEqu(const CPU *cpu) { return cmpKind(cpu) != FLAGS_NONE && cpu->cmpLhs == cpu->cmpRhs; }
+static inline bool flagNeq(const CPU *cpu) { return cmpKind(cpu) != FLAGS_NONE && cpu->cmpLhs != cpu->cmpRhs; }
+static inline bool flagGr(const CPU *cpu)  { return cmpKind(cpu) != FLAGS_NONE && cpu->cmpLhs > cpu->cmpRhs; }
+static inline bool flagGe(const CPU *cpu)  { return cmpKind(cpu) != FLAGS_NONE && cpu->cmpLhs >= cpu->cmpRhs; }
+static inline bool flagLs(const CPU *cpu)  { return cmpKind(cpu) != FLAGS_NONE && cpu->cmpLhs < cpu->cmpRhs; }
+static inline bool flagLe(const CPU *cpu)  { return cmpKind(cpu) != FLAGS_NONE && cpu->cmpLhs <= cpu->cmpRhs; }
 
 CPU *initializeEmulator(char *ram);
 
+void freeEmulator(CPU *cpu);
+
+void invalidateCode(CPU *cpu, uint16_t address, uint16_t length);
+
+DecodedInstruction *decodeAt(CPU *cpu, uint16_t address);
+
+uint16_t busLoad(const CPU *cpu, uint16_t address);
+
+void busStore(CPU *cpu, uint16_t address, uint16_t value);
+
+// Guest memory is big endian; both accessors are a single host access plus a
+// byte swap, after one page table lookup that sends device pages to the bus
+static inline uint16_t loadWord(const CPU *cpu, uint16_t address) {
+    if (__builtin_expect(cpu->busPages[address>>8] != 0, 0)) { return busLoad(cpu, address); }
+    uint16_t value;
+    memcpy(&value, cpu->ram + address, 2);
+    return guestToHost16(value);
+}
+
+static inline void storeWord(CPU *cpu, uint16_t address, uint16_t value) {
+    if (__builtin_expect(cpu->busPages[address>>8] != 0, 0)) {
+        busStore(cpu, address, value);
+        return;
+    }
+    uint16_t swapped = guestToHost16(value);
+    memcpy(cpu->ram + address, &swapped, 2);
+    cpu->dirtyPages[address>>14] |= 1ull << ((address>>8) & 63);
+    cpu->dirtyPages[(uint16_t)(address + 1)>>14] |= 1ull << (((uint16_t)(address + 1)>>8) & 63);
+    if (address == 0xFFFF) {
+        cpu->ram[0] = cpu->ram[RAM_SIZE];
+    } else if (address == 0) {
+        cpu->ram[RAM_SIZE] = cpu->ram[0];
+    }
+    if (cpu->codePages[address>>8] || cpu->codePages[(uint16_t)(address + 1)>>8]) {
+        invalidateCode(cpu, address, 2);
+    }
+}
+
+void compare(uint16_t num1, uint16_t num2, CPU *cpu);
+
+uint16_t arithmetic(uint32_t result, CPU *cpu);
+
+uint16_t signedArithmetic(int32_t result, CPU *cpu);
+
 void printCPUState(CPU *cpu);
 
 Instruction parseBytes(uint32_t data);
@@ -33,4 +177,18 @@ void tickComputer(CPU *cpu, bool verbose);
 
 void executeInstruction(Instruction instruction, CPU *cpu, bool verbose);
 
+StopReason runEmulator(CPU *cpu, uint64_t maxCycles);
+
+StopReason runEngine(CPU *cpu, Engine engine, uint64_t maxCycles);
+
+StopReason stopReason(CPU *cpu);
+
+uint32_t ramChecksum(CPU *cpu);
+
+bool parseEngine(const char *name, Engine *engine);
+
+const char *engineName(Engine engine);
+
+const char *stopReasonName(StopReason reason);
+
 #endif
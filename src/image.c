@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "image.h"
+#include "utils.h"
+
+static uint32_t tableChecksum(const uint8_t* image, uint16_t segments) {
+    uint32_t hash = fnv1a(2166136261u, image, IMAGE_HEADER_SIZE - 4);
+    return fnv1a(hash, image + IMAGE_HEADER_SIZE, (size_t)segments * IMAGE_SEGMENT_SIZE);
+}
+
+// Validates a mapped image and copies its segments into ram
+static int loadImage(const char* path, const uint8_t* image, size_t size, char* ram) {
+    if (size < IMAGE_HEADER_SIZE) {
+        printf(HI_RED "Fatal error! %s is truncated!\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    uint16_t version = get16(image + 4);
+    if (version != IMAGE_VERSION) {
+        printf(HI_RED "Fatal error! %s has unsupported image version %u!\n" COL_RESET, path, version);
+        return EXIT_FAILURE;
+    }
+    uint16_t entry = get16(image + 6);
+    uint16_t segments = get16(image + 8);
+    if (IMAGE_HEADER_SIZE + (size_t)segments * IMAGE_SEGMENT_SIZE > size) {
+        printf(HI_RED "Fatal error! %s is truncated!\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    if (tableChecksum(image, segments) != get32(image + 12)) {
+        printf(HI_RED "Fatal error! %s has a corrupt header!\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+
+    for (uint16_t i = 0; i < segments; i++) {
+        const uint8_t* segment = image + IMAGE_HEADER_SIZE + (size_t)i * IMAGE_SEGMENT_SIZE;
+        uint16_t address = get16(segment);
+        uint32_t length = get32(segment + 4);
+        uint32_t offset = get32(segment + 8);
+        if (length > (uint32_t)(RAM_SIZE - address) || offset > size || length > size - offset) {
+            printf(HI_RED "Fatal error! Segment %u of %s is out of bounds!\n" COL_RESET, i, path);
+            return EXIT_FAILURE;
+        }
+        if (fnv1a(2166136261u, image + offset, length) != get32(segment + 12)) {
+            printf(HI_RED "Fatal error! Segment %u of %s fails its checksum!\n" COL_RESET, i, path);
+            return EXIT_FAILURE;
+        }
+        memcpy(ram + address, image + offset, length);
+    }
+    ram[0] = entry >> 8;
+    ram[1] = entry & 0xFF;
+    return EXIT_SUCCESS;
+}
+
+// Loads either a LOL16 image or a raw dump of up to 64 KiB, both through mmap
+int readRAMFile(const char* path, char* ram) {
+    memset(ram, 0, RAM_SIZE);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf(HI_RED "Fatal error! Cannot find file %s\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        printf(HI_RED "Fatal error! Cannot read file %s\n" COL_RESET, path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t size = (size_t)info.st_size;
+    if (size == 0) {
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+    const uint8_t* file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        printf(HI_RED "Fatal error! Cannot map file %s\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    if (size >= 4 && memcmp(file, IMAGE_MAGIC, 4) == 0) {
+        status = loadImage(path, file, size, ram);
+    } else if (size > RAM_SIZE) {
+        printf(HI_RED "Fatal error! %s is larger than the 64 KiB address space!\n" COL_RESET, path);
+        status = EXIT_FAILURE;
+    } else {
+        memcpy(ram, file, size);
+    }
+    munmap((void*)file, size);
+    return status;
+}
+
+// readRAMFile straight into the RAM of a CPU from initializeEmulator(NULL),
+// so the image is copied once, from the mapping
+int loadRAMFile(const char* path, CPU* cpu) {
+    int status = readRAMFile(path, cpu->ram);
+    cpu->ram[RAM_SIZE] = cpu->ram[0];
+    return status;
+}
+
+// Writes ram as a LOL16 image: the word at 0 becomes the entry vector and every
+// other run of non-zero bytes becomes a segment
+int writeImageFile(const char* path, const char* ram) {
+    uint16_t starts[RAM_SIZE / (IMAGE_SEGMENT_GAP + 1) + 1];
+    uint32_t lengths[RAM_SIZE / (IMAGE_SEGMENT_GAP + 1) + 1];
+    uint16_t segments = 0;
+    int address = 2;
+    while (address < RAM_SIZE) {
+        if (ram[address] == 0) {
+            address++;
+            continue;
+        }
+        int end = address;
+        int last = address;
+        while (end < RAM_SIZE && end - last <= IMAGE_SEGMENT_GAP) {
+            if (ram[end] != 0) { last = end; }
+            end++;
+        }
+        starts[segments] = (uint16_t)address;
+        lengths[segments] = (uint32_t)(last + 1 - address);
+        segments++;
+        address = last + 1;
+    }
+
+    size_t tableSize = IMAGE_HEADER_SIZE + (size_t)segments * IMAGE_SEGMENT_SIZE;
+    uint8_t* header = calloc(1, tableSize);
+    memcpy(header, IMAGE_MAGIC, 4);
+    put16(header + 4, IMAGE_VERSION);
+    put16(header + 6, (uint16_t)((uint8_t)ram[0] << 8 | (uint8_t)ram[1]));
+    put16(header + 8, segments);
+    uint32_t offset = (uint32_t)tableSize;
+    for (uint16_t i = 0; i < segments; i++) {
+        uint8_t* segment = header + IMAGE_HEADER_SIZE + (size_t)i * IMAGE_SEGMENT_SIZE;
+        put16(segment, starts[i]);
+        put32(segment + 4, lengths[i]);
+        put32(segment + 8, offset);
+        put32(segment + 12, fnv1a(2166136261u, (const uint8_t*)ram + starts[i], lengths[i]));
+        offset += lengths[i];
+    }
+    put32(header + 12, tableChecksum(header, segments));
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        printf(HI_RED "Fatal error! Cannot write file %s\n" COL_RESET, path);
+        free(header);
+        return EXIT_FAILURE;
+    }
+    bool written = fwrite(header, 1, tableSize, file) == tableSize;
+    for (uint16_t i = 0; i < segments && written; i++) {
+        written = fwrite(ram + starts[i], 1, lengths[i], file) == lengths[i];
+    }
+    written = fclose(file) == 0 && written;
+    free(header);
+    if (!written) {
+        printf(HI_RED "Fatal error! Failed writing %s\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int assembleFile(const char* path, char* ram, FILE* log, bool optimize) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf(HI_RED "Source file not found!\n" COL_RESET);
+        return EXIT_FAILURE;
+    }
+    int status = assembleStream(file, ram, 0xA000, log, optimize);
+    fclose(file);
+    return status;
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "emulator.h"
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+// LOL16 image file, all fields big endian like the guest:
+//   header   magic "L16I", u16 version, u16 entry vector, u16 segment count,
+//            u16 reserved, u32 FNV-1a over the first 12 header bytes and the
+//            segment table
+//   segment  u16 load address, u16 reserved, u32 length, u32 file offset,
+//            u32 FNV-1a over the segment data
+#define IMAGE_MAGIC "L16I"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 16
+#define IMAGE_SEGMENT_SIZE 16
+// Zero runs shorter than this are cheaper to store than to split a segment on
+#define IMAGE_SEGMENT_GAP 32
+
+int readRAMFile(const char *path, char *ram);
+
+int loadRAMFile(const char *path, CPU *cpu);
+
+int writeImageFile(const char *path, const char *ram);
+
+int assembleFile(const char *path, char *ram, FILE *log, bool optimize);
+
+#endif
@@ -0,0 +1,678 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "emulator.h"
+#include "jit.h"
+#include "utils.h"
+
+// Basic-block translator from LOL16 to x86-64. Blocks run with rbx = cpu, keep
+// all guest state including the cycle limit in the CPU struct and chain into each
+// other with patched rel32 jumps. Anything that is not translated natively is
+// executed by calling back into executeInstruction, and so are the memory
+// accesses that leave plain RAM.
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define CODE_SIZE (8 << 20)
+#define MAX_BLOCK_INSTRUCTIONS 64
+#define MAX_BLOCK_BYTES (MAX_BLOCK_INSTRUCTIONS * 256 + 64)
+
+struct JitPatch {
+    uint8_t *site;
+    int32_t next;
+}; typedef struct JitPatch JitPatch;
+
+struct JitState {
+    uint8_t *code;
+    uint8_t *cursor;
+    uint8_t *epilogue;
+    uint8_t *blocksStart;
+    void (*enter)(CPU *cpu, void *block);
+    void *blocks[65536];
+    int32_t pending[65536];
+    uint8_t covered[65536 / 8];
+    JitPatch *patches;
+    int32_t patchCount;
+    int32_t patchCapacity;
+    bool flushPending;
+}; typedef struct JitState JitState;
+
+enum {
+    RAX = 0,
+    RCX = 1
+};
+
+enum {
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_BE = 0x6,
+    CC_A = 0x7
+};
+
+void emitByte(JitState* jit, uint8_t byte) {
+    *jit->cursor++ = byte;
+}
+
+void emit16(JitState* jit, uint16_t value) {
+    memcpy(jit->cursor, &value, 2);
+    jit->cursor += 2;
+}
+
+void emit32(JitState* jit, uint32_t value) {
+    memcpy(jit->cursor, &value, 4);
+    jit->cursor += 4;
+}
+
+void emit64(JitState* jit, uint64_t value) {
+    memcpy(jit->cursor, &value, 8);
+    jit->cursor += 8;
+}
+
+// ModRM for [rbx + disp32]
+void emitMem(JitState* jit, uint8_t reg, int32_t offset) {
+    emitByte(jit, 0x80 | (reg << 3) | 3);
+    emit32(jit, (uint32_t)offset);
+}
+
+void patchRel32(uint8_t* site, uint8_t* target) {
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site, &rel, 4);
+}
+
+uint8_t* emitJmp(JitState* jit) {
+    emitByte(jit, 0xE9);
+    uint8_t* site = jit->cursor;
+    emit32(jit, 0);
+    return site;
+}
+
+uint8_t* emitJcc(JitState* jit, uint8_t cc) {
+    emitByte(jit, 0x0F);
+    emitByte(jit, 0x80 | cc);
+    uint8_t* site = jit->cursor;
+    emit32(jit, 0);
+    return site;
+}
+
+// movzx reg, word [rbx+offset]
+void emitLoad16(JitState* jit, uint8_t reg, int32_t offset) {
+    emitByte(jit, 0x0F);
+    emitByte(jit, 0xB7);
+    emitMem(jit, reg, offset);
+}
+
+// movzx reg, byte [rbx+offset]
+void emitLoad8(JitState* jit, uint8_t reg, int32_t offset) {
+    emitByte(jit, 0x0F);
+    emitByte(jit, 0xB6);
+    emitMem(jit, reg, offset);
+}
+
+// mov word [rbx+offset], ax
+void emitStoreAx(JitState* jit, int32_t offset) {
+    emitByte(jit, 0x66);
+    emitByte(jit, 0x89);
+    emitMem(jit, RAX, offset);
+}
+
+void emitStoreImm16(JitState* jit, int32_t offset, uint16_t value) {
+    emitByte(jit, 0x66);
+    emitByte(jit, 0xC7);
+    emitMem(jit, 0, offset);
+    emit16(jit, value);
+}
+
+void emitStoreImm8(JitState* jit, int32_t offset, uint8_t value) {
+    emitByte(jit, 0xC6);
+    emitMem(jit, 0, offset);
+    emitByte(jit, value);
+}
+
+void emitMovImm(JitState* jit, uint8_t reg, uint32_t value) {
+    emitByte(jit, 0xB8 + reg);
+    emit32(jit, value);
+}
+
+void emitSetcc(JitState* jit, uint8_t cc, int32_t offset) {
+    emitByte(jit, 0x0F);
+    emitByte(jit, 0x90 | cc);
+    emitMem(jit, 0, offset);
+}
+
+int32_t registerOffset(Register reg) {
+    return offsetof(CPU, regs) + reg * sizeof(uint16_t);
+}
+
+// Replaces the kind bits selected by mask in the packed flags byte
+void emitFlagKind(JitState* jit, uint8_t mask, uint8_t kind) {
+    emitByte(jit, 0x80);
+    emitMem(jit, 4, offsetof(CPU, flags));
+    emitByte(jit, (uint8_t)~mask);
+    emitByte(jit, 0x80);
+    emitMem(jit, 1, offsetof(CPU, flags));
+    emitByte(jit, kind);
+}
+
+// Loads an operand into eax/ecx: a register when isRegister, the immediate otherwise
+void emitOperand(JitState* jit, uint8_t reg, bool isRegister, Register source, uint16_t value) {
+    if (isRegister) {
+        emitLoad16(jit, reg, registerOffset(source));
+    } else {
+        emitMovImm(jit, reg, value);
+    }
+}
+
+// Mirrors compare(): eax = num1, ecx = num2
+void emitCompare(JitState* jit) {
+    emitStoreAx(jit, offsetof(CPU, cmpLhs));
+    emitByte(jit, 0x66);
+    emitByte(jit, 0x89);
+    emitMem(jit, RCX, offsetof(CPU, cmpRhs));
+    emitFlagKind(jit, FLAGS_CMP_MASK, FLAGS_UNSIGNED << FLAGS_CMP_SHIFT);
+}
+
+// Mirrors arithmetic(): records the 32 bit result in eax, then stores ax
+void emitArithmetic(JitState* jit, Register dest) {
+    emitByte(jit, 0x89);
+    emitMem(jit, RAX, offsetof(CPU, aluResult));
+    emitFlagKind(jit, FLAGS_ALU_MASK, FLAGS_UNSIGNED);
+    emitStoreAx(jit, registerOffset(dest));
+}
+
+// eax = a (+|-) b for the ADD/SUB families
+void emitAddSub(JitState* jit, bool subtract, bool aIsRegister, Register a, bool bIsRegister, Register b, uint16_t value, Register dest) {
+    emitOperand(jit, RAX, aIsRegister, a, value);
+    emitOperand(jit, RCX, bIsRegister, b, value);
+    emitByte(jit, subtract ? 0x29 : 0x01);
+    emitByte(jit, 0xC8);
+    emitArithmetic(jit, dest);
+}
+
+// Runs with cpu->cycles at the instruction's own cycle, the way tickComputer
+// runs it. 1 leaves the block after it retires, 2 leaves without retiring it.
+int jitFallback(CPU* cpu, uint32_t word) {
+    uint64_t limit = cpu->limit;
+    executeInstruction(parseBytes(word), cpu, false);
+    if (cpu->status == CPU_FAULT) {
+        cpu->PC -= 4;
+        return 2;
+    }
+    if (cpu->status != CPU_RUNNING || cpu->jit->flushPending) { return 1; }
+    // A device scheduled an event that pulled the limit in, so the rest of the
+    // block may no longer fit
+    if (cpu->limit != limit) { return 1; }
+    return 0;
+}
+
+// Calls jitFallback for the instruction at pc, leaving the block when it asks to.
+// The prologue already charged all count instructions, so the unretired ones
+// are given back around the call.
+void emitFallback(JitState* jit, uint16_t pc, uint32_t word, int index, int count) {
+    // sub qword [rbx+cycles], count - index
+    emitByte(jit, 0x48); emitByte(jit, 0x81); emitMem(jit, 5, offsetof(CPU, cycles)); emit32(jit, count - index);
+    emitStoreImm16(jit, offsetof(CPU, PC), pc + 4);
+    emitByte(jit, 0x48); emitByte(jit, 0x89); emitByte(jit, 0xDF);
+    emitByte(jit, 0xBE); emit32(jit, word);
+    emitByte(jit, 0x48); emitByte(jit, 0xB8); emit64(jit, (uint64_t)(uintptr_t)jitFallback);
+    emitByte(jit, 0xFF); emitByte(jit, 0xD0);
+
+    // Leaving: retire this instruction unless it faulted
+    emitByte(jit, 0x85); emitByte(jit, 0xC0);
+    emitByte(jit, 0x74); emitByte(jit, 21);
+    emitByte(jit, 0x83); emitByte(jit, 0xF8); emitByte(jit, 0x02);
+    emitByte(jit, 0x0F); emitByte(jit, 0x95); emitByte(jit, 0xC1);
+    emitByte(jit, 0x0F); emitByte(jit, 0xB6); emitByte(jit, 0xC9);
+    emitByte(jit, 0x48); emitByte(jit, 0x01); emitMem(jit, RCX, offsetof(CPU, cycles));
+    patchRel32(emitJmp(jit), jit->epilogue);
+    // add qword [rbx+cycles], count - index
+    emitByte(jit, 0x48); emitByte(jit, 0x81); emitMem(jit, 0, offsetof(CPU, cycles)); emit32(jit, count - index);
+}
+
+// eax = stackptr + delta, wrapped to 16 bits
+void emitStackAddress(JitState* jit, int8_t delta) {
+    emitLoad16(jit, RAX, offsetof(CPU, stackptr));
+    emitByte(jit, 0x83); emitByte(jit, 0xC0); emitByte(jit, (uint8_t)delta);
+    emitByte(jit, 0x0F); emitByte(jit, 0xB7); emitByte(jit, 0xC0);
+}
+
+// cmp byte [rbx+rsi+offset], 0 for the page in esi, then jne to a site
+// returned for the slow path
+uint8_t* emitPageCheck(JitState* jit, int32_t offset) {
+    emitByte(jit, 0x80); emitByte(jit, 0xBC); emitByte(jit, 0x33); emit32(jit, (uint32_t)offset); emitByte(jit, 0);
+    return emitJcc(jit, CC_NE);
+}
+
+// Branches to the slow paths stored in slow unless the word at the address in
+// eax is plain RAM, the way loadWord and storeWord route it. A store also takes
+// the slow path when it touches a page holding code, which storeWord would
+// invalidate, or the byte mirrored at 0. Leaves edx = address + 1 for stores.
+int emitAccessChecks(JitState* jit, CPU* cpu, bool store, uint8_t** slow) {
+    int count = 0;
+    // movzx esi, ah
+    emitByte(jit, 0x0F); emitByte(jit, 0xB6); emitByte(jit, 0xF4);
+    // Devices are attached before anything runs, so without them no page routes
+    if (cpu->bus != NULL) { slow[count++] = emitPageCheck(jit, offsetof(CPU, busPages)); }
+    if (!store) { return count; }
+    slow[count++] = emitPageCheck(jit, offsetof(CPU, codePages));
+    // lea edx, [rax+1]; movzx edx, dx; cmp edx, 1; jbe slow
+    emitByte(jit, 0x8D); emitByte(jit, 0x50); emitByte(jit, 0x01);
+    emitByte(jit, 0x0F); emitByte(jit, 0xB7); emitByte(jit, 0xD2);
+    emitByte(jit, 0x83); emitByte(jit, 0xFA); emitByte(jit, 0x01);
+    slow[count++] = emitJcc(jit, CC_BE);
+    // movzx esi, dh
+    emitByte(jit, 0x0F); emitByte(jit, 0xB6); emitByte(jit, 0xF6);
+    slow[count++] = emitPageCheck(jit, offsetof(CPU, codePages));
+    return count;
+}
+
+// ax = the guest word at eax
+void emitRAMLoad(JitState* jit) {
+    // mov rcx, [rbx+ram]; movzx eax, word [rcx+rax]; rol ax, 8
+    emitByte(jit, 0x48); emitByte(jit, 0x8B); emitMem(jit, RCX, offsetof(CPU, ram));
+    emitByte(jit, 0x0F); emitByte(jit, 0xB7); emitByte(jit, 0x04); emitByte(jit, 0x01);
+    emitByte(jit, 0x66); emitByte(jit, 0xC1); emitByte(jit, 0xC0); emitByte(jit, 8);
+}
+
+// Stores cx as the guest word at eax and marks both pages dirty, with edx =
+// address + 1 from emitAccessChecks
+void emitRAMStore(JitState* jit) {
+    // mov rdi, [rbx+ram]; rol cx, 8; mov [rdi+rax], cx
+    emitByte(jit, 0x48); emitByte(jit, 0x8B); emitMem(jit, 7, offsetof(CPU, ram));
+    emitByte(jit, 0x66); emitByte(jit, 0xC1); emitByte(jit, 0xC1); emitByte(jit, 8);
+    emitByte(jit, 0x66); emitByte(jit, 0x89); emitByte(jit, 0x0C); emitByte(jit, 0x07);
+    // movzx esi, ah; bts [rbx+dirtyPages], rsi; movzx esi, dh; bts [rbx+dirtyPages], rsi
+    emitByte(jit, 0x0F); emitByte(jit, 0xB6); emitByte(jit, 0xF4);
+    emitByte(jit, 0x48); emitByte(jit, 0x0F); emitByte(jit, 0xAB); emitMem(jit, 6, offsetof(CPU, dirtyPages));
+    emitByte(jit, 0x0F); emitByte(jit, 0xB6); emitByte(jit, 0xF6);
+    emitByte(jit, 0x48); emitByte(jit, 0x0F); emitByte(jit, 0xAB); emitMem(jit, 6, offsetof(CPU, dirtyPages));
+}
+
+// add/sub word [rbx+stackptr], 2
+void emitStackAdjust(JitState* jit, bool pop) {
+    emitByte(jit, 0x66); emitByte(jit, 0x83); emitMem(jit, pop ? 0 : 5, offsetof(CPU, stackptr)); emitByte(jit, 2);
+}
+
+// Ends the fast path of an access and emits its slow path, the full fallback
+void emitSlowPath(JitState* jit, uint8_t** slow, int slowCount, uint16_t pc, uint32_t word, int index, int count) {
+    uint8_t* done = emitJmp(jit);
+    for (int i = 0; i < slowCount; i++) { patchRel32(slow[i], jit->cursor); }
+    emitFallback(jit, pc, word, index, count);
+    patchRel32(done, jit->cursor);
+}
+
+// A store of the value in ecx to the address in eax
+void emitStore(JitState* jit, CPU* cpu, uint16_t pc, uint32_t word, int index, int count, bool push) {
+    uint8_t* slow[4];
+    int slowCount = emitAccessChecks(jit, cpu, true, slow);
+    emitRAMStore(jit);
+    if (push) { emitStackAdjust(jit, false); }
+    emitSlowPath(jit, slow, slowCount, pc, word, index, count);
+}
+
+// A load from the address in eax, stored to offset or popped when pop is set
+void emitLoad(JitState* jit, CPU* cpu, uint16_t pc, uint32_t word, int index, int count, int32_t offset, bool pop) {
+    uint8_t* slow[4];
+    int slowCount = emitAccessChecks(jit, cpu, false, slow);
+    emitRAMLoad(jit);
+    emitStoreAx(jit, offset);
+    if (pop) { emitStackAdjust(jit, true); }
+    emitSlowPath(jit, slow, slowCount, pc, word, index, count);
+}
+
+void emitChain(JitState* jit, uint16_t target) {
+    if (jit->blocks[target] != NULL) {
+        patchRel32(emitJmp(jit), jit->blocks[target]);
+        return;
+    }
+    uint8_t* site = emitJmp(jit);
+    patchRel32(site, jit->cursor);
+    emitStoreImm16(jit, offsetof(CPU, PC), target);
+    patchRel32(emitJmp(jit), jit->epilogue);
+    if (target == 0) { return; }
+
+    if (jit->patchCount == jit->patchCapacity) {
+        jit->patchCapacity = jit->patchCapacity ? jit->patchCapacity * 2 : 1024;
+        jit->patches = realloc(jit->patches, jit->patchCapacity * sizeof(JitPatch));
+    }
+    jit->patches[jit->patchCount] = (JitPatch){ .site = site, .next = jit->pending[target] };
+    jit->pending[target] = jit->patchCount++;
+}
+
+// Looks the block for cpu->PC up in blocks[] and jumps there, or leaves to the dispatcher
+void emitIndirect(JitState* jit) {
+    emitLoad16(jit, RAX, offsetof(CPU, PC));
+    emitByte(jit, 0x48); emitByte(jit, 0xB9); emit64(jit, (uint64_t)(uintptr_t)jit->blocks);
+    emitByte(jit, 0x48); emitByte(jit, 0x8B); emitByte(jit, 0x04); emitByte(jit, 0xC1);
+    emitByte(jit, 0x48); emitByte(jit, 0x85); emitByte(jit, 0xC0);
+    patchRel32(emitJcc(jit, CC_E), jit->epilogue);
+    emitByte(jit, 0xFF); emitByte(jit, 0xE0);
+}
+
+void flushJit(JitState* jit) {
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->pending, 0xFF, sizeof(jit->pending));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->patchCount = 0;
+    jit->cursor = jit->blocksStart;
+    jit->flushPending = false;
+}
+
+JitState* createJit() {
+    uint8_t* code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) { return NULL; }
+    JitState* jit = calloc(1, sizeof(JitState));
+    jit->code = code;
+    jit->cursor = code;
+
+    // enter(cpu, block): save callee-saved registers (keeping rsp 16 byte aligned), jump into the block
+    jit->enter = (void (*)(CPU*, void*))(void*)jit->cursor;
+    emitByte(jit, 0x53);
+    emitByte(jit, 0x41); emitByte(jit, 0x54);
+    emitByte(jit, 0x41); emitByte(jit, 0x55);
+    emitByte(jit, 0x48); emitByte(jit, 0x89); emitByte(jit, 0xFB);
+    emitByte(jit, 0xFF); emitByte(jit, 0xE6);
+    jit->epilogue = jit->cursor;
+    emitByte(jit, 0x41); emitByte(jit, 0x5D);
+    emitByte(jit, 0x41); emitByte(jit, 0x5C);
+    emitByte(jit, 0x5B);
+    emitByte(jit, 0xC3);
+    jit->blocksStart = jit->cursor;
+
+    flushJit(jit);
+    return jit;
+}
+
+bool isTerminator(char opId) {
+    return (opId >= JZ_A && opId <= JGE_A) || opId == CALL_A || opId == RET || opId == HLT;
+}
+
+// Emits the test for the predicate a conditional jump reads and returns the
+// condition code that holds when the predicate is true. negate is set for the
+// jumps taken when it is false. A kind of FLAGS_NONE makes every predicate false.
+uint8_t* emitPredicate(JitState* jit, char opId, uint8_t* cc, bool* negate) {
+    bool alu = opId == JZ_A || opId == JNZ_A || opId == JN_A || opId == JNN_A;
+    emitByte(jit, 0xF6);
+    emitMem(jit, 0, offsetof(CPU, flags));
+    emitByte(jit, alu ? FLAGS_ALU_MASK : FLAGS_CMP_MASK);
+    uint8_t* none = emitJcc(jit, CC_E);
+
+    *negate = opId == JNZ_A || opId == JNN_A;
+    if (opId == JZ_A || opId == JNZ_A) {
+        // test word [aluResult], 0xFFFF
+        emitByte(jit, 0x66); emitByte(jit, 0xF7); emitMem(jit, 0, offsetof(CPU, aluResult)); emit16(jit, 0xFFFF);
+        *cc = CC_E;
+        return none;
+    }
+    if (opId == JN_A || opId == JNN_A) {
+        // test byte [aluResult+1], 0x80
+        emitByte(jit, 0xF6); emitMem(jit, 0, offsetof(CPU, aluResult) + 1); emitByte(jit, 0x80);
+        *cc = CC_NE;
+        return none;
+    }
+    // cmp ax, word [cmpRhs]
+    emitLoad16(jit, RAX, offsetof(CPU, cmpLhs));
+    emitByte(jit, 0x66); emitByte(jit, 0x3B); emitMem(jit, RAX, offsetof(CPU, cmpRhs));
+    switch (opId) {
+        case JE_A:  *cc = CC_E;  break;
+        case JNE_A: *cc = CC_NE; break;
+        case JL_A:  *cc = CC_B;  break;
+        case JLE_A: *cc = CC_BE; break;
+        case JG_A:  *cc = CC_A;  break;
+        default:    *cc = CC_AE; break;
+    }
+    return none;
+}
+
+uint32_t fetchWord(CPU* cpu, uint16_t pc) {
+    return ((uint32_t)(uint8_t)cpu->ram[pc]) << 24 |
+           ((uint32_t)(uint8_t)cpu->ram[(uint16_t)(pc + 1)]) << 16 |
+           ((uint32_t)(uint8_t)cpu->ram[(uint16_t)(pc + 2)]) << 8 |
+           ((uint32_t)(uint8_t)cpu->ram[(uint16_t)(pc + 3)]);
+}
+
+void* translateBlock(CPU* cpu, JitState* jit, uint16_t start) {
+    if (jit->cursor + MAX_BLOCK_BYTES > jit->code + CODE_SIZE) { flushJit(jit); }
+
+    int count = 0;
+    uint16_t pc = start;
+    while (count < MAX_BLOCK_INSTRUCTIONS) {
+        DecodedInstruction* decoded = cpu->decoded[pc].valid ? &cpu->decoded[pc] : decodeAt(cpu, pc);
+        count++;
+        pc += 4;
+        if (isTerminator(decoded->instruction.opId) || pc < 4) { break; }
+    }
+
+    uint8_t* entry = jit->cursor;
+
+    // Prologue: run only if the whole block fits in the remaining cycle budget
+    emitByte(jit, 0x48); emitByte(jit, 0x8B); emitMem(jit, RAX, offsetof(CPU, cycles));
+    emitByte(jit, 0x48); emitByte(jit, 0x05); emit32(jit, count);
+    emitByte(jit, 0x48); emitByte(jit, 0x3B); emitMem(jit, RAX, offsetof(CPU, limit));
+    emitByte(jit, 0x76); emitByte(jit, 14);
+    emitStoreImm16(jit, offsetof(CPU, PC), start);
+    patchRel32(emitJmp(jit), jit->epilogue);
+    emitByte(jit, 0x48); emitByte(jit, 0x89); emitMem(jit, RAX, offsetof(CPU, cycles));
+
+    pc = start;
+    for (int index = 0; index < count; index++, pc += 4) {
+        Instruction instruction = cpu->decoded[pc].instruction;
+        uint32_t word = fetchWord(cpu, pc);
+        Register r1 = instruction.r1;
+        Register r2 = instruction.r2;
+        Register r3 = instruction.r3;
+        uint16_t value = instruction.data;
+        for (int i = 0; i < 4; i++) {
+            uint16_t byte = pc + i;
+            jit->covered[byte >> 3] |= 1 << (byte & 7);
+        }
+
+        switch (instruction.opId) {
+            case MOV_R_R:
+                emitLoad16(jit, RAX, registerOffset(r2));
+                emitStoreAx(jit, registerOffset(r1));
+                break;
+            case MOV_R_V:
+                emitStoreImm16(jit, registerOffset(r1), value);
+                break;
+            case MOV_R_A:
+                // Devices are attached before anything runs, so the page's route is fixed
+                if (cpu->busPages[value >> 8] != 0) {
+                    emitFallback(jit, pc, word, index, count);
+                    break;
+                }
+                // mov rcx, [rbx+ram]; movzx eax, word [rcx+value]
+                emitByte(jit, 0x48); emitByte(jit, 0x8B); emitMem(jit, RCX, offsetof(CPU, ram));
+                emitByte(jit, 0x0F); emitByte(jit, 0xB7); emitByte(jit, 0x81); emit32(jit, value);
+                emitByte(jit, 0x66); emitByte(jit, 0xC1); emitByte(jit, 0xC0); emitByte(jit, 8);
+                emitStoreAx(jit, registerOffset(r1));
+                break;
+            case CMP_R_V:
+                emitOperand(jit, RAX, true, r1, value);
+                emitOperand(jit, RCX, false, r1, value);
+                emitCompare(jit);
+                break;
+            case CMP_V_R:
+                emitOperand(jit, RAX, false, r1, value);
+                emitOperand(jit, RCX, true, r1, value);
+                emitCompare(jit);
+                break;
+            case CMP_R_R:
+                emitOperand(jit, RAX, true, r1, value);
+                emitOperand(jit, RCX, true, r2, value);
+                emitCompare(jit);
+                break;
+            case ADD_R_V_R:
+                emitAddSub(jit, false, true, r1, false, r1, value, r2);
+                break;
+            case ADD_R_R_R:
+                emitAddSub(jit, false, true, r1, true, r2, value, r3);
+                break;
+            case SUB_R_V_R:
+                emitAddSub(jit, true, true, r1, false, r1, value, r2);
+                break;
+            case SUB_V_R_R:
+                emitAddSub(jit, true, false, r1, true, r1, value, r2);
+                break;
+            case SUB_R_R_R:
+                emitAddSub(jit, true, true, r1, true, r2, value, r3);
+                break;
+            case PASS_R:
+                emitLoad16(jit, RAX, registerOffset(r1));
+                emitArithmetic(jit, r1);
+                break;
+            case JMP_A:
+                emitChain(jit, value);
+                break;
+            case JZ_A:
+            case JNZ_A:
+            case JN_A:
+            case JNN_A:
+            case JE_A:
+            case JNE_A:
+            case JL_A:
+            case JLE_A:
+            case JG_A:
+            case JGE_A: {
+                uint8_t cc;
+                bool negate;
+                uint8_t* none = emitPredicate(jit, instruction.opId, &cc, &negate);
+                uint8_t* predicateTrue = emitJcc(jit, cc);
+                patchRel32(none, jit->cursor);
+                emitChain(jit, negate ? value : (uint16_t)(pc + 4));
+                patchRel32(predicateTrue, jit->cursor);
+                emitChain(jit, negate ? (uint16_t)(pc + 4) : value);
+                break;
+            }
+            case MOV_A_R:
+                emitMovImm(jit, RAX, value);
+                emitLoad16(jit, RCX, registerOffset(r1));
+                emitStore(jit, cpu, pc, word, index, count, false);
+                break;
+            case MOV_AR_R:
+                emitLoad16(jit, RAX, registerOffset(r1));
+                emitLoad16(jit, RCX, registerOffset(r2));
+                emitStore(jit, cpu, pc, word, index, count, false);
+                break;
+            case MOV_AR_V:
+                emitLoad16(jit, RAX, registerOffset(r1));
+                emitMovImm(jit, RCX, value);
+                emitStore(jit, cpu, pc, word, index, count, false);
+                break;
+            case MOV_R_AR:
+                emitLoad16(jit, RAX, registerOffset(r2));
+                emitLoad(jit, cpu, pc, word, index, count, registerOffset(r1), false);
+                break;
+            case PUSH_R:
+                emitStackAddress(jit, -1);
+                emitLoad16(jit, RCX, registerOffset(r1));
+                emitStore(jit, cpu, pc, word, index, count, true);
+                break;
+            case PUSH_V:
+                emitStackAddress(jit, -1);
+                emitMovImm(jit, RCX, value);
+                emitStore(jit, cpu, pc, word, index, count, true);
+                break;
+            case POP_R:
+                emitStackAddress(jit, 1);
+                emitLoad(jit, cpu, pc, word, index, count, registerOffset(r1), true);
+                break;
+            case CALL_A:
+                emitStackAddress(jit, -1);
+                emitMovImm(jit, RCX, (uint16_t)(pc + 4));
+                emitStore(jit, cpu, pc, word, index, count, true);
+                emitChain(jit, value);
+                break;
+            case RET:
+                emitStackAddress(jit, 1);
+                emitLoad(jit, cpu, pc, word, index, count, offsetof(CPU, PC), true);
+                emitIndirect(jit);
+                break;
+            default:
+                emitFallback(jit, pc, word, index, count);
+                break;
+        }
+    }
+    if (!isTerminator(cpu->decoded[(uint16_t)(pc - 4)].instruction.opId)) {
+        emitChain(jit, pc);
+    } else if (cpu->decoded[(uint16_t)(pc - 4)].instruction.opId == HLT) {
+        patchRel32(emitJmp(jit), jit->epilogue);
+    }
+
+    jit->blocks[start] = entry;
+    for (int32_t i = jit->pending[start]; i != -1; i = jit->patches[i].next) {
+        patchRel32(jit->patches[i].site, entry);
+    }
+    jit->pending[start] = -1;
+    return entry;
+}
+
+void invalidateJit(CPU* cpu, uint16_t address, uint16_t length) {
+    JitState* jit = cpu->jit;
+    for (uint16_t i = 0; i < length; i++) {
+        uint16_t byte = address + i;
+        if (jit->covered[byte >> 3] & (1 << (byte & 7))) {
+            jit->flushPending = true;
+            return;
+        }
+    }
+}
+
+void freeJit(CPU* cpu) {
+    if (cpu->jit == NULL) { return; }
+    munmap(cpu->jit->code, CODE_SIZE);
+    free(cpu->jit->patches);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+StopReason runJit(CPU* cpu, uint64_t maxCycles) {
+    if (cpu->jit == NULL) {
+        cpu->jit = createJit();
+        if (cpu->jit == NULL) { return runEmulator(cpu, maxCycles); }
+    }
+    JitState* jit = cpu->jit;
+    cpu->limit = maxCycles > UINT64_MAX - cpu->cycles ? UINT64_MAX : cpu->cycles + maxCycles;
+
+    while (cpu->status == CPU_RUNNING && cpu->cycles < cpu->limit) {
+        if (jit->flushPending) { flushJit(jit); }
+        if (cpu->PC == 0) {
+            tickComputer(cpu, false);
+            continue;
+        }
+        void* block = jit->blocks[cpu->PC];
+        if (block == NULL) { block = translateBlock(cpu, jit, cpu->PC); }
+
+        uint64_t before = cpu->cycles;
+        jit->enter(cpu, block);
+        if (cpu->cycles == before && cpu->status == CPU_RUNNING) {
+            // The block does not fit in what is left of the budget
+            tickComputer(cpu, false);
+        }
+    }
+    return stopReason(cpu);
+}
+
+#else
+
+StopReason runJit(CPU* cpu, uint64_t maxCycles) {
+    return runEmulator(cpu, maxCycles);
+}
+
+void invalidateJit(CPU* cpu, uint16_t address, uint16_t length) {
+    (void)cpu;
+    (void)address;
+    (void)length;
+}
+
+void freeJit(CPU* cpu) {
+    (void)cpu;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "emulator.h"
+
+#ifndef JIT_H
+#define JIT_H
+
+StopReason runJit(CPU *cpu, uint64_t maxCycles);
+
+void invalidateJit(CPU *cpu, uint16_t address, uint16_t length);
+
+void freeJit(CPU *cpu);
+
+#endif
@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "lockstep.h"
+#include "utils.h"
+
+// Structure-of-arrays interpreter for parameter sweeps: up to LOCKSTEP_LANES
+// CPUs running the same program, with every piece of hot state held as one
+// vector of 16 bit lanes. Each step picks the PC of the first running lane
+// and executes that instruction for every lane sitting on the same PC (and
+// seeing the same instruction word), masking the others out, so lanes that
+// diverge simply take turns until they reconverge. Register, compare, ALU and
+// jump instructions run as vector operations, memory and stack instructions
+// lane by lane on each lane's RAM, and division and anything else through
+// tickComputer on the lane's own CPU, so those keep the reference semantics.
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Direct-mapped cache of instructions whose word was the same in every lane
+#define LOCKSTEP_CACHE_SIZE 256
+
+typedef uint16_t LaneWord __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint16_t))));
+typedef int16_t LaneMask __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int16_t))));
+typedef uint32_t LaneWide __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint32_t))));
+typedef int32_t LaneWideSigned __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int32_t))));
+
+struct LockstepEntry {
+    uint64_t epoch;
+    uint16_t pc;
+    Instruction instruction;
+}; typedef struct LockstepEntry LockstepEntry;
+
+// aluResult is kept as its two halves so the ALU stays in 16 bit lanes, and
+// cycles only catch up with the budget, which counts down from granted, when
+// it runs out or a lane goes through tickComputer
+struct LockstepState {
+    LaneWord regs[4];
+    LaneWord PC;
+    LaneWord stackptr;
+    LaneWord cmpLhs;
+    LaneWord cmpRhs;
+    LaneWord aluKind;
+    LaneWord cmpKind;
+    LaneWord aluLow;
+    LaneWord aluHigh;
+    LaneWord budget;
+    LaneWord granted;
+    LaneMask running;
+    uint64_t cycles[LOCKSTEP_LANES];
+    uint64_t limit[LOCKSTEP_LANES];
+    // Bumped whenever a lane may have written cached code, which drops the cache.
+    // 64 bits so it never wraps around to a stale entry's.
+    uint64_t epoch;
+    LockstepEntry cache[LOCKSTEP_CACHE_SIZE];
+    bool codePages[256];
+    CPU *cpus[LOCKSTEP_LANES];
+}; typedef struct LockstepState LockstepState;
+
+static inline LaneWord selectWord(LaneMask mask, LaneWord a, LaneWord b) {
+    return ((LaneWord)mask & a) | (~(LaneWord)mask & b);
+}
+
+// Index of the first lane set in mask, or -1
+static inline int firstLane(LaneMask mask) {
+#ifdef __AVX2__
+    uint32_t bits = (uint32_t)_mm256_movemask_epi8((__m256i)mask);
+    return bits == 0 ? -1 : __builtin_ctz(bits) / 2;
+#else
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (mask[lane]) { return lane; }
+    }
+    return -1;
+#endif
+}
+
+static inline LaneMask lanesZero(LockstepState* state) {
+    return (state->aluKind != FLAGS_NONE) & (state->aluLow == 0);
+}
+
+static inline LaneMask lanesNeg(LockstepState* state) {
+    return (state->aluKind != FLAGS_NONE) & ((state->aluLow & 0x8000) != 0);
+}
+
+// Unsigned results carry when the high half is set, signed ones when it is
+// not the sign extension of the low half
+static inline LaneMask lanesCarry(LockstepState* state) {
+    LaneWord extension = (LaneWord)((LaneMask)state->aluLow >> 15);
+    return ((state->aluKind == FLAGS_UNSIGNED) & (state->aluHigh != 0)) |
+           ((state->aluKind == FLAGS_SIGNED) & (state->aluHigh != extension));
+}
+
+// Lanes where the conditional jump opId is taken
+LaneMask lanesTaken(LockstepState* state, char opId) {
+    LaneMask compared = state->cmpKind != FLAGS_NONE;
+    LaneWord lhs = state->cmpLhs;
+    LaneWord rhs = state->cmpRhs;
+    switch (opId) {
+        case JZ_A:  return lanesZero(state);
+        case JNZ_A: return ~lanesZero(state);
+        case JN_A:  return lanesNeg(state);
+        case JNN_A: return ~lanesNeg(state);
+        case JE_A:  return compared & (lhs == rhs);
+        case JNE_A: return compared & (lhs != rhs);
+        case JL_A:  return compared & (lhs < rhs);
+        case JLE_A: return compared & (lhs <= rhs);
+        case JG_A:  return compared & (lhs > rhs);
+        case JGE_A: return compared & (lhs >= rhs);
+        default:    return ~(LaneMask){0};
+    }
+}
+
+// Grants the lane up to 0xFFFF instructions before its cycles need updating
+static void grantBudget(LockstepState* state, int lane) {
+    uint64_t remaining = state->limit[lane] - state->cycles[lane];
+    state->granted[lane] = remaining < 0xFFFF ? (uint16_t)remaining : 0xFFFF;
+    state->budget[lane] = state->granted[lane];
+}
+
+static inline uint64_t laneCycles(LockstepState* state, int lane) {
+    return state->cycles[lane] + (uint16_t)(state->granted[lane] - state->budget[lane]);
+}
+
+void loadLane(LockstepState* state, int lane, CPU* cpu) {
+    for (int reg = 0; reg < 4; reg++) {
+        state->regs[reg][lane] = cpu->regs[reg];
+    }
+    state->PC[lane] = cpu->PC;
+    state->stackptr[lane] = cpu->stackptr;
+    state->cmpLhs[lane] = cpu->cmpLhs;
+    state->cmpRhs[lane] = cpu->cmpRhs;
+    state->aluKind[lane] = aluKind(cpu);
+    state->cmpKind[lane] = cmpKind(cpu);
+    state->aluLow[lane] = (uint16_t)cpu->aluResult;
+    state->aluHigh[lane] = (uint16_t)(cpu->aluResult >> 16);
+    state->cycles[lane] = cpu->cycles;
+    grantBudget(state, lane);
+    state->running[lane] = cpu->status == CPU_RUNNING ? -1 : 0;
+}
+
+void storeLane(LockstepState* state, int lane, CPU* cpu) {
+    for (int reg = 0; reg < 4; reg++) {
+        cpu->regs[reg] = state->regs[reg][lane];
+    }
+    cpu->PC = state->PC[lane];
+    cpu->stackptr = state->stackptr[lane];
+    cpu->cmpLhs = state->cmpLhs[lane];
+    cpu->cmpRhs = state->cmpRhs[lane];
+    cpu->flags = state->aluKind[lane] | (state->cmpKind[lane] << FLAGS_CMP_SHIFT);
+    cpu->aluResult = (uint32_t)state->aluHigh[lane] << 16 | state->aluLow[lane];
+    cpu->cycles = laneCycles(state, lane);
+}
+
+// Where the lane's CPU is about to store a word, or -1 if it does not write memory
+static int32_t storeAddress(CPU* cpu) {
+    if (cpu->PC == 0) { return -1; }
+    DecodedInstruction* decoded = cpu->decoded[cpu->PC].valid ? &cpu->decoded[cpu->PC] : decodeAt(cpu, cpu->PC);
+    switch (decoded->instruction.opId) {
+        case MOV_A_R:
+            return decoded->instruction.data;
+        case MOV_AR_R:
+        case MOV_AR_V:
+            return cpu->regs[decoded->instruction.r1];
+        case PUSH_R:
+        case PUSH_V:
+        case CALL_A:
+            return (uint16_t)(cpu->stackptr - 1);
+        default:
+            return -1;
+    }
+}
+
+// Whether a store of a word at address touches code the cache decoded
+static inline bool writesCode(LockstepState* state, uint16_t address) {
+    return state->codePages[address >> 8] || state->codePages[(uint16_t)(address + 1) >> 8];
+}
+
+// Runs one instruction on each lane in group through the lane's own CPU
+void serializeLanes(LockstepState* state, LaneMask group) {
+    bool codeWritten = false;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (!group[lane]) { continue; }
+        CPU* cpu = state->cpus[lane];
+        storeLane(state, lane, cpu);
+        int32_t address = storeAddress(cpu);
+        codeWritten |= address >= 0 && writesCode(state, (uint16_t)address);
+        tickComputer(cpu, false);
+        loadLane(state, lane, cpu);
+    }
+    if (codeWritten) { state->epoch++; }
+}
+
+// Brings every lane's cycles up to date and grants new budgets, returning
+// false once no running lane has any cycles left
+static bool refillBudgets(LockstepState* state) {
+    bool any = false;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (state->cpus[lane] == NULL) { continue; }
+        state->cycles[lane] = laneCycles(state, lane);
+        grantBudget(state, lane);
+        any |= state->running[lane] && state->budget[lane] != 0;
+    }
+    return any;
+}
+
+#define FOR_GROUP(lane) for (int lane = 0; lane < LOCKSTEP_LANES; lane++) if (group[lane])
+
+// Memory and stack instructions, run lane by lane against each lane's own RAM
+// but without handing the whole lane state to tickComputer. Returns the next PCs.
+static LaneWord accessLanes(LockstepState* state, Instruction instruction, LaneMask group, LaneWord next) {
+    LaneWord* r1 = &state->regs[instruction.r1];
+    LaneWord* r2 = &state->regs[instruction.r2];
+    LaneWord* stackptr = &state->stackptr;
+    CPU** cpus = state->cpus;
+    uint16_t data = instruction.data;
+    bool codeWritten = false;
+    switch (instruction.opId) {
+        case MOV_R_A:
+            FOR_GROUP(lane) { (*r1)[lane] = loadWord(cpus[lane], data); }
+            break;
+        case MOV_A_R:
+            codeWritten = writesCode(state, data);
+            FOR_GROUP(lane) { storeWord(cpus[lane], data, (*r1)[lane]); }
+            break;
+        case MOV_AR_R:
+            FOR_GROUP(lane) {
+                codeWritten |= writesCode(state, (*r1)[lane]);
+                storeWord(cpus[lane], (*r1)[lane], (*r2)[lane]);
+            }
+            break;
+        case MOV_AR_V:
+            FOR_GROUP(lane) {
+                codeWritten |= writesCode(state, (*r1)[lane]);
+                storeWord(cpus[lane], (*r1)[lane], data);
+            }
+            break;
+        case MOV_R_AR:
+            FOR_GROUP(lane) { (*r1)[lane] = loadWord(cpus[lane], (*r2)[lane]); }
+            break;
+        case PUSH_R:
+        case PUSH_V:
+        case CALL_A: {
+            bool call = instruction.opId == CALL_A;
+            LaneWord pushed = call ? next : instruction.opId == PUSH_V ? (LaneWord){0} + data : *r1;
+            FOR_GROUP(lane) {
+                codeWritten |= writesCode(state, (*stackptr)[lane] - 1);
+                storeWord(cpus[lane], (*stackptr)[lane] - 1, pushed[lane]);
+            }
+            *stackptr = selectWord(group, *stackptr - 2, *stackptr);
+            if (call) { next = (LaneWord){0} + data; }
+            break;
+        }
+        case POP_R:
+            *stackptr = selectWord(group, *stackptr + 2, *stackptr);
+            FOR_GROUP(lane) { (*r1)[lane] = loadWord(cpus[lane], (*stackptr)[lane] - 1); }
+            break;
+        default:
+            *stackptr = selectWord(group, *stackptr + 2, *stackptr);
+            FOR_GROUP(lane) { next[lane] = loadWord(cpus[lane], (*stackptr)[lane] - 1); }
+            break;
+    }
+    if (codeWritten) { state->epoch++; }
+    return next;
+}
+
+uint32_t fetchLaneWord(CPU* cpu, uint16_t pc) {
+    uint32_t word;
+    memcpy(&word, cpu->ram + pc, 4);
+    return word;
+}
+
+// The leader's instruction at pc. Lanes whose word differs drop out of group;
+// when no lane differs the instruction is cached until memory may change.
+static Instruction fetchInstruction(LockstepState* state, int leader, uint16_t pc, LaneMask* group) {
+    LockstepEntry* entry = &state->cache[(pc >> 2) % LOCKSTEP_CACHE_SIZE];
+    if (entry->epoch == state->epoch && entry->pc == pc) { return entry->instruction; }
+    uint32_t word = fetchLaneWord(state->cpus[leader], pc);
+    bool shared = true;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (state->cpus[lane] != NULL && fetchLaneWord(state->cpus[lane], pc) != word) {
+            (*group)[lane] = 0;
+            shared = false;
+        }
+    }
+    Instruction instruction = parseBytes(__builtin_bswap32(word));
+    if (shared) {
+        *entry = (LockstepEntry){ .epoch = state->epoch, .pc = pc, .instruction = instruction };
+        state->codePages[pc >> 8] = true;
+        state->codePages[(uint16_t)(pc + 3) >> 8] = true;
+    }
+    return instruction;
+}
+
+void runLockstep(CPU** cpus, int count, uint64_t maxCycles) {
+    // Lanes are whole vector registers, so the state needs their alignment
+    LockstepState* state = aligned_alloc(64, sizeof(LockstepState));
+    memset(state, 0, sizeof(LockstepState));
+    // Epoch 0 marks empty cache entries
+    state->epoch = 1;
+    for (int lane = 0; lane < count && lane < LOCKSTEP_LANES; lane++) {
+        state->cpus[lane] = cpus[lane];
+        state->limit[lane] = maxCycles > UINT64_MAX - cpus[lane]->cycles ? UINT64_MAX : cpus[lane]->cycles + maxCycles;
+        loadLane(state, lane, cpus[lane]);
+    }
+
+    while (true) {
+        LaneMask active = state->running & (state->budget != 0);
+        int leader = firstLane(active);
+        if (leader == -1) {
+            if (!refillBudgets(state)) { break; }
+            continue;
+        }
+
+        uint16_t pc = state->PC[leader];
+        LaneMask group = active & (state->PC == pc);
+        if (pc == 0 || pc > 0xFFFC) {
+            serializeLanes(state, group);
+            continue;
+        }
+        Instruction instruction = fetchInstruction(state, leader, pc, &group);
+        LaneWord* r1 = &state->regs[instruction.r1];
+        LaneWord* r2 = &state->regs[instruction.r2];
+        LaneWord* r3 = &state->regs[instruction.r3];
+        LaneWord value = (LaneWord){0} + instruction.data;
+        LaneWord next = state->PC + 4;
+        LaneWord low, high;
+        LaneWord* dest;
+
+        switch (instruction.opId) {
+            case MOV_R_R:
+                *r1 = selectWord(group, *r2, *r1);
+                break;
+            case MOV_R_V:
+                *r1 = selectWord(group, value, *r1);
+                break;
+            case MOV_R_A:
+            case MOV_A_R:
+            case MOV_AR_R:
+            case MOV_AR_V:
+            case MOV_R_AR:
+            case PUSH_R:
+            case PUSH_V:
+            case POP_R:
+            case CALL_A:
+            case RET:
+                next = accessLanes(state, instruction, group, next);
+                break;
+            case CMP_R_V:
+            case CMP_V_R:
+            case CMP_R_R: {
+                LaneWord lhs = instruction.opId == CMP_V_R ? value : *r1;
+                LaneWord rhs = instruction.opId == CMP_R_V ? value : instruction.opId == CMP_V_R ? *r1 : *r2;
+                state->cmpLhs = selectWord(group, lhs, state->cmpLhs);
+                state->cmpRhs = selectWord(group, rhs, state->cmpRhs);
+                state->cmpKind = selectWord(group, (LaneWord){0} + FLAGS_UNSIGNED, state->cmpKind);
+                break;
+            }
+            case JZ_A:
+            case JNZ_A:
+            case JN_A:
+            case JNN_A:
+            case JMP_A:
+            case JE_A:
+            case JNE_A:
+            case JL_A:
+            case JLE_A:
+            case JG_A:
+            case JGE_A:
+                next = selectWord(lanesTaken(state, instruction.opId), value, next);
+                break;
+            case ADD_R_V_R:
+            case ADD_R_R_R:
+            case ADC_R_V_R:
+            case ADC_R_R_R:
+            case SUB_R_V_R:
+            case SUB_V_R_R:
+            case SUB_R_R_R:
+            case SBB_R_V_R:
+            case SBB_V_R_R:
+            case SBB_R_R_R:
+            case MUL_R_V_R:
+            case MUL_R_R_R: {
+                bool threeRegisters = instruction.opId == ADD_R_R_R || instruction.opId == ADC_R_R_R ||
+                                      instruction.opId == SUB_R_R_R || instruction.opId == SBB_R_R_R ||
+                                      instruction.opId == MUL_R_R_R;
+                bool valueFirst = instruction.opId == SUB_V_R_R || instruction.opId == SBB_V_R_R;
+                LaneWord a = valueFirst ? value : *r1;
+                LaneWord b = valueFirst ? *r1 : threeRegisters ? *r2 : value;
+                dest = threeRegisters ? r3 : r2;
+                // high is what the 32 bit result of executeInstruction holds above bit 15
+                switch (instruction.opId) {
+                    case ADD_R_V_R: case ADD_R_R_R:
+                        low = a + b;
+                        high = (LaneWord)(low < a) & 1;
+                        break;
+                    case ADC_R_V_R: case ADC_R_R_R: {
+                        LaneWord sum = a + b;
+                        low = sum + ((LaneWord)lanesCarry(state) & 1);
+                        high = (LaneWord)((sum < a) | (low < sum)) & 1;
+                        break;
+                    }
+                    case SUB_R_V_R: case SUB_V_R_R: case SUB_R_R_R:
+                        low = a - b;
+                        high = (LaneWord)(a < b);
+                        break;
+                    case SBB_R_V_R: case SBB_V_R_R: case SBB_R_R_R: {
+                        LaneWord difference = a - b;
+                        LaneWord borrow = (LaneWord)lanesCarry(state) & 1;
+                        low = difference - borrow;
+                        high = (LaneWord)((a < b) | (difference < borrow));
+                        break;
+                    }
+                    default: {
+                        LaneWide product = __builtin_convertvector(a, LaneWide) * __builtin_convertvector(b, LaneWide);
+                        low = __builtin_convertvector(product, LaneWord);
+                        high = __builtin_convertvector(product >> 16, LaneWord);
+                        break;
+                    }
+                }
+                state->aluLow = selectWord(group, low, state->aluLow);
+                state->aluHigh = selectWord(group, high, state->aluHigh);
+                state->aluKind = selectWord(group, (LaneWord){0} + FLAGS_UNSIGNED, state->aluKind);
+                *dest = selectWord(group, low, *dest);
+                break;
+            }
+            case IMUL_R_V_R:
+            case IMUL_R_R_R: {
+                dest = instruction.opId == IMUL_R_R_R ? r3 : r2;
+                LaneWord b = instruction.opId == IMUL_R_R_R ? *r2 : value;
+                LaneWideSigned product = __builtin_convertvector((LaneMask)*r1, LaneWideSigned) *
+                                         __builtin_convertvector((LaneMask)b, LaneWideSigned);
+                low = __builtin_convertvector(product, LaneWord);
+                high = __builtin_convertvector(product >> 16, LaneWord);
+                state->aluLow = selectWord(group, low, state->aluLow);
+                state->aluHigh = selectWord(group, high, state->aluHigh);
+                state->aluKind = selectWord(group, (LaneWord){0} + FLAGS_SIGNED, state->aluKind);
+                *dest = selectWord(group, low, *dest);
+                break;
+            }
+            case PASS_R:
+                state->aluLow = selectWord(group, *r1, state->aluLow);
+                state->aluHigh = selectWord(group, (LaneWord){0}, state->aluHigh);
+                state->aluKind = selectWord(group, (LaneWord){0} + FLAGS_UNSIGNED, state->aluKind);
+                break;
+            case HLT:
+                for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                    if (group[lane]) { state->cpus[lane]->status = CPU_HALTED; }
+                }
+                state->running &= ~group;
+                break;
+            default:
+                serializeLanes(state, group);
+                continue;
+        }
+        state->PC = selectWord(group, next, state->PC);
+        state->budget += (LaneWord)group;
+    }
+
+    for (int lane = 0; lane < count && lane < LOCKSTEP_LANES; lane++) {
+        storeLane(state, lane, cpus[lane]);
+    }
+    free(state);
+}
+
+bool sameResult(CPU* a, CPU* b) {
+    return memcmp(a->regs, b->regs, sizeof(a->regs)) == 0 && a->PC == b->PC &&
+           a->stackptr == b->stackptr && a->cycles == b->cycles && a->status == b->status &&
+           flagZero(a) == flagZero(b) && flagNeg(a) == flagNeg(b) && flagCarry(a) == flagCarry(b) &&
+           flagEqu(a) == flagEqu(b) && flagNeq(a) == flagNeq(b) && flagGr(a) == flagGr(b) &&
+           flagGe(a) == flagGe(b) && flagLs(a) == flagLs(b) && flagLe(a) == flagLe(b) &&
+           memcmp(a->ram, b->ram, RAM_SIZE) == 0;
+}
+
+// Runs instances copies of the image, instance i starting with A = i
+int runSweep(char* ram, int instances, uint64_t maxCycles, bool verify) {
+    CPU** cpus = malloc(instances * sizeof(CPU*));
+    for (int i = 0; i < instances; i++) {
+        cpus[i] = initializeEmulator(ram);
+        cpus[i]->regs[REG_A] = (uint16_t)i;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < instances; i += LOCKSTEP_LANES) {
+        int count = instances - i < LOCKSTEP_LANES ? instances - i : LOCKSTEP_LANES;
+        runLockstep(cpus + i, count, maxCycles);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t cycles = 0;
+    int halted = 0;
+    int faulted = 0;
+    for (int i = 0; i < instances; i++) {
+        cycles += cpus[i]->cycles;
+        halted += cpus[i]->status == CPU_HALTED;
+        faulted += cpus[i]->status == CPU_FAULT;
+    }
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    double mips = seconds > 0 ? (double)cycles / seconds / 1e6 : 0;
+    printf(
+        HI_GREEN
+        "Instances - %d (%d halted, %d faulted)\n"
+        "Cycles - %llu\n"
+        "Wall time - %.6f s\n"
+        "Aggregate MIPS - %.2f\n"
+        COL_RESET, instances, halted, faulted, (unsigned long long)cycles, seconds, mips
+    );
+
+    int mismatches = 0;
+    if (verify) {
+        for (int i = 0; i < instances; i++) {
+            CPU* reference = initializeEmulator(ram);
+            reference->regs[REG_A] = (uint16_t)i;
+            runEmulator(reference, maxCycles);
+            if (!sameResult(reference, cpus[i])) {
+                printf(HI_RED "Lane mismatch in instance %d (PC %u vs %u, cycles %llu vs %llu)\n" COL_RESET,
+                    i, reference->PC, cpus[i]->PC, (unsigned long long)reference->cycles, (unsigned long long)cpus[i]->cycles);
+                mismatches++;
+            }
+            freeEmulator(reference);
+        }
+        printf(HI_GREEN "Verified %d instances against the switch engine, %d mismatches\n" COL_RESET, instances, mismatches);
+    }
+
+    for (int i = 0; i < instances; i++) {
+        freeEmulator(cpus[i]);
+    }
+    free(cpus);
+    return mismatches > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "emulator.h"
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+// 16 lanes of 16 bit state fill one AVX2 register (half an AVX-512 one)
+#define LOCKSTEP_LANES 16
+
+void runLockstep(CPU **cpus, int count, uint64_t maxCycles);
+
+int runSweep(char *ram, int instances, uint64_t maxCycles, bool verify);
+
+#endif
@@ -6,9 +6,25 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include "emulator.h"
 #include "assembler.h"
+#include "image.h"
+#include "batch.h"
+#include "lockstep.h"
+#include "snapshot.h"
+#include "object.h"
+#include "watch.h"
+#include "profile.h"
+#include "trace.h"
+#include "timeline.h"
+#include "debugger.h"
+#include "differential.h"
+#include "bus.h"
+#include "scheduler.h"
 #include "utils.h"
 
 #define HI_PURPLE "\e[0;95m"
@@ -18,8 +34,147 @@
 #define COL_RESET "\x1b[0m"
 #define SCREEN_CLEAR "\033[2J \033[H"
 
-int startEmulator(char* ram) {
-    CPU* cpu = initializeEmulator(ram);
+// Waits for a line on stdin, reloading the watched source whenever it changes
+static char* readCommand(char* command, int size, CPU* cpu, WatchState* watch, Timeline* timeline) {
+    while (watch != NULL) {
+        struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { watch->fd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) == -1) { continue; }
+        if (fds[1].revents & POLLIN && watchChanged(watch)) {
+            WatchReport report;
+            if (reloadWatch(watch, cpu, &report) == EXIT_SUCCESS) {
+                printf(HI_GREEN "\n%s changed (%d lines", watch->path, report.changedLines);
+                if (report.changedLines > 0) { printf(", %d-%d", report.firstLine, report.lastLine); }
+                printf("): patched %d words %s in %.3f us\n" COL_RESET, report.patchedWords,
+                    report.incremental ? "incrementally" : "after a full reassembly", (double)report.nanos / 1000.0);
+                if (report.patchedWords > 0) { rebaseTimeline(timeline, cpu); }
+            } else {
+                printf(HI_RED "%s changed but does not assemble, still running the old program\n" COL_RESET, watch->path);
+            }
+            printf(HI_PURPLE "LOL16> " COL_RESET);
+            fflush(stdout);
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) { break; }
+    }
+    return fgets(command, size, stdin);
+}
+
+bool parseCount(const char* string, uint64_t* count) {
+    char* endptr;
+    errno = 0;
+    unsigned long long num = strtoull(string, &endptr, 0);
+    if (errno != 0 || *endptr != '\0' || endptr == string || *string == '-') { return false; }
+    *count = num;
+    return true;
+}
+
+// Parses a decimal, 0x or 0b address, complaining when it is not one
+static bool parseAddress(char* token, uint16_t* address) {
+    char* endptr;
+    unsigned long num = strtoul(token, &endptr, 10);
+    if (strncmp(token, "0x", 2) == 0) {
+        token[1] = '0';
+        num = strtoul(token, &endptr, 16);
+    }
+    if (strncmp(token, "0b", 2) == 0) {
+        token[1] = '0';
+        num = strtoul(token, &endptr, 2);
+    }
+    if (*endptr != '\0' || endptr == token) {
+        printf(HI_RED "Could not parse input address!\n" COL_RESET);
+        return false;
+    }
+    if (num > UINT16_MAX) {
+        printf(HI_RED "Input address does not fit within bounds of memory!\n" COL_RESET);
+        return false;
+    }
+    *address = (uint16_t)num;
+    return true;
+}
+
+// Prints where a timeline command left the CPU
+static void printTimelineState(CPU* cpu, const char* message, uint64_t nanos) {
+    printf(SCREEN_CLEAR);
+    printf(HI_GREEN "%s, now at cycle %llu (%.3f ms)\n" COL_RESET, message, (unsigned long long)cpu->cycles, (double)nanos / 1e6);
+    fprintf(cpu->log, HI_YELLOW "\nCPU: " COL_RESET);
+    printCPUState(cpu);
+    fprintf(cpu->log, "\n");
+}
+
+static uint64_t elapsedNanos(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (uint64_t)(end.tv_sec - start->tv_sec) * 1000000000ull + (uint64_t)(end.tv_nsec - start->tv_nsec);
+}
+
+static const char* watchModeName(uint8_t mode) {
+    switch (mode) {
+        case WATCH_READ: return "reads";
+        case WATCH_WRITE: return "writes";
+        default: return "reads and writes";
+    }
+}
+
+static void describeHit(char* message, size_t size, const Debugger* debugger, DebugStop stop) {
+    switch (stop) {
+        case DEBUG_BREAKPOINT:
+            snprintf(message, size, "Breakpoint at $%04X", debugger->hitAddress);
+            break;
+        case DEBUG_WATCHPOINT:
+            snprintf(message, size, "Watchpoint: %s $%04X", debugger->hitMode == WATCH_READ ? "read of" : "write to", debugger->hitAddress);
+            break;
+        case DEBUG_HALT:
+            snprintf(message, size, "CPU halted");
+            break;
+        case DEBUG_FAULT:
+            snprintf(message, size, "CPU faulted");
+            break;
+    }
+}
+
+static void listPoints(const Debugger* debugger) {
+    int count = 0;
+    for (int word = 0; word < RAM_SIZE / 64; word++) {
+        for (uint64_t bits = debugger->breakpoints[word]; bits != 0; bits &= bits - 1) {
+            printf(HI_GREEN "Breakpoint at $%04X\n" COL_RESET, word * 64 + __builtin_ctzll(bits));
+            count++;
+        }
+        for (uint64_t bits = debugger->watchpoints[word]; bits != 0; bits &= bits - 1) {
+            int address = word * 64 + __builtin_ctzll(bits);
+            printf(HI_GREEN "Watching $%04X for %s\n" COL_RESET, address, watchModeName(debugger->watchModes[address]));
+            count++;
+        }
+    }
+    if (count == 0) { printf(HI_GREEN "No breakpoints or watchpoints\n" COL_RESET); }
+}
+
+// Checkpoints and snapshots hold neither the devices nor the pending events,
+// and replaying would repeat console output and keyboard reads
+static bool refuseWithDevices(const CPU* cpu, const char* command) {
+    if (cpu->bus == NULL) { return false; }
+    printf(HI_RED "%s cannot replay device I/O! Run without --devices to go back in time.\n" COL_RESET, command);
+    return true;
+}
+
+// -r images load straight into the CPU's RAM, anything else is copied from ram
+CPU* createCPU(char* ram, const char* imagePath, bool devices) {
+    CPU* cpu;
+    if (imagePath != NULL) {
+        cpu = initializeEmulator(NULL);
+        if (loadRAMFile(imagePath, cpu) == EXIT_FAILURE) {
+            freeEmulator(cpu);
+            return NULL;
+        }
+    } else {
+        cpu = initializeEmulator(ram);
+    }
+    if (devices) { attachDevices(cpu, stdout, stdin); }
+    return cpu;
+}
+
+int startEmulator(CPU* cpu, WatchState* watch, uint64_t checkpointInterval, size_t checkpointBudget) {
+    Snapshot* snapshot = NULL;
+    Timeline* timeline = createTimeline(cpu, checkpointInterval, checkpointBudget);
+    Debugger* debugger = calloc(1, sizeof(Debugger));
 
     printf(HI_YELLOW
         HI_YELLOW "---------------------------------------------\n"
@@ -27,13 +182,18 @@ int startEmulator(char* ram) {
         HI_YELLOW "---------------------------------------------\n"
         COL_RESET
     );
+    if (watch != NULL) {
+        // Unbuffered, so poll on stdin never misses a line stdio already read
+        setvbuf(stdin, NULL, _IONBF, 0);
+        printf(HI_GREEN "Watching %s for changes\n" COL_RESET, watch->path);
+    }
 
     bool isRunning = true;
     while (isRunning) {
         char command[100];
         printf(HI_PURPLE "LOL16> " COL_RESET);
         fflush(stdout);
-        fgets(command, sizeof(command), stdin);
+        if (readCommand(command, sizeof(command), cpu, watch, timeline) == NULL) { break; }
         command[strcspn(command, "\n")] = '\0';
         if (*command == '\0') { continue; }
         char* token = strtok(command, " ");
@@ -55,102 +215,476 @@ int startEmulator(char* ram) {
             }
             Instruction instruction = parseBytes(value);
             printf(SCREEN_CLEAR);
-            printInstructionStruct(&instruction);
+            printInstructionStruct(stdout, &instruction);
             executeInstruction(instruction, cpu, true);
+            // Not part of the program, so replay could not reproduce what follows
+            rebaseTimeline(timeline, cpu);
         } else if (strcmp(token, "step") == 0) {
             printf(SCREEN_CLEAR);
+            pollEvents(cpu);
             tickComputer(cpu, true);
-        } else if (strcmp(token, "m") == 0) {
+            recordTimeline(timeline, cpu);
+        } else if (strcmp(token, "goto") == 0) {
+            if (refuseWithDevices(cpu, token)) { continue; }
             token = strtok(NULL, " ");
-            if (token == NULL) { continue; }
-            char* endptr;
-            unsigned long num = strtoul(token, &endptr, 10);
-            if (strncmp(token, "0x", 2) == 0) {
-                token[1] = '0';
-                num = strtoul(token, &endptr, 16);
+            uint64_t cycle;
+            if (token == NULL || !parseCount(token, &cycle)) {
+                printf(HI_RED "Expected a cycle number!\n" COL_RESET);
+                continue;
             }
-            if (strncmp(token, "0b", 2) == 0) {
-                token[1] = '0';
-                num = strtoul(token, &endptr, 2);
+            if (cycle < timeline->checkpoints[0].cycle) {
+                printf(HI_RED "History only goes back to cycle %llu!\n" COL_RESET, (unsigned long long)timeline->checkpoints[0].cycle);
+                continue;
             }
-            if (*endptr != '\0' || endptr == token) {
-                printf(HI_RED "Could not parse input address!\n" COL_RESET);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            seekTimeline(timeline, cpu, cycle);
+            printTimelineState(cpu, cpu->cycles == cycle ? "Reached the cycle" : "Stopped before the cycle", elapsedNanos(&start));
+        } else if (strcmp(token, "rstep") == 0) {
+            if (refuseWithDevices(cpu, token)) { continue; }
+            if (cpu->cycles <= timeline->checkpoints[0].cycle) {
+                printf(HI_RED "Already at the start of the history!\n" COL_RESET);
                 continue;
             }
-            if (num > UINT16_MAX) {
-                printf(HI_RED "Input address does not fit within bounds of memory!\n" COL_RESET);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            seekTimeline(timeline, cpu, cpu->cycles - 1);
+            printTimelineState(cpu, "Stepped back", elapsedNanos(&start));
+        } else if (strcmp(token, "rcontinue") == 0) {
+            if (refuseWithDevices(cpu, token)) { continue; }
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (!reverseTimeline(timeline, cpu, debuggerStop, debugger)) {
+                printTimelineState(cpu, "No earlier hit, ran back to the start", elapsedNanos(&start));
                 continue;
             }
-
-            uint16_t address = (uint16_t)num;
+            // The search asked about later cycles too, so ask again about this one
+            debuggerStop(cpu, debugger);
+            char message[64];
+            describeHit(message, sizeof(message), debugger, debugger->hitMode == 0 ? DEBUG_BREAKPOINT : DEBUG_WATCHPOINT);
+            printTimelineState(cpu, message, elapsedNanos(&start));
+        } else if (strcmp(token, "break") == 0) {
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                listPoints(debugger);
+                continue;
+            }
+            uint16_t address;
+            if (!parseAddress(token, &address)) { continue; }
+            setAddress(debugger->breakpoints, address, true);
+            printf(HI_GREEN "Breakpoint at $%04X\n" COL_RESET, address);
+        } else if (strcmp(token, "watch") == 0) {
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                listPoints(debugger);
+                continue;
+            }
+            uint16_t address;
+            if (!parseAddress(token, &address)) { continue; }
+            token = strtok(NULL, " ");
+            uint8_t mode = WATCH_READ | WATCH_WRITE;
+            if (token != NULL && strcmp(token, "r") == 0) {
+                mode = WATCH_READ;
+            } else if (token != NULL && strcmp(token, "w") == 0) {
+                mode = WATCH_WRITE;
+            } else if (token != NULL) {
+                printf(HI_RED "Expected r or w, got %s!\n" COL_RESET, token);
+                continue;
+            }
+            setWatchpoint(debugger, address, mode);
+            printf(HI_GREEN "Watching $%04X for %s\n" COL_RESET, address, watchModeName(mode));
+        } else if (strcmp(token, "delete") == 0) {
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                memset(debugger, 0, sizeof(Debugger));
+                printf(HI_GREEN "Deleted all breakpoints and watchpoints\n" COL_RESET);
+                continue;
+            }
+            uint16_t address;
+            if (!parseAddress(token, &address)) { continue; }
+            setAddress(debugger->breakpoints, address, false);
+            setWatchpoint(debugger, address, 0);
+            printf(HI_GREEN "Deleted breakpoints and watchpoints at $%04X\n" COL_RESET, address);
+        } else if (strcmp(token, "continue") == 0) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            uint64_t cycles = cpu->cycles;
+            DebugStop stop = continueDebugger(debugger, cpu, timeline);
+            uint64_t nanos = elapsedNanos(&start);
+            char message[64];
+            describeHit(message, sizeof(message), debugger, stop);
+            printTimelineState(cpu, message, nanos);
+            printf(HI_GREEN "Ran %llu cycles\n" COL_RESET, (unsigned long long)(cpu->cycles - cycles));
+        } else if (strcmp(token, "checkpoints") == 0) {
+            printf(HI_GREEN "%d checkpoints every %llu cycles, %.1f of %.1f MiB\n" COL_RESET, timeline->count,
+                (unsigned long long)timeline->interval, (double)timeline->used / (1 << 20), (double)timeline->budget / (1 << 20));
+        } else if (strcmp(token, "snap") == 0) {
+            if (refuseWithDevices(cpu, token)) { continue; }
+            if (snapshot != NULL) { freeSnapshot(snapshot); }
+            snapshot = takeSnapshot(cpu);
+            printf(HI_GREEN "Snapshot taken at PC %u, cycle %llu\n" COL_RESET, cpu->PC, (unsigned long long)cpu->cycles);
+        } else if (strcmp(token, "restore") == 0) {
+            if (refuseWithDevices(cpu, token)) { continue; }
+            if (snapshot == NULL) {
+                printf(HI_RED "No snapshot to restore! Take one with snap first.\n" COL_RESET);
+                continue;
+            }
+            int pages = restoreSnapshot(cpu, snapshot);
+            rebaseTimeline(timeline, cpu);
+            printf(HI_GREEN "Restored %d dirty pages in %.3f us (%llu restores, %.3f us average)\n" COL_RESET,
+                pages, (double)snapshot->lastRestoreNanos / 1000.0, (unsigned long long)snapshot->restores,
+                (double)snapshot->restoreNanos / 1000.0 / (double)snapshot->restores);
+        } else if (strcmp(token, "m") == 0) {
+            token = strtok(NULL, " ");
+            if (token == NULL) { continue; }
+            uint16_t address;
+            if (!parseAddress(token, &address)) { continue; }
             for (int i = 0; i < 10; i++)
             {
-                printf(HI_GREEN "%u : %u\n" COL_RESET, address+i, (uint32_t)cpu->ram[address+i] & 255);
+                printf(HI_GREEN "%u : %u\n" COL_RESET, (uint16_t)(address+i), (uint32_t)cpu->ram[(uint16_t)(address+i)] & 255);
             }
         }
     }
 
-    free(cpu);
+    if (snapshot != NULL) { freeSnapshot(snapshot); }
+    free(debugger);
+    freeTimeline(timeline);
+    freeEmulator(cpu);
     return EXIT_SUCCESS;
 }
 
+// Runs cpu to completion and frees it. With a profile path the run goes through the profiling
+// interpreter whatever the engine, the report is printed after the summary and
+// the dump written to the path. A trace writer likewise forces the tracing
+// interpreter.
+int runHeadless(CPU* cpu, Engine engine, uint64_t maxCycles, const char* profilePath, TraceWriter* trace) {
+    Profile* profile = profilePath != NULL ? createProfile() : NULL;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    StopReason reason;
+    if (profile != NULL) {
+        reason = runProfiled(cpu, profile, maxCycles);
+    } else if (trace != NULL) {
+        reason = runTraced(cpu, trace, maxCycles);
+    } else {
+        reason = runEngine(cpu, engine, maxCycles);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    double mips = seconds > 0 ? (double)cpu->cycles / seconds / 1e6 : 0;
+    printf(
+        HI_GREEN
+        "Stop reason - %s (PC %u)\n"
+        "Cycles - %llu\n"
+        "Wall time - %.6f s\n"
+        "MIPS - %.2f\n"
+        COL_RESET, stopReasonName(reason), cpu->PC, (unsigned long long)cpu->cycles, seconds, mips
+    );
+
+    int status = reason == STOP_FAULT ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (profile != NULL) {
+        printProfile(stdout, profile, cpu);
+        if (writeProfileDump(profilePath, profile, cpu) == EXIT_FAILURE) { status = EXIT_FAILURE; }
+        free(profile);
+    }
+    if (trace != NULL) {
+        printf(HI_GREEN "Traced %llu instructions\n" COL_RESET, (unsigned long long)trace->written);
+        if (closeTrace(trace) == EXIT_FAILURE) { status = EXIT_FAILURE; }
+    }
+    freeEmulator(cpu);
+    return status;
+}
+
+void printUsage() {
+    printf(HI_YELLOW
+        "Usage: lol16 [-a -r] file [-O] [--listing] [--run [--max-cycles N] [--engine switch|threaded|jit|lockstep]]\n"
+        "       lol16 [-a -r] file -o image\n"
+        "       lol16 -a file [-O] -c object\n"
+        "       lol16 [-a -r] file --profile dump [--max-cycles N]  (run with a per-address profile)\n"
+        "       lol16 [-a -r] file [--checkpoint-interval N] [--checkpoint-budget MiB]  (console)\n"
+        "       lol16 [-a -r] file --devices [--run ...]  (map console, keyboard, clock/timer and DMA at $FC00-$FFFF)\n"
+        "       lol16 -a file --watch  (patch edits to file into the running console)\n"
+        "       lol16 -a file... [-O] [--threads N] [-o image | --run ...]  (assemble and link several sources)\n"
+        "       lol16 [-a -r] file --trace out [--trace-size RECORDS] [--max-cycles N]  (record a binary trace)\n"
+        "       lol16 trace out [--pc ADDR] [--reg R] [--write ADDR] [--op OPCODE] [--last N] [--summary]\n"
+        "       lol16 link -o image object...\n"
+        "       lol16 --batch manifest [--threads N] [--max-cycles N] [--engine switch|threaded|jit|lockstep]\n"
+        "       lol16 [-a -r] file --sweep N [--max-cycles N] [--verify]\n"
+        "       lol16 [-a -r] file --diff [--engine threaded|jit|lockstep] [--diff-interval N] [--max-cycles N] [--devices]\n"
+        "       lol16 fuzz [--engine threaded|jit|lockstep] [--iterations N] [--seed N] [--save image] ...\n"
+        COL_RESET);
+}
+
+static const struct option longOptions[] = {
+    { "run",        no_argument,       NULL, 'R' },
+    { "max-cycles", required_argument, NULL, 'm' },
+    { "engine",     required_argument, NULL, 'e' },
+    { "batch",      required_argument, NULL, 'b' },
+    { "threads",    required_argument, NULL, 't' },
+    { "sweep",      required_argument, NULL, 's' },
+    { "verify",     no_argument,       NULL, 'v' },
+    { "listing",    no_argument,       NULL, 'l' },
+    { "watch",      no_argument,       NULL, 'w' },
+    { "profile",    required_argument, NULL, 'p' },
+    { "trace",      required_argument, NULL, 'T' },
+    { "trace-size", required_argument, NULL, 'z' },
+    { "checkpoint-interval", required_argument, NULL, 'i' },
+    { "checkpoint-budget",   required_argument, NULL, 'B' },
+    { "devices",       no_argument,       NULL, 'd' },
+    { "diff",          no_argument,       NULL, 'D' },
+    { "diff-interval", required_argument, NULL, 'I' },
+    { NULL,         0,                 NULL, 0   }
+};
+
+// lol16 link -o image object...
+int runLink(int argc, char const *argv[]) {
+    const char* imagePath = NULL;
+    const char** objectPaths = malloc(argc * sizeof(char*));
+    int count = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            imagePath = argv[++i];
+        } else {
+            objectPaths[count++] = argv[i];
+        }
+    }
+    if (imagePath == NULL || count == 0) {
+        printUsage();
+        free(objectPaths);
+        return EXIT_FAILURE;
+    }
+    int status = linkObjects(imagePath, objectPaths, count, 0xA000);
+    free(objectPaths);
+    return status;
+}
+
 int main(int argc, char const *argv[]) {
-    if (argc > 1) {
-        if (strcmp(argv[1], "-r") == 0) {
-            if (argc > 2) {
-                char ram[65536];
-                FILE* file = fopen(argv[2], "r");
-                if (file == NULL) {
-                    printf(HI_RED "Fatal error! Cannot find file %s\n" COL_RESET, argv[2]);
+    if (argc > 1 && strcmp(argv[1], "link") == 0) {
+        return runLink(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+        return runTraceTool(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "fuzz") == 0) {
+        return runFuzzTool(argc, argv);
+    }
+    const char* ramPath = NULL;
+    const char** srcPaths = malloc(argc * sizeof(char*));
+    int srcCount = 0;
+    const char* outPath = NULL;
+    const char* objectPath = NULL;
+    bool headless = false;
+    uint64_t maxCycles = UINT64_MAX;
+    Engine engine = ENGINE_SWITCH;
+    const char* batchPath = NULL;
+    uint64_t threads = 0;
+    uint64_t sweep = 0;
+    bool verify = false;
+    bool listing = false;
+    bool watching = false;
+    bool optimize = false;
+    const char* profilePath = NULL;
+    const char* tracePath = NULL;
+    uint64_t traceSize = TRACE_DEFAULT_CAPACITY;
+    uint64_t checkpointInterval = TIMELINE_DEFAULT_INTERVAL;
+    uint64_t checkpointBudget = TIMELINE_DEFAULT_BUDGET >> 20;
+    bool devices = false;
+    bool differential = false;
+    uint64_t diffInterval = DIFFERENTIAL_DEFAULT_INTERVAL;
+
+    int opt;
+    opterr = 0;
+    while ((opt = getopt_long(argc, (char* const*)argv, ":r:a:o:c:O", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                ramPath = optarg;
+                break;
+            case 'a':
+                srcPaths[srcCount++] = optarg;
+                break;
+            case 'o':
+                outPath = optarg;
+                break;
+            case 'c':
+                objectPath = optarg;
+                break;
+            case 'R':
+                headless = true;
+                break;
+            case 'm':
+                if (!parseCount(optarg, &maxCycles)) {
+                    printf(HI_RED "Fatal error! %s is not a valid cycle count!\n" COL_RESET, optarg);
                     return EXIT_FAILURE;
                 }
-                char c;
-                int i = 0;
-                while ((c = fgetc(file)) != EOF) {
-                    ram[i] = c;
-                    i++;
+                break;
+            case 'b':
+                batchPath = optarg;
+                break;
+            case 't':
+                if (!parseCount(optarg, &threads) || threads > 1024) {
+                    printf(HI_RED "Fatal error! %s is not a valid thread count!\n" COL_RESET, optarg);
+                    return EXIT_FAILURE;
                 }
-                fflush(stdout);
-
-                return startEmulator(ram);
-            } else {
-                printf(HI_RED "Fatal error! No ram binary specified!\n" COL_RESET);
-                return EXIT_FAILURE;
-            }
-        } else if (strcmp(argv[1], "-a") == 0) {
-            if (argc > 2) {
-                FILE* file = fopen(argv[2], "rb");
-                if (!file) {
-                    printf(HI_RED "Source file not found!\n" COL_RESET);
+                break;
+            case 's':
+                if (!parseCount(optarg, &sweep) || sweep == 0 || sweep > 1000000) {
+                    printf(HI_RED "Fatal error! %s is not a valid instance count!\n" COL_RESET, optarg);
                     return EXIT_FAILURE;
                 }
-
-                fseek(file, 0, SEEK_END);
-                long size = ftell(file);
-                rewind(file);
-
-                char* src = (char*)malloc(size + 1); 
-                if (!src) {
-                    fclose(file);
+                break;
+            case 'v':
+                verify = true;
+                break;
+            case 'l':
+                listing = true;
+                break;
+            case 'w':
+                watching = true;
+                break;
+            case 'O':
+                optimize = true;
+                break;
+            case 'p':
+                profilePath = optarg;
+                headless = true;
+                break;
+            case 'T':
+                tracePath = optarg;
+                headless = true;
+                break;
+            case 'i':
+                if (!parseCount(optarg, &checkpointInterval) || checkpointInterval == 0) {
+                    printf(HI_RED "Fatal error! %s is not a valid checkpoint interval!\n" COL_RESET, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                if (!parseCount(optarg, &checkpointBudget) || checkpointBudget == 0 || checkpointBudget > (1 << 20)) {
+                    printf(HI_RED "Fatal error! %s is not a valid checkpoint budget in MiB!\n" COL_RESET, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                devices = true;
+                break;
+            case 'D':
+                differential = true;
+                break;
+            case 'I':
+                if (!parseCount(optarg, &diffInterval) || diffInterval == 0) {
+                    printf(HI_RED "Fatal error! %s is not a valid comparison interval!\n" COL_RESET, optarg);
+                    return EXIT_FAILURE;
+                }
+                differential = true;
+                break;
+            case 'z':
+                if (!parseCount(optarg, &traceSize) || traceSize == 0 || traceSize > UINT32_MAX) {
+                    printf(HI_RED "Fatal error! %s is not a valid trace size!\n" COL_RESET, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'e':
+                if (!parseEngine(optarg, &engine)) {
+                    printf(HI_RED "Fatal error! Unknown engine %s!\n" COL_RESET, optarg);
                     return EXIT_FAILURE;
                 }
+                break;
+            case ':':
+                if (optopt == 'r') {
+                    printf(HI_RED "Fatal error! No ram binary specified!\n" COL_RESET);
+                } else if (optopt == 'a') {
+                    printf(HI_RED "Fatal error! No ram binary provided\n" COL_RESET);
+                } else if (optopt == 'o') {
+                    printf(HI_RED "Fatal error! No output image specified!\n" COL_RESET);
+                } else if (optopt == 'c') {
+                    printf(HI_RED "Fatal error! No output object specified!\n" COL_RESET);
+                } else {
+                    printUsage();
+                }
+                return EXIT_FAILURE;
+            default:
+                printUsage();
+                return EXIT_FAILURE;
+        }
+    }
 
-                fread(src, 1, size, file);
-                src[size] = '\0';
-                fclose(file);
+    if (devices && (batchPath != NULL || sweep > 0)) {
+        printf(HI_RED "Fatal error! --devices cannot be combined with --batch or --sweep!\n" COL_RESET);
+        return EXIT_FAILURE;
+    }
+    if (devices && engine == ENGINE_LOCKSTEP && !differential) {
+        printf(HI_RED "Fatal error! The lockstep engine runs without devices!\n" COL_RESET);
+        return EXIT_FAILURE;
+    }
+    if (batchPath != NULL) {
+        return runBatch(batchPath, engine, maxCycles, (int)threads);
+    }
 
-                char ram[65536];
-                int status = assembleIntoRAM(src, ram, 0xA000);
-                free(src);
-                if (status == EXIT_FAILURE) { return EXIT_FAILURE; }
-                return startEmulator(ram);
-            } else {
-                printf(HI_RED "Fatal error! No ram binary provided\n" COL_RESET);
-                return EXIT_FAILURE;
-            }
-        } else {
-            printf(HI_YELLOW "Usage: lol16 [-a -r] file\n" COL_RESET);
+    // Further sources can follow -a as plain arguments
+    for (; srcCount > 0 && optind < argc; optind++) {
+        srcPaths[srcCount++] = argv[optind];
+    }
+
+    if (objectPath != NULL) {
+        if (srcCount != 1) {
+            printUsage();
+            return EXIT_FAILURE;
+        }
+        return assembleObjectFile(srcPaths[0], objectPath, listing ? stdout : NULL, optimize);
+    }
+
+    char ram[65536];
+    if (watching) {
+        if (srcCount != 1 || ramPath != NULL) {
+            printUsage();
+            return EXIT_FAILURE;
+        }
+        WatchState* watch = createWatch(srcPaths[0], ram, 0xA000);
+        if (watch == NULL) { return EXIT_FAILURE; }
+        int status = startEmulator(createCPU(ram, NULL, devices), watch, checkpointInterval, (size_t)checkpointBudget << 20);
+        freeWatch(watch);
+        return status;
+    }
+    // Only the modes that build several CPUs or write the RAM back out need the
+    // image in ram; the others map it straight into their CPU
+    bool staged = outPath != NULL || differential || sweep > 0;
+    if (ramPath != NULL) {
+        if (staged && readRAMFile(ramPath, ram) == EXIT_FAILURE) { return EXIT_FAILURE; }
+    } else if (srcCount == 1) {
+        if (assembleFile(srcPaths[0], ram, listing ? stdout : NULL, optimize) == EXIT_FAILURE) { return EXIT_FAILURE; }
+    } else if (srcCount > 1) {
+        if (assembleSources(srcPaths, srcCount, (int)threads, ram, listing, optimize) == EXIT_FAILURE) { return EXIT_FAILURE; }
+    } else {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    if (outPath != NULL) {
+        return writeImageFile(outPath, ram);
+    }
+    if (differential) {
+        return runDiff(ram, engine, maxCycles, diffInterval, devices);
+    }
+    if (sweep > 0) {
+        return runSweep(ram, (int)sweep, maxCycles, verify);
+    }
+    if (headless) {
+        if (profilePath != NULL && tracePath != NULL) {
+            printf(HI_RED "Fatal error! --profile and --trace cannot be combined!\n" COL_RESET);
+            return EXIT_FAILURE;
+        }
+        CPU* cpu = createCPU(ram, ramPath, devices);
+        if (cpu == NULL) { return EXIT_FAILURE; }
+        TraceWriter* trace = NULL;
+        if (tracePath != NULL && (trace = createTrace(tracePath, (uint32_t)traceSize)) == NULL) {
+            freeEmulator(cpu);
             return EXIT_FAILURE;
         }
+        return runHeadless(cpu, engine, maxCycles, profilePath, trace);
     }
+    CPU* cpu = createCPU(ram, ramPath, devices);
+    if (cpu == NULL) { return EXIT_FAILURE; }
+    return startEmulator(cpu, NULL, checkpointInterval, (size_t)checkpointBudget << 20);
 }
@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "symbols.h"
+#include "image.h"
+#include "object.h"
+#include "utils.h"
+
+static bool isLocal(const char* name) {
+    return name[0] == '.';
+}
+
+int writeObjectFile(const char* path, ObjectModule* module) {
+    uint32_t stringSize = 0;
+    for (int i = 0; i < module->symbols->count; i++) {
+        stringSize += strlen(module->symbols->symbols[i].name) + 1;
+    }
+    uint32_t tableSize = OBJECT_HEADER_SIZE + OBJECT_SECTION_SIZE +
+                         module->symbols->count * OBJECT_SYMBOL_SIZE +
+                         module->relocationCount * OBJECT_RELOCATION_SIZE;
+    uint32_t fileSize = tableSize + stringSize + module->size;
+    uint8_t* file = calloc(1, fileSize);
+
+    memcpy(file, OBJECT_MAGIC, 4);
+    put16(file + 4, OBJECT_VERSION);
+    put16(file + 6, 1);
+    put32(file + 8, module->symbols->count);
+    put32(file + 12, module->relocationCount);
+    put32(file + 16, stringSize);
+
+    uint8_t* section = file + OBJECT_HEADER_SIZE;
+    put32(section, module->size);
+    put32(section + 4, tableSize + stringSize);
+    memcpy(file + tableSize + stringSize, module->code, module->size);
+
+    uint8_t* symbol = section + OBJECT_SECTION_SIZE;
+    uint32_t nameOffset = 0;
+    for (int i = 0; i < module->symbols->count; i++, symbol += OBJECT_SYMBOL_SIZE) {
+        Symbol* entry = &module->symbols->symbols[i];
+        put32(symbol, nameOffset);
+        put16(symbol + 4, entry->defined ? 0 : OBJECT_UNDEFINED);
+        put16(symbol + 6, entry->address);
+        strcpy((char*)file + tableSize + nameOffset, entry->name);
+        nameOffset += strlen(entry->name) + 1;
+    }
+
+    uint8_t* relocation = symbol;
+    for (int i = 0; i < module->relocationCount; i++, relocation += OBJECT_RELOCATION_SIZE) {
+        put16(relocation, 0);
+        put16(relocation + 2, module->relocations[i].offset);
+        put32(relocation + 4, module->relocations[i].symbol);
+    }
+    put32(file + 20, fnv1a(2166136261u, file + OBJECT_HEADER_SIZE, fileSize - OBJECT_HEADER_SIZE));
+
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        printf(HI_RED "Fatal error! Cannot write file %s\n" COL_RESET, path);
+        free(file);
+        return EXIT_FAILURE;
+    }
+    bool written = fwrite(file, 1, fileSize, out) == fileSize;
+    written = fclose(out) == 0 && written;
+    free(file);
+    if (!written) {
+        printf(HI_RED "Fatal error! Failed writing %s\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int assembleObjectFile(const char* sourcePath, const char* objectPath, FILE* log, bool optimize) {
+    FILE* source = fopen(sourcePath, "r");
+    if (!source) {
+        printf(HI_RED "Source file not found!\n" COL_RESET);
+        return EXIT_FAILURE;
+    }
+    char* code = malloc(RAM_SIZE);
+    Peephole peephole;
+    ObjectModule module = { .code = code, .capacity = RAM_SIZE, .peephole = optimize ? &peephole : NULL };
+    int status = assembleModule(source, &module, log);
+    fclose(source);
+    if (status == EXIT_SUCCESS && optimize) {
+        printf(HI_GREEN "Optimizer removed %d instructions\n" COL_RESET, peephole.removed);
+    }
+
+    for (int i = 0; status == EXIT_SUCCESS && i < module.relocationCount; i++) {
+        Symbol* symbol = &module.symbols->symbols[module.relocations[i].symbol];
+        if (isLocal(symbol->name) && !symbol->defined) {
+            printf(HI_RED "%d: Local label %s is never defined!\n" COL_RESET, module.relocations[i].line+1, symbol->name);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (status == EXIT_SUCCESS) {
+        status = writeObjectFile(objectPath, &module);
+    }
+    freeObjectModule(&module);
+    free(code);
+    return status;
+}
+
+// Reads and validates an object file into module, with its code malloc'd
+int readObjectFile(const char* path, ObjectModule* module) {
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        printf(HI_RED "Fatal error! Cannot find file %s\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    fseek(in, 0, SEEK_END);
+    long fileSize = ftell(in);
+    rewind(in);
+    uint8_t* file = malloc(fileSize > 0 ? fileSize : 1);
+    bool read = fileSize > 0 && fread(file, 1, fileSize, in) == (size_t)fileSize;
+    fclose(in);
+
+    size_t size = read ? (size_t)fileSize : 0;
+    const char* problem = NULL;
+    uint32_t symbols = 0, relocations = 0, stringSize = 0, tableSize = 0;
+    if (size < OBJECT_HEADER_SIZE || memcmp(file, OBJECT_MAGIC, 4) != 0) {
+        problem = "is not a LOL16 object file";
+    } else if (get16(file + 4) != OBJECT_VERSION || get16(file + 6) != 1) {
+        problem = "has an unsupported version";
+    } else if (fnv1a(2166136261u, file + OBJECT_HEADER_SIZE, size - OBJECT_HEADER_SIZE) != get32(file + 20)) {
+        problem = "fails its checksum";
+    } else {
+        symbols = get32(file + 8);
+        relocations = get32(file + 12);
+        stringSize = get32(file + 16);
+        tableSize = OBJECT_HEADER_SIZE + OBJECT_SECTION_SIZE;
+        if (symbols > size || relocations > size || stringSize > size ||
+            (uint64_t)tableSize + (uint64_t)symbols * OBJECT_SYMBOL_SIZE +
+            (uint64_t)relocations * OBJECT_RELOCATION_SIZE + stringSize > size) {
+            problem = "is truncated";
+        } else {
+            tableSize += symbols * OBJECT_SYMBOL_SIZE + relocations * OBJECT_RELOCATION_SIZE;
+        }
+    }
+
+    uint8_t* section = file + OBJECT_HEADER_SIZE;
+    uint32_t codeSize = problem == NULL ? get32(section) : 0;
+    uint32_t codeOffset = problem == NULL ? get32(section + 4) : 0;
+    if (problem == NULL && (codeSize > RAM_SIZE || codeOffset > size || codeSize > size - codeOffset)) {
+        problem = "has a section out of bounds";
+    }
+    if (problem == NULL && stringSize > 0 && file[tableSize + stringSize - 1] != '\0') {
+        problem = "has a corrupt string table";
+    }
+
+    if (problem == NULL) {
+        module->size = module->capacity = codeSize;
+        module->code = malloc(codeSize > 0 ? codeSize : 1);
+        memcpy(module->code, file + codeOffset, codeSize);
+        module->symbols = createSymbolTable();
+        module->relocations = NULL;
+        module->relocationCount = module->relocationCapacity = 0;
+
+        const uint8_t* symbol = section + OBJECT_SECTION_SIZE;
+        for (uint32_t i = 0; i < symbols && problem == NULL; i++, symbol += OBJECT_SYMBOL_SIZE) {
+            uint32_t nameOffset = get32(symbol);
+            uint16_t sectionIndex = get16(symbol + 4);
+            uint16_t offset = get16(symbol + 6);
+            if (nameOffset >= stringSize || (sectionIndex != 0 && sectionIndex != OBJECT_UNDEFINED)) {
+                problem = "has a corrupt symbol table";
+                break;
+            }
+            int index = internSymbol(module->symbols, (const char*)file + tableSize + nameOffset);
+            if ((uint32_t)index != i) {
+                problem = "has a duplicate symbol";
+                break;
+            }
+            module->symbols->symbols[index].defined = sectionIndex == 0;
+            module->symbols->symbols[index].address = offset;
+        }
+        const uint8_t* relocation = symbol;
+        for (uint32_t i = 0; i < relocations && problem == NULL; i++, relocation += OBJECT_RELOCATION_SIZE) {
+            uint16_t offset = get16(relocation + 2);
+            uint32_t index = get32(relocation + 4);
+            if (get16(relocation) != 0 || (uint32_t)offset + 4 > codeSize || index >= symbols) {
+                problem = "has a corrupt relocation";
+                break;
+            }
+            addRelocation(module, (Relocation){ offset, (int)index, 0 });
+        }
+        if (problem != NULL) {
+            freeObjectModule(module);
+            free(module->code);
+        }
+    }
+    free(file);
+    if (problem != NULL) {
+        printf(HI_RED "Fatal error! %s %s!\n" COL_RESET, path, problem);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Lays the modules out back to back from startVector in ram and resolves every
+// relocation against the module's own local symbols or the hashed table of
+// global ones. A global "start" symbol becomes the entry vector.
+int linkModules(ObjectModule* modules, const char** names, int count, uint16_t startVector, char* ram) {
+    uint32_t* bases = calloc(count, sizeof(uint32_t));
+    SymbolTable* globals = createSymbolTable();
+    int* owners = NULL;
+    int status = EXIT_SUCCESS;
+    memset(ram, 0, RAM_SIZE);
+
+    uint32_t address = startVector;
+    for (int i = 0; i < count && status == EXIT_SUCCESS; i++) {
+        bases[i] = address;
+        address += modules[i].size;
+        if (address > RAM_SIZE) {
+            printf(HI_RED "Fatal error! Linked program does not fit in memory at %s!\n" COL_RESET, names[i]);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < count && status == EXIT_SUCCESS; i++) {
+        memcpy(ram + bases[i], modules[i].code, modules[i].size);
+        for (int j = 0; j < modules[i].symbols->count; j++) {
+            Symbol* symbol = &modules[i].symbols->symbols[j];
+            if (!symbol->defined || isLocal(symbol->name)) { continue; }
+            int index = internSymbol(globals, symbol->name);
+            owners = realloc(owners, globals->capacity * sizeof(int));
+            if (globals->symbols[index].defined) {
+                printf(HI_RED "Fatal error! %s is defined in both %s and %s!\n" COL_RESET,
+                    symbol->name, names[owners[index]], names[i]);
+                status = EXIT_FAILURE;
+                break;
+            }
+            globals->symbols[index].defined = true;
+            globals->symbols[index].address = (uint16_t)(bases[i] + symbol->address);
+            owners[index] = i;
+        }
+    }
+
+    for (int i = 0; i < count && status == EXIT_SUCCESS; i++) {
+        for (int j = 0; j < modules[i].relocationCount; j++) {
+            Relocation* relocation = &modules[i].relocations[j];
+            Symbol* symbol = &modules[i].symbols->symbols[relocation->symbol];
+            uint16_t value;
+            if (isLocal(symbol->name)) {
+                if (!symbol->defined) {
+                    printf(HI_RED "Fatal error! Local label %s is never defined in %s!\n" COL_RESET, symbol->name, names[i]);
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                value = (uint16_t)(bases[i] + symbol->address);
+            } else {
+                int index = findSymbol(globals, symbol->name);
+                if (index == -1 || !globals->symbols[index].defined) {
+                    printf(HI_RED "Fatal error! Undefined symbol %s referenced from %s!\n" COL_RESET,
+                        symbol->name, names[i]);
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                value = globals->symbols[index].address;
+            }
+            patchData(ram + bases[i], relocation->offset, value);
+        }
+    }
+
+    int start = findSymbol(globals, "start");
+    uint16_t entry = start != -1 ? globals->symbols[start].address : startVector;
+    ram[0] = (char)(entry >> 8);
+    ram[1] = (char)(entry & 0xFF);
+
+    free(bases);
+    free(owners);
+    freeSymbolTable(globals);
+    return status;
+}
+
+// Links object files into an image
+int linkObjects(const char* imagePath, const char** objectPaths, int count, uint16_t startVector) {
+    ObjectModule* modules = calloc(count, sizeof(ObjectModule));
+    char* ram = malloc(RAM_SIZE);
+    int loaded = 0;
+    int status = EXIT_SUCCESS;
+    for (; loaded < count; loaded++) {
+        if (readObjectFile(objectPaths[loaded], &modules[loaded]) == EXIT_FAILURE) {
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    if (status == EXIT_SUCCESS) {
+        status = linkModules(modules, objectPaths, count, startVector, ram);
+    }
+    if (status == EXIT_SUCCESS) {
+        status = writeImageFile(imagePath, ram);
+    }
+
+    for (int i = 0; i < loaded; i++) {
+        freeObjectModule(&modules[i]);
+        free(modules[i].code);
+    }
+    free(modules);
+    free(ram);
+    return status;
+}
+
+// Bump allocator owned by one assembly worker; the code of every module it
+// assembles is copied here so no allocation is shared between threads
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+}; typedef struct ArenaBlock ArenaBlock;
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+static void* arenaAlloc(ArenaBlock** arena, size_t size) {
+    if (*arena == NULL || (*arena)->capacity - (*arena)->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock* block = malloc(sizeof(ArenaBlock) + capacity);
+        *block = (ArenaBlock){ .next = *arena, .used = 0, .capacity = capacity };
+        *arena = block;
+    }
+    void* memory = (*arena)->data + (*arena)->used;
+    (*arena)->used += size;
+    return memory;
+}
+
+static void freeArena(ArenaBlock* arena) {
+    while (arena != NULL) {
+        ArenaBlock* next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+struct SourceJob {
+    const char *path;
+    ObjectModule module;
+    char *output;
+    size_t outputSize;
+    int status;
+}; typedef struct SourceJob SourceJob;
+
+struct AssemblyPool {
+    SourceJob *jobs;
+    int count;
+    atomic_int next;
+    bool listing;
+    bool optimize;
+}; typedef struct AssemblyPool AssemblyPool;
+
+struct AssemblyWorker {
+    AssemblyPool *pool;
+    char *scratch;
+    ArenaBlock *arena;
+}; typedef struct AssemblyWorker AssemblyWorker;
+
+// Jobs are claimed in order from a shared counter. Each module is assembled
+// into the worker's scratch buffer with its listing and diagnostics captured
+// in a per-job stream, then its code is moved into the worker's arena.
+static void* assemblyWorkerMain(void* argument) {
+    AssemblyWorker* worker = argument;
+    AssemblyPool* pool = worker->pool;
+    int index;
+    while ((index = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        SourceJob* job = &pool->jobs[index];
+        FILE* output = open_memstream(&job->output, &job->outputSize);
+        FILE* source = fopen(job->path, "r");
+        if (source == NULL) {
+            fprintf(output, HI_RED "Source file %s not found!\n" COL_RESET, job->path);
+            job->status = EXIT_FAILURE;
+        } else {
+            Peephole peephole;
+            job->module = (ObjectModule){ .code = worker->scratch, .capacity = RAM_SIZE, .errors = output,
+                .peephole = pool->optimize ? &peephole : NULL };
+            job->status = assembleModule(source, &job->module, pool->listing ? output : NULL);
+            fclose(source);
+            if (job->status == EXIT_SUCCESS && pool->optimize) {
+                fprintf(output, HI_GREEN "%s: optimizer removed %d instructions\n" COL_RESET, job->path, peephole.removed);
+            }
+            job->module.peephole = NULL;
+            char* code = arenaAlloc(&worker->arena, job->module.size);
+            memcpy(code, worker->scratch, job->module.size);
+            job->module.code = code;
+        }
+        job->module.errors = NULL;
+        fclose(output);
+    }
+    return NULL;
+}
+
+// Assembles every source concurrently and links them, in the order given, into
+// ram at startVector. Listings and diagnostics are printed in source order once
+// all workers finish, so the output does not depend on the thread count.
+int assembleSources(const char** paths, int count, int threads, char* ram, bool listing, bool optimize) {
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+    if (threads > count) { threads = count; }
+
+    AssemblyPool pool = { .jobs = calloc(count, sizeof(SourceJob)), .count = count, .listing = listing, .optimize = optimize };
+    atomic_init(&pool.next, 0);
+    for (int i = 0; i < count; i++) {
+        pool.jobs[i].path = paths[i];
+    }
+    pthread_t* handles = malloc(threads * sizeof(pthread_t));
+    AssemblyWorker* workers = malloc(threads * sizeof(AssemblyWorker));
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (AssemblyWorker){ .pool = &pool, .scratch = malloc(RAM_SIZE), .arena = NULL };
+        pthread_create(&handles[i], NULL, assemblyWorkerMain, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < count; i++) {
+        fwrite(pool.jobs[i].output, 1, pool.jobs[i].outputSize, stdout);
+        if (pool.jobs[i].status == EXIT_FAILURE) {
+            printf(HI_RED "Failed to assemble %s\n" COL_RESET, paths[i]);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (status == EXIT_SUCCESS) {
+        ObjectModule* modules = malloc(count * sizeof(ObjectModule));
+        for (int i = 0; i < count; i++) {
+            modules[i] = pool.jobs[i].module;
+        }
+        status = linkModules(modules, paths, count, 0xA000, ram);
+        free(modules);
+    }
+
+    for (int i = 0; i < count; i++) {
+        freeObjectModule(&pool.jobs[i].module);
+        free(pool.jobs[i].output);
+    }
+    for (int i = 0; i < threads; i++) {
+        free(workers[i].scratch);
+        freeArena(workers[i].arena);
+    }
+    free(workers);
+    free(handles);
+    free(pool.jobs);
+    return status;
+}
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "assembler.h"
+
+#ifndef OBJECT_H
+#define OBJECT_H
+
+// LOL16 relocatable object file, all fields big endian:
+//   header      magic "L16O", u16 version, u16 section count, u32 symbol count,
+//               u32 relocation count, u32 string table size, u32 FNV-1a over
+//               everything after the header
+//   section     u32 size, u32 file offset of its code
+//   symbol      u32 name offset into the string table, u16 section or
+//               OBJECT_UNDEFINED, u16 offset within the section
+//   relocation  u16 section, u16 offset of the instruction, u32 symbol index
+// followed by the string table and the section code. Symbols whose name starts
+// with '.' are local to the object; all others are visible to the linker.
+#define OBJECT_MAGIC "L16O"
+#define OBJECT_VERSION 1
+#define OBJECT_HEADER_SIZE 24
+#define OBJECT_SECTION_SIZE 8
+#define OBJECT_SYMBOL_SIZE 8
+#define OBJECT_RELOCATION_SIZE 8
+#define OBJECT_UNDEFINED 0xFFFF
+
+int assembleObjectFile(const char *sourcePath, const char *objectPath, FILE *log, bool optimize);
+
+int linkModules(ObjectModule *modules, const char **names, int count, uint16_t startVector, char *ram);
+
+int linkObjects(const char *imagePath, const char **objectPaths, int count, uint16_t startVector);
+
+int assembleSources(const char **paths, int count, int threads, char *ram, bool listing, bool optimize);
+
+#endif
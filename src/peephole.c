@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "utils.h"
+#include "peephole.h"
+
+// The -O pass sees each instruction after parseLine, together with the one
+// emitted just before it, and may drop it, rewrite it or take the previous one
+// back:
+//   mov r r                  dropped
+//   mov r #v                 dropped when r is known to hold v already
+//   push r / pop r           both dropped
+//   push r / pop s           mov s r
+//   push #v / pop r          mov r #v
+//   cmp ... / cmp ...        the first is dropped, its result is never read
+// A label starts a new block, since control can enter there from elsewhere,
+// so nothing is ever moved across one. Jumps to numeric addresses are assumed
+// not to land inside a block.
+
+// Forgets everything known about the registers and the previous instruction
+void resetPeephole(Peephole* peephole) {
+    peephole->hasLast = false;
+    for (int reg = 0; reg < 4; reg++) { peephole->known[reg] = -1; }
+}
+
+static bool isCompare(char opId) {
+    return opId == CMP_R_V || opId == CMP_V_R || opId == CMP_R_R;
+}
+
+// Updates the known register values for an instruction that is being emitted
+static void track(Peephole* peephole, const Instruction* instruction, bool hasLabel) {
+    int32_t* known = peephole->known;
+    switch (instruction->opId) {
+        case MOV_R_V:
+            known[instruction->r1] = hasLabel ? -1 : instruction->data;
+            break;
+        case MOV_R_R:
+            known[instruction->r1] = known[instruction->r2];
+            break;
+        case MOV_R_A:
+        case MOV_R_AR:
+        case POP_R:
+            known[instruction->r1] = -1;
+            break;
+        case ADD_R_V_R: case ADC_R_V_R: case SUB_R_V_R: case SUB_V_R_R: case SBB_R_V_R: case SBB_V_R_R:
+        case MUL_R_V_R: case IMUL_R_V_R: case DIV_R_V_R: case DIV_V_R_R: case IDIV_R_V_R: case IDIV_V_R_R:
+            known[instruction->r2] = -1;
+            break;
+        case ADD_R_R_R: case ADC_R_R_R: case SUB_R_R_R: case SBB_R_R_R: case MUL_R_R_R: case IMUL_R_R_R:
+        case DIV_R_R_R: case IDIV_R_R_R:
+            known[instruction->r3] = -1;
+            break;
+        case MOV_A_R: case MOV_AR_R: case MOV_AR_V: case PUSH_R: case PUSH_V: case CMP_R_V: case CMP_V_R:
+        case CMP_R_R: case JZ_A: case JNZ_A: case JN_A: case JNN_A: case JE_A: case JNE_A: case JL_A:
+        case JLE_A: case JG_A: case JGE_A: case PASS_R:
+            break;
+        default:
+            // Calls may clobber anything, and after jmp, ret or hlt only a label is reachable
+            for (int reg = 0; reg < 4; reg++) { known[reg] = -1; }
+            break;
+    }
+}
+
+// Decides what happens to instruction, whose label operand (if any) is label.
+// Returns PEEPHOLE_EMIT and/or PEEPHOLE_RETRACT.
+int peepholeInstruction(Peephole* peephole, Instruction* instruction, char* label) {
+    Instruction* last = &peephole->last;
+    bool hasLabel = label[0] != '\0';
+
+    if (instruction->opId == MOV_R_R && instruction->r1 == instruction->r2) {
+        peephole->removed++;
+        return 0;
+    }
+    if (instruction->opId == MOV_R_V && !hasLabel && peephole->known[instruction->r1] == instruction->data) {
+        peephole->removed++;
+        return 0;
+    }
+
+    int action = PEEPHOLE_EMIT;
+    if (peephole->hasLast && instruction->opId == POP_R && (last->opId == PUSH_R || last->opId == PUSH_V)) {
+        if (last->opId == PUSH_R && last->r1 == instruction->r1) {
+            peephole->removed += 2;
+            peephole->hasLast = false;
+            return PEEPHOLE_RETRACT;
+        }
+        Register dest = instruction->r1;
+        if (last->opId == PUSH_R) {
+            *instruction = (Instruction){ .opId = MOV_R_R, .r1 = dest, .r2 = last->r1 };
+        } else {
+            *instruction = (Instruction){ .opId = MOV_R_V, .r1 = dest, .data = last->data };
+            strcpy(label, peephole->lastLabel);
+            hasLabel = label[0] != '\0';
+        }
+        peephole->removed++;
+        action |= PEEPHOLE_RETRACT;
+    } else if (peephole->hasLast && isCompare(instruction->opId) && isCompare(last->opId)) {
+        peephole->removed++;
+        action |= PEEPHOLE_RETRACT;
+    }
+
+    track(peephole, instruction, hasLabel);
+    peephole->last = *instruction;
+    strcpy(peephole->lastLabel, label);
+    peephole->hasLast = true;
+    return action;
+}
@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "symbols.h"
+
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+// What the assembler should do with the instruction it just parsed
+#define PEEPHOLE_EMIT 1     // emit it, possibly rewritten
+#define PEEPHOLE_RETRACT 2  // first take back the instruction emitted before it
+
+// State of the -O pass over the instructions of one straight line block. The
+// previous instruction is kept with its label operand so it can be fused.
+struct Peephole {
+    Instruction last;
+    char lastLabel[MAX_LABEL_LENGTH + 1];
+    bool hasLast;
+    int32_t known[4];
+    int removed;
+}; typedef struct Peephole Peephole;
+
+void resetPeephole(Peephole *peephole);
+
+int peepholeInstruction(Peephole *peephole, Instruction *instruction, char *label);
+
+#endif
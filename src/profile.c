@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "utils.h"
+
+// The hot loop only bumps the execution count of each PC. When an instruction
+// leaves PC anywhere but 4 bytes on, or was a jump, call or return (which may
+// target the next instruction), the slow path looks at what it was: a taken
+// jump or call counts against its address and calls and returns drive a
+// shadow stack for inclusive cycles. Functions are the entry point and every
+// call target; an address belongs to the closest function at or below it.
+// Per opcode counts use the code in RAM when the report is written, so code
+// that was overwritten during the run is attributed to what replaced it.
+
+Profile* createProfile(void) {
+    return calloc(1, sizeof(Profile));
+}
+
+static inline Instruction instructionAt(CPU* cpu, uint16_t address) {
+    DecodedInstruction* decoded = &cpu->decoded[address];
+    return decoded->valid ? decoded->instruction : decodeAt(cpu, address)->instruction;
+}
+
+static bool isJump(char opId) {
+    return opId >= JZ_A && opId <= JGE_A;
+}
+
+static bool isConditionalJump(char opId) {
+    return isJump(opId) && opId != JMP_A;
+}
+
+static bool isControl(char opId) {
+    return isJump(opId) || opId == CALL_A || opId == RET;
+}
+
+// Whether a jump's condition holds. Jumps leave the flags alone, so this still
+// answers after it ran, for a jump whose target is the next instruction.
+static bool jumpCondition(const CPU* cpu, char opId) {
+    switch (opId) {
+        case JZ_A:  return flagZero(cpu);
+        case JNZ_A: return !flagZero(cpu);
+        case JN_A:  return flagNeg(cpu);
+        case JNN_A: return !flagNeg(cpu);
+        case JE_A:  return flagEqu(cpu);
+        case JNE_A: return flagNeq(cpu);
+        case JL_A:  return flagLs(cpu);
+        case JLE_A: return flagLe(cpu);
+        case JG_A:  return flagGr(cpu);
+        case JGE_A: return flagGe(cpu);
+        default:    return true;
+    }
+}
+
+static void profileControl(Profile* profile, CPU* cpu, uint16_t pc) {
+    if (pc == 0) {
+        profile->entry = cpu->PC;
+        return;
+    }
+    Instruction instruction = instructionAt(cpu, pc);
+    if (isJump(instruction.opId)) {
+        if (cpu->PC != (uint16_t)(pc + 4) || jumpCondition(cpu, instruction.opId)) { profile->taken[pc]++; }
+    } else if (instruction.opId == CALL_A) {
+        profile->taken[pc]++;
+        if (profile->depth < PROFILE_CALL_DEPTH) {
+            profile->stackTargets[profile->depth] = instruction.data;
+            profile->stackCycles[profile->depth] = cpu->cycles;
+        }
+        profile->depth++;
+    } else if (instruction.opId == RET) {
+        if (profile->depth == 0) {
+            profile->unmatchedReturns++;
+            return;
+        }
+        profile->depth--;
+        if (profile->depth < PROFILE_CALL_DEPTH) {
+            uint16_t target = profile->stackTargets[profile->depth];
+            profile->returns[target]++;
+            profile->inclusive[target] += cpu->cycles - profile->stackCycles[profile->depth];
+        }
+    }
+}
+
+// runEmulator with a profile of everything it executes
+StopReason runProfiled(CPU* cpu, Profile* profile, uint64_t maxCycles) {
+    if (profile->entry == 0) { profile->entry = loadWord(cpu, 0); }
+    uint64_t start = cpu->cycles;
+    while (cpu->status == CPU_RUNNING && cpu->cycles - start < maxCycles) {
+        pollEvents(cpu);
+        uint16_t pc = cpu->PC;
+        tickComputer(cpu, false);
+        profile->executions[pc]++;
+        // decoded[pc] still holds what ran, even if it overwrote itself
+        if (cpu->PC != (uint16_t)(pc + 4) || pc == 0 || isControl(cpu->decoded[pc].instruction.opId)) {
+            profileControl(profile, cpu, pc);
+        }
+    }
+    return stopReason(cpu);
+}
+
+// One function of the flat profile
+struct ProfileFunction {
+    uint16_t start;
+    uint64_t self;
+    uint64_t calls;
+}; typedef struct ProfileFunction ProfileFunction;
+
+// Finds every function and charges each executed address to one of them.
+// owner maps each address to its function index, or -1 below the first one.
+static int buildFunctions(Profile* profile, CPU* cpu, ProfileFunction** functions, int32_t* owner) {
+    bool* isStart = calloc(RAM_SIZE, sizeof(bool));
+    isStart[profile->entry] = true;
+    for (uint32_t pc = 1; pc < RAM_SIZE; pc++) {
+        if (profile->executions[pc] == 0) { continue; }
+        Instruction instruction = instructionAt(cpu, (uint16_t)pc);
+        if (instruction.opId == CALL_A) { isStart[instruction.data] = true; }
+    }
+    int count = 0;
+    for (uint32_t pc = 0; pc < RAM_SIZE; pc++) { count += isStart[pc]; }
+    *functions = calloc(count, sizeof(ProfileFunction));
+
+    int current = -1;
+    for (uint32_t pc = 0; pc < RAM_SIZE; pc++) {
+        if (isStart[pc]) {
+            (*functions)[++current].start = (uint16_t)pc;
+        }
+        owner[pc] = current;
+        if (current >= 0) { (*functions)[current].self += profile->executions[pc]; }
+    }
+    for (uint32_t pc = 1; pc < RAM_SIZE; pc++) {
+        if (profile->executions[pc] == 0) { continue; }
+        Instruction instruction = instructionAt(cpu, (uint16_t)pc);
+        if (instruction.opId == CALL_A) { (*functions)[owner[instruction.data]].calls += profile->executions[pc]; }
+    }
+    free(isStart);
+    return count;
+}
+
+struct HotAddress {
+    uint16_t pc;
+    uint64_t executions;
+}; typedef struct HotAddress HotAddress;
+
+static int compareExecutions(const void* a, const void* b) {
+    const HotAddress* left = a;
+    const HotAddress* right = b;
+    return left->executions < right->executions ? 1 : left->executions > right->executions ? -1 : (int)left->pc - (int)right->pc;
+}
+
+static int compareSelf(const void* a, const void* b) {
+    const ProfileFunction* left = a;
+    const ProfileFunction* right = b;
+    return left->self < right->self ? 1 : left->self > right->self ? -1 : (int)left->start - (int)right->start;
+}
+
+// The entry point is never called, everything executed is inside it
+static uint64_t inclusiveCycles(Profile* profile, uint16_t function, uint64_t total) {
+    return function == profile->entry ? total : profile->inclusive[function];
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total > 0 ? 100.0 * (double)part / (double)total : 0;
+}
+
+// Writes the human readable report: hottest addresses, opcode histogram, flat
+// profile and call graph
+void printProfile(FILE* out, Profile* profile, CPU* cpu) {
+    uint64_t total = 0;
+    int executed = 0;
+    uint64_t opcodes[256] = {0};
+    for (uint32_t pc = 1; pc < RAM_SIZE; pc++) {
+        if (profile->executions[pc] == 0) { continue; }
+        total += profile->executions[pc];
+        executed++;
+        opcodes[(uint8_t)instructionAt(cpu, (uint16_t)pc).opId] += profile->executions[pc];
+    }
+
+    HotAddress* hot = malloc(executed * sizeof(HotAddress));
+    for (uint32_t pc = 1, i = 0; pc < RAM_SIZE; pc++) {
+        if (profile->executions[pc] > 0) { hot[i++] = (HotAddress){ (uint16_t)pc, profile->executions[pc] }; }
+    }
+    qsort(hot, executed, sizeof(HotAddress), compareExecutions);
+    fprintf(out, HI_YELLOW "Hottest addresses (%d executed, %llu instructions)\n" COL_RESET, executed, (unsigned long long)total);
+    fprintf(out, "  address       count      %%  instruction\n");
+    for (int i = 0; i < executed && i < PROFILE_HOT_ADDRESSES; i++) {
+        uint16_t pc = hot[i].pc;
+        Instruction instruction = instructionAt(cpu, pc);
+        char text[64];
+        disassemble(&instruction, text, sizeof(text));
+        fprintf(out, "  $%04X  %12llu  %5.1f  %-20s", pc, (unsigned long long)profile->executions[pc],
+            percent(profile->executions[pc], total), text);
+        if (isConditionalJump(instruction.opId)) {
+            fprintf(out, "  taken %llu, not taken %llu", (unsigned long long)profile->taken[pc],
+                (unsigned long long)(profile->executions[pc] - profile->taken[pc]));
+        }
+        fprintf(out, "\n");
+    }
+    free(hot);
+
+    fprintf(out, HI_YELLOW "Opcodes\n" COL_RESET);
+    for (int opId = 0; opId < 256; opId++) {
+        if (opcodes[opId] == 0) { continue; }
+        const char* name = instructionName(opId);
+        fprintf(out, "  %-10s  %12llu  %5.1f\n", name != NULL ? name : "invalid", (unsigned long long)opcodes[opId],
+            percent(opcodes[opId], total));
+    }
+
+    ProfileFunction* functions;
+    int32_t* owner = malloc(RAM_SIZE * sizeof(int32_t));
+    int count = buildFunctions(profile, cpu, &functions, owner);
+    ProfileFunction* flat = malloc(count * sizeof(ProfileFunction));
+    memcpy(flat, functions, count * sizeof(ProfileFunction));
+    qsort(flat, count, sizeof(ProfileFunction), compareSelf);
+    fprintf(out, HI_YELLOW "Flat profile\n" COL_RESET);
+    fprintf(out, "  function          self      %%     inclusive       calls\n");
+    for (int i = 0; i < count; i++) {
+        if (flat[i].self == 0 && flat[i].calls == 0) { continue; }
+        uint64_t inclusive = inclusiveCycles(profile, flat[i].start, total);
+        fprintf(out, "  $%04X     %12llu  %5.1f  %12llu  %10llu\n", flat[i].start, (unsigned long long)flat[i].self,
+            percent(flat[i].self, total), (unsigned long long)inclusive, (unsigned long long)flat[i].calls);
+    }
+
+    uint16_t* sites = malloc(executed * sizeof(uint16_t));
+    int siteCount = 0;
+    for (uint32_t pc = 1; pc < RAM_SIZE; pc++) {
+        if (profile->executions[pc] > 0 && instructionAt(cpu, (uint16_t)pc).opId == CALL_A) { sites[siteCount++] = (uint16_t)pc; }
+    }
+    fprintf(out, HI_YELLOW "Call graph\n" COL_RESET);
+    for (int i = 0; i < count; i++) {
+        uint16_t start = flat[i].start;
+        bool printed = false;
+        for (int site = 0; site < siteCount; site++) {
+            uint16_t pc = sites[site];
+            uint16_t target = instructionAt(cpu, pc).data;
+            if (owner[pc] < 0) { continue; }
+            uint16_t caller = functions[owner[pc]].start;
+            if (caller != start && target != start) { continue; }
+            if (!printed) {
+                fprintf(out, "  $%04X\n", start);
+                printed = true;
+            }
+            if (target == start) {
+                fprintf(out, "    called from $%04X (in $%04X)  %llu\n", pc, caller, (unsigned long long)profile->executions[pc]);
+            }
+            if (caller == start) {
+                fprintf(out, "    calls $%04X at $%04X  %llu\n", target, pc, (unsigned long long)profile->executions[pc]);
+            }
+        }
+    }
+    free(sites);
+    if (profile->unmatchedReturns > 0 || profile->depth > 0) {
+        fprintf(out, "  %llu returns without a call, %d calls still open\n",
+            (unsigned long long)profile->unmatchedReturns, profile->depth);
+    }
+    free(flat);
+    free(functions);
+    free(owner);
+}
+
+// Writes a tab separated dump, one record per line, tagged by its first field:
+//   pc        address, opcode, executions, taken
+//   function  start, self, inclusive, calls, returns
+//   call      site, caller, target, count
+int writeProfileDump(const char* path, Profile* profile, CPU* cpu) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        printf(HI_RED "Fatal error! Cannot write %s\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "# lol16 profile\tentry\t%u\tcycles\t%llu\n", profile->entry, (unsigned long long)cpu->cycles);
+    uint64_t total = 0;
+    for (uint32_t pc = 1; pc < RAM_SIZE; pc++) {
+        if (profile->executions[pc] == 0) { continue; }
+        total += profile->executions[pc];
+        const char* name = instructionName(instructionAt(cpu, (uint16_t)pc).opId);
+        fprintf(out, "pc\t%u\t%s\t%llu\t%llu\n", pc, name != NULL ? name : "invalid",
+            (unsigned long long)profile->executions[pc], (unsigned long long)profile->taken[pc]);
+    }
+
+    ProfileFunction* functions;
+    int32_t* owner = malloc(RAM_SIZE * sizeof(int32_t));
+    int count = buildFunctions(profile, cpu, &functions, owner);
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "function\t%u\t%llu\t%llu\t%llu\t%llu\n", functions[i].start, (unsigned long long)functions[i].self,
+            (unsigned long long)inclusiveCycles(profile, functions[i].start, total), (unsigned long long)functions[i].calls,
+            (unsigned long long)profile->returns[functions[i].start]);
+    }
+    for (uint32_t pc = 1; pc < RAM_SIZE; pc++) {
+        if (profile->executions[pc] == 0) { continue; }
+        Instruction instruction = instructionAt(cpu, (uint16_t)pc);
+        if (instruction.opId != CALL_A) { continue; }
+        fprintf(out, "call\t%u\t%u\t%u\t%llu\n", pc, owner[pc] >= 0 ? functions[owner[pc]].start : 0,
+            instruction.data, (unsigned long long)profile->executions[pc]);
+    }
+    free(functions);
+    free(owner);
+
+    bool written = ferror(out) == 0;
+    written = fclose(out) == 0 && written;
+    if (!written) {
+        printf(HI_RED "Fatal error! Failed writing %s\n" COL_RESET, path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
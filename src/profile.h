@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "emulator.h"
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#define PROFILE_CALL_DEPTH 1024
+#define PROFILE_HOT_ADDRESSES 20
+
+// Counters gathered by runProfiled. Executions are counted per PC; everything
+// per opcode, per function and per call edge is derived from them afterwards.
+// Control flow only costs extra for jumps, calls, returns and whatever else
+// does not simply advance PC by 4.
+struct Profile {
+    uint64_t executions[RAM_SIZE];
+    // Times a jump or call at this address went to its target
+    uint64_t taken[RAM_SIZE];
+    // Per call target: CALL_A/RET pairs seen and the cycles spent inside them
+    uint64_t returns[RAM_SIZE];
+    uint64_t inclusive[RAM_SIZE];
+    // Shadow call stack of targets and the cycle count at entry
+    uint16_t stackTargets[PROFILE_CALL_DEPTH];
+    uint64_t stackCycles[PROFILE_CALL_DEPTH];
+    int depth;
+    uint64_t unmatchedReturns;
+    uint16_t entry;
+}; typedef struct Profile Profile;
+
+Profile *createProfile(void);
+
+StopReason runProfiled(CPU *cpu, Profile *profile, uint64_t maxCycles);
+
+void printProfile(FILE *out, Profile *profile, CPU *cpu);
+
+int writeProfileDump(const char *path, Profile *profile, CPU *cpu);
+
+#endif
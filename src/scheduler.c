@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emulator.h"
+#include "scheduler.h"
+
+// Events fire between the batches runEngine hands to the engines. A batch
+// normally ends at scheduler->next; scheduling an earlier event while one runs
+// lowers cpu->limit, which the engines reread after every memory access.
+
+Scheduler* createScheduler() {
+    Scheduler* scheduler = calloc(1, sizeof(Scheduler));
+    scheduler->next = UINT64_MAX;
+    return scheduler;
+}
+
+void freeScheduler(Scheduler* scheduler) {
+    if (scheduler == NULL) { return; }
+    free(scheduler->heap);
+    free(scheduler);
+}
+
+static void siftUp(Scheduler* scheduler, int i) {
+    Event event = scheduler->heap[i];
+    while (i > 0 && scheduler->heap[(i - 1) / 2].cycle > event.cycle) {
+        scheduler->heap[i] = scheduler->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    scheduler->heap[i] = event;
+}
+
+static void siftDown(Scheduler* scheduler, int i) {
+    Event event = scheduler->heap[i];
+    while (2 * i + 1 < scheduler->count) {
+        int child = 2 * i + 1;
+        if (child + 1 < scheduler->count && scheduler->heap[child + 1].cycle < scheduler->heap[child].cycle) { child++; }
+        if (scheduler->heap[child].cycle >= event.cycle) { break; }
+        scheduler->heap[i] = scheduler->heap[child];
+        i = child;
+    }
+    scheduler->heap[i] = event;
+}
+
+static void updateNext(Scheduler* scheduler) {
+    scheduler->next = scheduler->count > 0 ? scheduler->heap[0].cycle : UINT64_MAX;
+}
+
+// Runs handler once cpu->cycles reaches cycle. An instruction scheduling an
+// event for its own cycle or earlier gets it right after it retires.
+void scheduleEvent(CPU* cpu, uint64_t cycle, EventHandler handler, void* context) {
+    Scheduler* scheduler = cpu->scheduler;
+    if (cycle <= cpu->cycles) { cycle = cpu->cycles + 1; }
+    if (scheduler->count == scheduler->capacity) {
+        scheduler->capacity = scheduler->capacity ? scheduler->capacity * 2 : 8;
+        scheduler->heap = realloc(scheduler->heap, scheduler->capacity * sizeof(Event));
+    }
+    scheduler->heap[scheduler->count] = (Event){ .cycle = cycle, .handler = handler, .context = context };
+    siftUp(scheduler, scheduler->count++);
+    updateNext(scheduler);
+    if (cycle < cpu->limit) { cpu->limit = cycle; }
+}
+
+// Drops every pending event with this handler and context
+void cancelEvents(CPU* cpu, EventHandler handler, void* context) {
+    Scheduler* scheduler = cpu->scheduler;
+    int kept = 0;
+    for (int i = 0; i < scheduler->count; i++) {
+        Event event = scheduler->heap[i];
+        if (event.handler != handler || event.context != context) { scheduler->heap[kept++] = event; }
+    }
+    if (kept == scheduler->count) { return; }
+    scheduler->count = kept;
+    for (int i = kept / 2 - 1; i >= 0; i--) { siftDown(scheduler, i); }
+    updateNext(scheduler);
+}
+
+// Fires the due events in cycle order
+void runEvents(CPU* cpu) {
+    Scheduler* scheduler = cpu->scheduler;
+    while (scheduler->count > 0 && scheduler->heap[0].cycle <= cpu->cycles) {
+        Event event = scheduler->heap[0];
+        scheduler->heap[0] = scheduler->heap[--scheduler->count];
+        if (scheduler->count > 0) { siftDown(scheduler, 0); }
+        updateNext(scheduler);
+        event.handler(cpu, event.context);
+    }
+}
+
+// For loops that step with tickComputer themselves instead of calling runEngine
+void pollEvents(CPU* cpu) {
+    if (cpu->scheduler != NULL && cpu->scheduler->next <= cpu->cycles) { runEvents(cpu); }
+}
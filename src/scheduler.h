@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "emulator.h"
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+typedef void (*EventHandler)(CPU *cpu, void *context);
+
+struct Event {
+    uint64_t cycle;
+    EventHandler handler;
+    void *context;
+}; typedef struct Event Event;
+
+// Pending events as a min-heap on cycle. next is the cycle of the earliest one,
+// or UINT64_MAX when there is none, so runEngine only ever compares against it.
+struct Scheduler {
+    Event *heap;
+    int count;
+    int capacity;
+    uint64_t next;
+}; typedef struct Scheduler Scheduler;
+
+Scheduler *createScheduler(void);
+
+void freeScheduler(Scheduler *scheduler);
+
+void scheduleEvent(CPU *cpu, uint64_t cycle, EventHandler handler, void *context);
+
+void cancelEvents(CPU *cpu, EventHandler handler, void *context);
+
+void runEvents(CPU *cpu);
+
+void pollEvents(CPU *cpu);
+
+#endif
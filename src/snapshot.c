@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "snapshot.h"
+
+// A snapshot keeps one full copy of RAM and clears the CPU's dirty page bitmap.
+// Restoring copies back only the pages stored to since then, so resetting a
+// machine that touched a handful of pages costs a handful of 256 byte copies.
+
+Snapshot* takeSnapshot(CPU* cpu) {
+    Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+    snapshot->ram = malloc(RAM_SIZE);
+    memcpy(snapshot->state, cpu, SNAPSHOT_STATE_SIZE);
+    memcpy(snapshot->ram, cpu->ram, RAM_SIZE);
+    memset(cpu->dirtyPages, 0, sizeof(cpu->dirtyPages));
+    return snapshot;
+}
+
+// Returns the number of pages copied back
+int restoreSnapshot(CPU* cpu, Snapshot* snapshot) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int pages = 0;
+    for (int word = 0; word < 4; word++) {
+        uint64_t bits = cpu->dirtyPages[word];
+        while (bits != 0) {
+            int page = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            memcpy(cpu->ram + page * 256, snapshot->ram + page * 256, 256);
+            if (cpu->codePages[page]) {
+                invalidateCode(cpu, (uint16_t)(page * 256), 256);
+            }
+            pages++;
+        }
+        cpu->dirtyPages[word] = 0;
+    }
+    cpu->ram[RAM_SIZE] = cpu->ram[0];
+    memcpy(cpu, snapshot->state, SNAPSHOT_STATE_SIZE);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    snapshot->restores++;
+    snapshot->pagesRestored += pages;
+    snapshot->lastRestoreNanos = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t)(end.tv_nsec - start.tv_nsec);
+    snapshot->restoreNanos += snapshot->lastRestoreNanos;
+    return pages;
+}
+
+void freeSnapshot(Snapshot* snapshot) {
+    free(snapshot->ram);
+    free(snapshot);
+}
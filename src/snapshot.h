@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// The hot prefix of the CPU, everything before the ram pointer
+#define SNAPSHOT_STATE_SIZE offsetof(CPU, ram)
+
+struct Snapshot {
+    char state[SNAPSHOT_STATE_SIZE];
+    char *ram;
+    uint64_t restores;
+    uint64_t pagesRestored;
+    uint64_t restoreNanos;
+    uint64_t lastRestoreNanos;
+}; typedef struct Snapshot Snapshot;
+
+Snapshot *takeSnapshot(CPU *cpu);
+
+int restoreSnapshot(CPU *cpu, Snapshot *snapshot);
+
+void freeSnapshot(Snapshot *snapshot);
+
+#endif
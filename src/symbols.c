@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "symbols.h"
+
+static uint32_t hashName(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+    return hash;
+}
+
+SymbolTable* createSymbolTable(void) {
+    SymbolTable* table = calloc(1, sizeof(SymbolTable));
+    table->capacity = 16;
+    table->symbols = malloc(table->capacity * sizeof(Symbol));
+    table->slotCount = 32;
+    table->slots = malloc(table->slotCount * sizeof(int));
+    memset(table->slots, -1, table->slotCount * sizeof(int));
+    return table;
+}
+
+void freeSymbolTable(SymbolTable* table) {
+    for (int i = 0; i < table->count; i++) {
+        free(table->symbols[i].name);
+    }
+    free(table->symbols);
+    free(table->slots);
+    free(table);
+}
+
+// Returns the slot holding name, or the empty slot it would go in
+static int findSlot(SymbolTable* table, const char* name) {
+    int mask = table->slotCount - 1;
+    int slot = hashName(name) & mask;
+    while (table->slots[slot] != -1 && strcmp(table->symbols[table->slots[slot]].name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Doubles the slot array once it is half full
+static void growSlots(SymbolTable* table) {
+    free(table->slots);
+    table->slotCount *= 2;
+    table->slots = malloc(table->slotCount * sizeof(int));
+    memset(table->slots, -1, table->slotCount * sizeof(int));
+    for (int i = 0; i < table->count; i++) {
+        table->slots[findSlot(table, table->symbols[i].name)] = i;
+    }
+}
+
+int findSymbol(SymbolTable* table, const char* name) {
+    return table->slots[findSlot(table, name)];
+}
+
+// Returns the index of name, adding it as undefined if it is new
+int internSymbol(SymbolTable* table, const char* name) {
+    int slot = findSlot(table, name);
+    if (table->slots[slot] != -1) {
+        return table->slots[slot];
+    }
+    if (table->count == table->capacity) {
+        table->capacity *= 2;
+        table->symbols = realloc(table->symbols, table->capacity * sizeof(Symbol));
+    }
+    int index = table->count++;
+    table->symbols[index] = (Symbol){ .name = strdup(name), .address = 0, .defined = false };
+    table->slots[slot] = index;
+    if (table->count * 2 > table->slotCount) {
+        growSlots(table);
+    }
+    return index;
+}
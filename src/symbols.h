@@ -0,0 +1,32 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#define MAX_LABEL_LENGTH 63
+
+struct Symbol {
+    char *name;
+    uint16_t address;
+    bool defined;
+}; typedef struct Symbol Symbol;
+
+// Open addressing hash table of symbol indices over a growing symbol array
+struct SymbolTable {
+    Symbol *symbols;
+    int count;
+    int capacity;
+    int *slots;
+    int slotCount;
+}; typedef struct SymbolTable SymbolTable;
+
+SymbolTable *createSymbolTable(void);
+
+void freeSymbolTable(SymbolTable *table);
+
+int findSymbol(SymbolTable *table, const char *name);
+
+int internSymbol(SymbolTable *table, const char *name);
+
+#endif
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "emulator.h"
+#include "threaded.h"
+#include "utils.h"
+
+// Alternative interpreter core using computed goto. executeInstruction stays the
+// reference implementation and every handler here mirrors its switch case.
+
+uint16_t* registerPointer(CPU* cpu, Register reg) {
+    return &cpu->regs[reg];
+}
+
+void invalidateThreaded(CPU* cpu, uint16_t address, uint16_t length) {
+    for (uint16_t i = 0; i < length + 3; i++) {
+        cpu->threaded[(uint16_t)(address - 3 + i)].handler = NULL;
+    }
+}
+
+#define DISPATCH()                                      \
+    do {                                                \
+        if (cycles == limit) { goto stop; }             \
+        op = &table[pc];                                \
+        if (op->handler == NULL) { goto decode; }       \
+        pc += 4;                                        \
+        goto *op->handler;                              \
+    } while (0)
+
+#define RETIRE()                                        \
+    do {                                                \
+        cycles++;                                       \
+        DISPATCH();                                     \
+    } while (0)
+
+// A memory access may reach a device, which reads the cycle counter and may
+// schedule an event that pulls the limit in
+#define SYNC() cpu->cycles = cycles
+
+#define RETIRE_ACCESS()                                 \
+    do {                                                \
+        limit = cpu->limit;                             \
+        RETIRE();                                       \
+    } while (0)
+
+#define FAULT()                                         \
+    do {                                                \
+        pc -= 4;                                        \
+        cpu->status = CPU_FAULT;                        \
+        goto stop;                                      \
+    } while (0)
+
+StopReason runThreaded(CPU* cpu, uint64_t maxCycles) {
+    static const void* handlers[256] = {
+        [MOV_R_R] = &&op_MOV_R_R,       [MOV_R_V] = &&op_MOV_R_V,
+        [MOV_R_A] = &&op_MOV_R_A,       [MOV_A_R] = &&op_MOV_A_R,
+        [MOV_AR_R] = &&op_MOV_AR_R,     [MOV_AR_V] = &&op_MOV_AR_V,
+        [MOV_R_AR] = &&op_MOV_R_AR,     [PUSH_R] = &&op_PUSH_R,
+        [PUSH_V] = &&op_PUSH_V,         [POP_R] = &&op_POP_R,
+        [CALL_A] = &&op_CALL_A,         [RET] = &&op_RET,
+        [CMP_R_V] = &&op_CMP_R_V,       [CMP_V_R] = &&op_CMP_V_R,
+        [CMP_R_R] = &&op_CMP_R_R,       [JZ_A] = &&op_JZ_A,
+        [JNZ_A] = &&op_JNZ_A,           [JN_A] = &&op_JN_A,
+        [JNN_A] = &&op_JNN_A,           [JMP_A] = &&op_JMP_A,
+        [JE_A] = &&op_JE_A,             [JNE_A] = &&op_JNE_A,
+        [JL_A] = &&op_JL_A,             [JLE_A] = &&op_JLE_A,
+        [JG_A] = &&op_JG_A,             [JGE_A] = &&op_JGE_A,
+        [ADD_R_V_R] = &&op_ADD_R_V_R,   [ADD_R_R_R] = &&op_ADD_R_R_R,
+        [ADC_R_V_R] = &&op_ADC_R_V_R,   [ADC_R_R_R] = &&op_ADC_R_R_R,
+        [SUB_R_V_R] = &&op_SUB_R_V_R,   [SUB_V_R_R] = &&op_SUB_V_R_R,
+        [SUB_R_R_R] = &&op_SUB_R_R_R,   [SBB_R_V_R] = &&op_SBB_R_V_R,
+        [SBB_V_R_R] = &&op_SBB_V_R_R,   [SBB_R_R_R] = &&op_SBB_R_R_R,
+        [MUL_R_V_R] = &&op_MUL_R_V_R,   [MUL_R_R_R] = &&op_MUL_R_R_R,
+        [IMUL_R_V_R] = &&op_IMUL_R_V_R, [IMUL_R_R_R] = &&op_IMUL_R_R_R,
+        [DIV_R_V_R] = &&op_DIV_R_V_R,   [DIV_V_R_R] = &&op_DIV_V_R_R,
+        [DIV_R_R_R] = &&op_DIV_R_R_R,   [IDIV_R_V_R] = &&op_IDIV_R_V_R,
+        [IDIV_V_R_R] = &&op_IDIV_V_R_R, [IDIV_R_R_R] = &&op_IDIV_R_R_R,
+        [PASS_R] = &&op_PASS_R,         [HLT] = &&op_HLT,
+    };
+
+    if (cpu->status != CPU_RUNNING) { return stopReason(cpu); }
+    if (cpu->threaded == NULL) {
+        cpu->threaded = calloc(65536, sizeof(ThreadedInstruction));
+    }
+
+    ThreadedInstruction* table = cpu->threaded;
+    ThreadedInstruction* op;
+    uint16_t pc = cpu->PC;
+    uint64_t cycles = cpu->cycles;
+    uint64_t limit = maxCycles > UINT64_MAX - cycles ? UINT64_MAX : cycles + maxCycles;
+    cpu->limit = limit;
+    uint16_t a, b;
+
+    DISPATCH();
+
+decode:
+    if (pc == 0) {
+        // Reset vector, handled by the reference core
+        cpu->PC = pc;
+        cpu->cycles = cycles;
+        tickComputer(cpu, false);
+        pc = cpu->PC;
+        if (cpu->status != CPU_RUNNING) { goto stop; }
+        DISPATCH();
+    }
+    {
+        Instruction instruction = cpu->decoded[pc].valid ? cpu->decoded[pc].instruction : decodeAt(cpu, pc)->instruction;
+        const void* handler = handlers[(uint8_t)instruction.opId];
+        op->r1 = registerPointer(cpu, instruction.r1);
+        op->r2 = registerPointer(cpu, instruction.r2);
+        op->r3 = registerPointer(cpu, instruction.r3);
+        op->data = instruction.data;
+        op->handler = handler != NULL ? handler : &&op_fault;
+        pc += 4;
+        goto *op->handler;
+    }
+
+op_MOV_R_R:
+    *op->r1 = *op->r2;
+    RETIRE();
+op_MOV_R_V:
+    *op->r1 = op->data;
+    RETIRE();
+op_MOV_R_A:
+    SYNC();
+    *op->r1 = loadWord(cpu, op->data);
+    RETIRE_ACCESS();
+op_MOV_A_R:
+    SYNC();
+    storeWord(cpu, op->data, *op->r1);
+    RETIRE_ACCESS();
+op_MOV_AR_R:
+    SYNC();
+    storeWord(cpu, *op->r1, *op->r2);
+    RETIRE_ACCESS();
+op_MOV_AR_V:
+    SYNC();
+    storeWord(cpu, *op->r1, op->data);
+    RETIRE_ACCESS();
+op_MOV_R_AR:
+    SYNC();
+    *op->r1 = loadWord(cpu, *op->r2);
+    RETIRE_ACCESS();
+op_PUSH_R:
+    SYNC();
+    storeWord(cpu, cpu->stackptr - 1, *op->r1);
+    cpu->stackptr -= 2;
+    RETIRE_ACCESS();
+op_PUSH_V:
+    SYNC();
+    storeWord(cpu, cpu->stackptr - 1, op->data);
+    cpu->stackptr -= 2;
+    RETIRE_ACCESS();
+op_POP_R:
+    SYNC();
+    cpu->stackptr += 2;
+    *op->r1 = loadWord(cpu, cpu->stackptr - 1);
+    RETIRE_ACCESS();
+op_CALL_A:
+    SYNC();
+    a = op->data;
+    storeWord(cpu, cpu->stackptr - 1, pc);
+    cpu->stackptr -= 2;
+    pc = a;
+    RETIRE_ACCESS();
+op_RET:
+    SYNC();
+    cpu->stackptr += 2;
+    pc = loadWord(cpu, cpu->stackptr - 1);
+    RETIRE_ACCESS();
+op_CMP_R_V:
+    compare(*op->r1, op->data, cpu);
+    RETIRE();
+op_CMP_V_R:
+    compare(op->data, *op->r1, cpu);
+    RETIRE();
+op_CMP_R_R:
+    compare(*op->r1, *op->r2, cpu);
+    RETIRE();
+op_JZ_A:
+    if (flagZero(cpu)) { pc = op->data; }
+    RETIRE();
+op_JNZ_A:
+    if (!flagZero(cpu)) { pc = op->data; }
+    RETIRE();
+op_JN_A:
+    if (flagNeg(cpu)) { pc = op->data; }
+    RETIRE();
+op_JNN_A:
+    if (!flagNeg(cpu)) { pc = op->data; }
+    RETIRE();
+op_JMP_A:
+    pc = op->data;
+    RETIRE();
+op_JE_A:
+    if (flagEqu(cpu)) { pc = op->data; }
+    RETIRE();
+op_JNE_A:
+    if (flagNeq(cpu)) { pc = op->data; }
+    RETIRE();
+op_JL_A:
+    if (flagLs(cpu)) { pc = op->data; }
+    RETIRE();
+op_JLE_A:
+    if (flagLe(cpu)) { pc = op->data; }
+    RETIRE();
+op_JG_A:
+    if (flagGr(cpu)) { pc = op->data; }
+    RETIRE();
+op_JGE_A:
+    if (flagGe(cpu)) { pc = op->data; }
+    RETIRE();
+op_ADD_R_V_R:
+    *op->r2 = arithmetic((uint32_t)*op->r1 + op->data, cpu);
+    RETIRE();
+op_ADD_R_R_R:
+    *op->r3 = arithmetic((uint32_t)*op->r1 + *op->r2, cpu);
+    RETIRE();
+op_ADC_R_V_R:
+    *op->r2 = arithmetic((uint32_t)*op->r1 + op->data + flagCarry(cpu), cpu);
+    RETIRE();
+op_ADC_R_R_R:
+    *op->r3 = arithmetic((uint32_t)*op->r1 + *op->r2 + flagCarry(cpu), cpu);
+    RETIRE();
+op_SUB_R_V_R:
+    *op->r2 = arithmetic((uint32_t)*op->r1 - op->data, cpu);
+    RETIRE();
+op_SUB_V_R_R:
+    *op->r2 = arithmetic((uint32_t)op->data - *op->r1, cpu);
+    RETIRE();
+op_SUB_R_R_R:
+    *op->r3 = arithmetic((uint32_t)*op->r1 - *op->r2, cpu);
+    RETIRE();
+op_SBB_R_V_R:
+    *op->r2 = arithmetic((uint32_t)*op->r1 - op->data - flagCarry(cpu), cpu);
+    RETIRE();
+op_SBB_V_R_R:
+    *op->r2 = arithmetic((uint32_t)op->data - *op->r1 - flagCarry(cpu), cpu);
+    RETIRE();
+op_SBB_R_R_R:
+    *op->r3 = arithmetic((uint32_t)*op->r1 - *op->r2 - flagCarry(cpu), cpu);
+    RETIRE();
+op_MUL_R_V_R:
+    *op->r2 = arithmetic((uint32_t)*op->r1 * op->data, cpu);
+    RETIRE();
+op_MUL_R_R_R:
+    *op->r3 = arithmetic((uint32_t)*op->r1 * *op->r2, cpu);
+    RETIRE();
+op_IMUL_R_V_R:
+    *op->r2 = signedArithmetic((int16_t)*op->r1 * (int16_t)op->data, cpu);
+    RETIRE();
+op_IMUL_R_R_R:
+    *op->r3 = signedArithmetic((int16_t)*op->r1 * (int16_t)*op->r2, cpu);
+    RETIRE();
+op_DIV_R_V_R:
+    a = *op->r1;
+    b = op->data;
+    if (b == 0) { FAULT(); }
+    *op->r2 = arithmetic(a / b, cpu);
+    RETIRE();
+op_DIV_V_R_R:
+    a = op->data;
+    b = *op->r1;
+    if (b == 0) { FAULT(); }
+    *op->r2 = arithmetic(a / b, cpu);
+    RETIRE();
+op_DIV_R_R_R:
+    a = *op->r1;
+    b = *op->r2;
+    if (b == 0) { FAULT(); }
+    *op->r3 = arithmetic(a / b, cpu);
+    RETIRE();
+op_IDIV_R_V_R:
+    a = *op->r1;
+    b = op->data;
+    if (b == 0 || ((int16_t)a == INT16_MIN && (int16_t)b == -1)) { FAULT(); }
+    *op->r2 = signedArithmetic((int16_t)a / (int16_t)b, cpu);
+    RETIRE();
+op_IDIV_V_R_R:
+    a = op->data;
+    b = *op->r1;
+    if (b == 0 || ((int16_t)a == INT16_MIN && (int16_t)b == -1)) { FAULT(); }
+    *op->r2 = signedArithmetic((int16_t)a / (int16_t)b, cpu);
+    RETIRE();
+op_IDIV_R_R_R:
+    a = *op->r1;
+    b = *op->r2;
+    if (b == 0 || ((int16_t)a == INT16_MIN && (int16_t)b == -1)) { FAULT(); }
+    *op->r3 = signedArithmetic((int16_t)a / (int16_t)b, cpu);
+    RETIRE();
+op_PASS_R:
+    arithmetic(*op->r1, cpu);
+    RETIRE();
+op_HLT:
+    cpu->status = CPU_HALTED;
+    cycles++;
+    goto stop;
+op_fault:
+    FAULT();
+
+stop:
+    cpu->PC = pc;
+    cpu->cycles = cycles;
+    return stopReason(cpu);
+}
@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include "emulator.h"
+
+#ifndef THREADED_H
+#define THREADED_H
+
+// Direct-threaded form of an instruction: the handler is the address of the
+// label that executes it and the register operands point straight into the CPU
+struct ThreadedInstruction {
+    const void *handler;
+    uint16_t *r1;
+    uint16_t *r2;
+    uint16_t *r3;
+    uint16_t data;
+}; typedef struct ThreadedInstruction ThreadedInstruction;
+
+StopReason runThreaded(CPU *cpu, uint64_t maxCycles);
+
+void invalidateThreaded(CPU *cpu, uint16_t address, uint16_t length);
+
+#endif
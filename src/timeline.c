@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emulator.h"
+#include "snapshot.h"
+#include "timeline.h"
+
+// A checkpoint is taken every interval cycles of forward execution. It keeps
+// the CPU state and the pages whose contents differ from the checkpoint before
+// it, found by comparing RAM against a shadow copy rather than through the
+// dirty page bitmap, which snapshots own. The contents of a page at checkpoint
+// k are in the latest checkpoint at or before k that stored it.
+//
+// Execution is deterministic, so any cycle is reached again by restoring the
+// closest checkpoint before it and re-executing. When the checkpoints outgrow
+// the budget every other one is merged into its successor and the interval
+// doubles, keeping them evenly spaced over the whole run.
+
+static size_t checkpointSize(const Checkpoint* checkpoint) {
+    return sizeof(Checkpoint) + (size_t)checkpoint->pageCount * TIMELINE_PAGE_SIZE;
+}
+
+static inline bool hasPage(const Checkpoint* checkpoint, int page) {
+    return (checkpoint->pages[page >> 6] >> (page & 63)) & 1;
+}
+
+// Pages are stored in ascending order, so a page's slot is its rank in the bitmap
+static char* pageData(const Checkpoint* checkpoint, int page) {
+    int rank = 0;
+    for (int word = 0; word < page >> 6; word++) {
+        rank += __builtin_popcountll(checkpoint->pages[word]);
+    }
+    rank += __builtin_popcountll(checkpoint->pages[page >> 6] & ((1ull << (page & 63)) - 1));
+    return checkpoint->data + (size_t)rank * TIMELINE_PAGE_SIZE;
+}
+
+static void updateDue(Timeline* timeline) {
+    if (timeline->position + 1 < timeline->count) {
+        timeline->due = timeline->checkpoints[timeline->position + 1].cycle;
+    } else {
+        timeline->due = timeline->checkpoints[timeline->position].cycle + timeline->interval;
+    }
+}
+
+static Checkpoint* appendCheckpoint(Timeline* timeline, CPU* cpu) {
+    if (timeline->count == timeline->capacity) {
+        timeline->capacity = timeline->capacity == 0 ? 64 : timeline->capacity * 2;
+        timeline->checkpoints = realloc(timeline->checkpoints, timeline->capacity * sizeof(Checkpoint));
+    }
+    Checkpoint* checkpoint = &timeline->checkpoints[timeline->count++];
+    *checkpoint = (Checkpoint){ .cycle = cpu->cycles };
+    memcpy(checkpoint->state, cpu, SNAPSHOT_STATE_SIZE);
+    return checkpoint;
+}
+
+// Merges checkpoint index into the one after it, which keeps its own pages
+static void mergeCheckpoint(Timeline* timeline, int index) {
+    Checkpoint* older = &timeline->checkpoints[index];
+    Checkpoint* newer = &timeline->checkpoints[index + 1];
+    Checkpoint merged = *newer;
+    merged.pageCount = 0;
+    for (int word = 0; word < 4; word++) {
+        merged.pages[word] = older->pages[word] | newer->pages[word];
+        merged.pageCount += __builtin_popcountll(merged.pages[word]);
+    }
+    merged.data = malloc((size_t)merged.pageCount * TIMELINE_PAGE_SIZE);
+    char* out = merged.data;
+    for (int page = 0; page < TIMELINE_PAGES; page++) {
+        if (!hasPage(&merged, page)) { continue; }
+        const Checkpoint* source = hasPage(newer, page) ? newer : older;
+        memcpy(out, pageData(source, page), TIMELINE_PAGE_SIZE);
+        out += TIMELINE_PAGE_SIZE;
+    }
+    timeline->used -= checkpointSize(older) + checkpointSize(newer);
+    timeline->used += checkpointSize(&merged);
+    free(older->data);
+    free(newer->data);
+    *newer = merged;
+}
+
+// Drops every other checkpoint, never the first or the last
+static void thinTimeline(Timeline* timeline) {
+    while (timeline->used > timeline->budget && timeline->count > 2) {
+        int kept = 1;
+        for (int i = 1; i < timeline->count; i++) {
+            if (i % 2 == 1 && i + 1 < timeline->count) {
+                mergeCheckpoint(timeline, i);
+            } else {
+                timeline->checkpoints[kept++] = timeline->checkpoints[i];
+            }
+        }
+        timeline->count = kept;
+        timeline->position = kept - 1;
+        timeline->interval *= 2;
+    }
+}
+
+// Stores every page that changed since the previous checkpoint
+static void takeCheckpoint(Timeline* timeline, CPU* cpu) {
+    Checkpoint* checkpoint = appendCheckpoint(timeline, cpu);
+    for (int page = 0; page < TIMELINE_PAGES; page++) {
+        if (memcmp(cpu->ram + page * TIMELINE_PAGE_SIZE, timeline->shadow + page * TIMELINE_PAGE_SIZE, TIMELINE_PAGE_SIZE) != 0) {
+            checkpoint->pages[page >> 6] |= 1ull << (page & 63);
+            checkpoint->pageCount++;
+        }
+    }
+    checkpoint->data = malloc((size_t)checkpoint->pageCount * TIMELINE_PAGE_SIZE);
+    char* out = checkpoint->data;
+    for (int page = 0; page < TIMELINE_PAGES; page++) {
+        if (!hasPage(checkpoint, page)) { continue; }
+        memcpy(out, cpu->ram + page * TIMELINE_PAGE_SIZE, TIMELINE_PAGE_SIZE);
+        memcpy(timeline->shadow + page * TIMELINE_PAGE_SIZE, out, TIMELINE_PAGE_SIZE);
+        out += TIMELINE_PAGE_SIZE;
+    }
+    timeline->used += checkpointSize(checkpoint);
+    timeline->position = timeline->count - 1;
+    thinTimeline(timeline);
+}
+
+static void clearTimeline(Timeline* timeline) {
+    for (int i = 0; i < timeline->count; i++) {
+        free(timeline->checkpoints[i].data);
+    }
+    timeline->count = 0;
+    timeline->used = RAM_SIZE + sizeof(Timeline);
+}
+
+// Discards the history and starts a new one at the CPU's current state, for
+// when the state changed in a way re-execution cannot reproduce
+void rebaseTimeline(Timeline* timeline, CPU* cpu) {
+    clearTimeline(timeline);
+    Checkpoint* base = appendCheckpoint(timeline, cpu);
+    memset(base->pages, 0xFF, sizeof(base->pages));
+    base->pageCount = TIMELINE_PAGES;
+    base->data = malloc(RAM_SIZE);
+    memcpy(base->data, cpu->ram, RAM_SIZE);
+    memcpy(timeline->shadow, cpu->ram, RAM_SIZE);
+    timeline->used += checkpointSize(base);
+    timeline->position = 0;
+    updateDue(timeline);
+}
+
+Timeline* createTimeline(CPU* cpu, uint64_t interval, size_t budget) {
+    Timeline* timeline = calloc(1, sizeof(Timeline));
+    timeline->shadow = malloc(RAM_SIZE);
+    timeline->interval = interval;
+    timeline->budget = budget;
+    rebaseTimeline(timeline, cpu);
+    return timeline;
+}
+
+void freeTimeline(Timeline* timeline) {
+    clearTimeline(timeline);
+    free(timeline->checkpoints);
+    free(timeline->shadow);
+    free(timeline);
+}
+
+// Called after every instruction executed outside advanceTimeline
+void recordTimeline(Timeline* timeline, CPU* cpu) {
+    if (cpu->cycles < timeline->due) { return; }
+    if (timeline->position + 1 < timeline->count) {
+        // Replaying: the state now is the next checkpoint's
+        timeline->position++;
+        memcpy(timeline->shadow, cpu->ram, RAM_SIZE);
+    } else {
+        takeCheckpoint(timeline, cpu);
+    }
+    updateDue(timeline);
+}
+
+static void restoreCheckpoint(Timeline* timeline, CPU* cpu, int index) {
+    for (int page = 0; page < TIMELINE_PAGES; page++) {
+        int holder = index;
+        while (!hasPage(&timeline->checkpoints[holder], page)) { holder--; }
+        const char* contents = pageData(&timeline->checkpoints[holder], page);
+        char* current = cpu->ram + page * TIMELINE_PAGE_SIZE;
+        if (memcmp(current, contents, TIMELINE_PAGE_SIZE) != 0) {
+            memcpy(current, contents, TIMELINE_PAGE_SIZE);
+            // Keeps a snapshot taken before this restore able to undo it
+            cpu->dirtyPages[page >> 6] |= 1ull << (page & 63);
+            if (cpu->codePages[page]) {
+                invalidateCode(cpu, (uint16_t)(page * TIMELINE_PAGE_SIZE), TIMELINE_PAGE_SIZE);
+            }
+        }
+        memcpy(timeline->shadow + page * TIMELINE_PAGE_SIZE, contents, TIMELINE_PAGE_SIZE);
+    }
+    cpu->ram[RAM_SIZE] = cpu->ram[0];
+    memcpy(cpu, timeline->checkpoints[index].state, SNAPSHOT_STATE_SIZE);
+    timeline->position = index;
+    updateDue(timeline);
+}
+
+// Index of the last checkpoint taken before cycle, or at it if atOrBefore
+static int checkpointBefore(Timeline* timeline, uint64_t cycle, bool atOrBefore) {
+    int low = 0, high = timeline->count - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        uint64_t at = timeline->checkpoints[middle].cycle;
+        if (at < cycle || (atOrBefore && at == cycle)) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// Runs forward to cycle, taking checkpoints on the way. A reset at PC 0 does
+// not count as a cycle, so it is always run through.
+StopReason advanceTimeline(Timeline* timeline, CPU* cpu, uint64_t cycle) {
+    while (cpu->status == CPU_RUNNING && (cpu->cycles < cycle || cpu->PC == 0)) {
+        tickComputer(cpu, false);
+        if (cpu->cycles >= timeline->due) { recordTimeline(timeline, cpu); }
+    }
+    return stopReason(cpu);
+}
+
+// Moves the CPU to the state before the instruction at cycle executes, or to
+// where it stops if that is earlier
+void seekTimeline(Timeline* timeline, CPU* cpu, uint64_t cycle) {
+    int index = checkpointBefore(timeline, cycle, true);
+    if (cycle < cpu->cycles || timeline->checkpoints[index].cycle > cpu->cycles) { restoreCheckpoint(timeline, cpu, index); }
+    advanceTimeline(timeline, cpu, cycle);
+}
+
+// Goes back to the latest cycle before the current one at which stop holds,
+// returning false and ending at the start of the history if there is none
+bool reverseTimeline(Timeline* timeline, CPU* cpu, TimelineStop stop, void* context) {
+    uint64_t now = cpu->cycles;
+    for (int index = checkpointBefore(timeline, now, false); stop != NULL && index >= 0; index--) {
+        uint64_t end = index + 1 < timeline->count && timeline->checkpoints[index + 1].cycle < now ?
+            timeline->checkpoints[index + 1].cycle : now;
+        restoreCheckpoint(timeline, cpu, index);
+        int64_t found = -1;
+        while (cpu->status == CPU_RUNNING && cpu->cycles < end) {
+            if (cpu->PC != 0 && stop(cpu, context)) { found = (int64_t)cpu->cycles; }
+            tickComputer(cpu, false);
+            if (cpu->cycles >= timeline->due) { recordTimeline(timeline, cpu); }
+        }
+        if (found >= 0) {
+            seekTimeline(timeline, cpu, (uint64_t)found);
+            return true;
+        }
+    }
+    seekTimeline(timeline, cpu, 0);
+    return false;
+}
@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "emulator.h"
+#include "snapshot.h"
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#define TIMELINE_DEFAULT_INTERVAL 100000
+#define TIMELINE_DEFAULT_BUDGET (64u << 20)
+#define TIMELINE_PAGE_SIZE 256
+#define TIMELINE_PAGES (RAM_SIZE / TIMELINE_PAGE_SIZE)
+
+// CPU state at one cycle plus the pages that differ from the checkpoint before
+// it, stored in ascending page order
+struct Checkpoint {
+    char state[SNAPSHOT_STATE_SIZE];
+    uint64_t cycle;
+    uint64_t pages[4];
+    int pageCount;
+    char *data;
+}; typedef struct Checkpoint Checkpoint;
+
+// Checkpoints of one deterministic run. The first holds all of RAM. position
+// is the checkpoint the CPU last passed, shadow is RAM as it was there and due
+// is the cycle at which the next checkpoint is passed or taken.
+struct Timeline {
+    Checkpoint *checkpoints;
+    int count;
+    int capacity;
+    int position;
+    char *shadow;
+    uint64_t due;
+    uint64_t interval;
+    size_t budget;
+    size_t used;
+}; typedef struct Timeline Timeline;
+
+// Asked before each instruction while searching backwards; true stops there
+typedef bool (*TimelineStop)(CPU *cpu, void *context);
+
+Timeline *createTimeline(CPU *cpu, uint64_t interval, size_t budget);
+
+void freeTimeline(Timeline *timeline);
+
+void rebaseTimeline(Timeline *timeline, CPU *cpu);
+
+void recordTimeline(Timeline *timeline, CPU *cpu);
+
+StopReason advanceTimeline(Timeline *timeline, CPU *cpu, uint64_t cycle);
+
+void seekTimeline(Timeline *timeline, CPU *cpu, uint64_t cycle);
+
+bool reverseTimeline(Timeline *timeline, CPU *cpu, TimelineStop stop, void *context);
+
+#endif
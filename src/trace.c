@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "trace.h"
+#include "scheduler.h"
+#include "utils.h"
+
+// The recorder writes each record straight into a shared mapping of the trace
+// file, so nothing is formatted while the guest runs. The total in the header
+// is updated after every record, so whatever was recorded survives the
+// emulator being killed or crashing.
+
+TraceWriter* createTrace(const char* path, uint32_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf(HI_RED "Fatal error! Cannot create %s\n" COL_RESET, path);
+        return NULL;
+    }
+    size_t size = TRACE_HEADER_SIZE + (size_t)capacity * TRACE_RECORD_SIZE;
+    uint8_t* map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf(HI_RED "Fatal error! Cannot map %s\n" COL_RESET, path);
+        return NULL;
+    }
+    memcpy(map, TRACE_MAGIC, 4);
+    put16(map + 4, TRACE_VERSION);
+    put16(map + 6, TRACE_RECORD_SIZE);
+    put32(map + 8, capacity);
+    TraceWriter* trace = calloc(1, sizeof(TraceWriter));
+    *trace = (TraceWriter){ .map = map, .size = size, .capacity = capacity };
+    return trace;
+}
+
+static void storeWritten(TraceWriter* trace) {
+    put32(trace->map + 16, (uint32_t)(trace->written >> 32));
+    put32(trace->map + 20, (uint32_t)trace->written);
+}
+
+int closeTrace(TraceWriter* trace) {
+    storeWritten(trace);
+    int status = munmap(trace->map, trace->size) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    free(trace);
+    return status;
+}
+
+// Where instruction will store a word and what, or -1 if it does not write
+// memory. Worked out from the operands so the tracer never reads device pages.
+static int32_t writeAccess(const CPU* cpu, uint16_t pc, const Instruction* instruction, uint16_t* value) {
+    switch (instruction->opId) {
+        case MOV_A_R:
+            *value = cpu->regs[instruction->r1];
+            return instruction->data;
+        case MOV_AR_R:
+            *value = cpu->regs[instruction->r2];
+            return cpu->regs[instruction->r1];
+        case MOV_AR_V:
+            *value = instruction->data;
+            return cpu->regs[instruction->r1];
+        case PUSH_R:
+            *value = cpu->regs[instruction->r1];
+            return (uint16_t)(cpu->stackptr - 1);
+        case PUSH_V:
+            *value = instruction->data;
+            return (uint16_t)(cpu->stackptr - 1);
+        case CALL_A:
+            *value = (uint16_t)(pc + 4);
+            return (uint16_t)(cpu->stackptr - 1);
+        default:
+            return -1;
+    }
+}
+
+// runEmulator with a record of every instruction executed
+StopReason runTraced(CPU* cpu, TraceWriter* trace, uint64_t maxCycles) {
+    uint64_t start = cpu->cycles;
+    uint32_t slot = (uint32_t)(trace->written % trace->capacity);
+    while (cpu->status == CPU_RUNNING && cpu->cycles - start < maxCycles) {
+        pollEvents(cpu);
+        uint16_t pc = cpu->PC;
+        if (pc == 0) {
+            tickComputer(cpu, false);
+            continue;
+        }
+        DecodedInstruction* decoded = &cpu->decoded[pc];
+        if (!decoded->valid) { decoded = decodeAt(cpu, pc); }
+        uint8_t* record = trace->map + TRACE_HEADER_SIZE + (size_t)slot * TRACE_RECORD_SIZE;
+        for (int i = 0; i < 4; i++) { record[4 + i] = (uint8_t)cpu->ram[(uint16_t)(pc + i)]; }
+        uint16_t stored = 0;
+        int32_t address = writeAccess(cpu, pc, &decoded->instruction, &stored);
+        uint16_t regs[4];
+        memcpy(regs, cpu->regs, sizeof(regs));
+
+        tickComputer(cpu, false);
+
+        uint8_t flags = 0;
+        uint8_t changed = TRACE_NO_REGISTER;
+        for (int reg = 0; reg < 4; reg++) {
+            if (regs[reg] != cpu->regs[reg]) {
+                changed = (uint8_t)reg;
+                flags |= TRACE_REGISTER;
+            }
+        }
+        if (cpu->status == CPU_FAULT) {
+            flags |= TRACE_FAULT;
+        } else if (address >= 0) {
+            flags |= TRACE_WRITE;
+        }
+        put16(record, pc);
+        record[2] = changed;
+        record[3] = flags;
+        put16(record + 8, changed != TRACE_NO_REGISTER ? cpu->regs[changed] : 0);
+        put16(record + 10, flags & TRACE_WRITE ? (uint16_t)address : 0);
+        put16(record + 12, flags & TRACE_WRITE ? stored : 0);
+        put16(record + 14, 0);
+        trace->written++;
+        storeWritten(trace);
+        if (++slot == trace->capacity) { slot = 0; }
+    }
+    return stopReason(cpu);
+}
+
+// Records a decoder prints, all conditions must hold
+struct TraceFilter {
+    int32_t pc;
+    int32_t reg;
+    int32_t write;
+    int32_t opId;
+}; typedef struct TraceFilter TraceFilter;
+
+static bool matchesFilter(const TraceFilter* filter, const uint8_t* record) {
+    if (filter->pc >= 0 && get16(record) != filter->pc) { return false; }
+    if (filter->reg >= 0 && (!(record[3] & TRACE_REGISTER) || record[2] != filter->reg)) { return false; }
+    if (filter->write >= 0 && (!(record[3] & TRACE_WRITE) || get16(record + 10) != filter->write)) { return false; }
+    if (filter->opId >= 0 && record[5] != filter->opId) { return false; }
+    return true;
+}
+
+static void printRecord(uint64_t step, const uint8_t* record) {
+    static const char* registerNames[4] = { "a", "x", "y", "ax" };
+    uint32_t word = get32(record + 4);
+    Instruction instruction = parseBytes(word);
+    char text[64];
+    disassemble(&instruction, text, sizeof(text));
+    printf("%10llu  $%04X  %08X  %-22s", (unsigned long long)step, get16(record), word, text);
+    if (record[3] & TRACE_REGISTER) { printf("  %s=$%04X", registerNames[record[2] & 3], get16(record + 8)); }
+    if (record[3] & TRACE_WRITE) { printf("  [$%04X]=$%04X", get16(record + 10), get16(record + 12)); }
+    if (record[3] & TRACE_FAULT) { printf("  fault"); }
+    printf("\n");
+}
+
+static bool parseTraceAddress(const char* string, int32_t* address) {
+    char* end;
+    unsigned long value = string[0] == '$' ? strtoul(string + 1, &end, 16) : strtoul(string, &end, 0);
+    if (*string == '\0' || *end != '\0' || value > UINT16_MAX) { return false; }
+    *address = (int32_t)value;
+    return true;
+}
+
+static bool parseTraceRegister(const char* string, int32_t* reg) {
+    static const char* registerNames[4] = { "a", "x", "y", "ax" };
+    for (int i = 0; i < 4; i++) {
+        if (strcasecmp(string, registerNames[i]) == 0) {
+            *reg = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parseTraceOpcode(const char* string, int32_t* opId) {
+    for (int i = 0; instructionName(i) != NULL; i++) {
+        if (strcasecmp(string, instructionName(i)) == 0) {
+            *opId = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void printTraceUsage() {
+    printf(HI_YELLOW
+        "Usage: lol16 trace file [--pc ADDR] [--reg a|x|y|ax] [--write ADDR] [--op OPCODE] [--last N] [--summary]\n"
+        COL_RESET);
+}
+
+// Prints the matching records, or with summary only their counts
+static void summarizeTrace(const uint8_t* records, uint32_t capacity, uint64_t first, uint32_t count, const TraceFilter* filter) {
+    static const char* registerNames[4] = { "a", "x", "y", "ax" };
+    uint64_t matched = 0, writes = 0, faults = 0;
+    uint64_t registers[4] = {0};
+    uint64_t opcodes[256] = {0};
+    uint8_t* seen = calloc(RAM_SIZE / 8, 1);
+    uint32_t distinct = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* record = records + (size_t)((first + i) % capacity) * TRACE_RECORD_SIZE;
+        if (!matchesFilter(filter, record)) { continue; }
+        matched++;
+        uint16_t pc = get16(record);
+        if (!(seen[pc >> 3] & (1 << (pc & 7)))) {
+            seen[pc >> 3] |= 1 << (pc & 7);
+            distinct++;
+        }
+        opcodes[record[5]]++;
+        if (record[3] & TRACE_REGISTER) { registers[record[2] & 3]++; }
+        if (record[3] & TRACE_WRITE) { writes++; }
+        if (record[3] & TRACE_FAULT) { faults++; }
+    }
+    free(seen);
+    printf(HI_YELLOW "Trace summary\n" COL_RESET);
+    printf("  steps %llu-%llu, %llu matching records at %u addresses\n", (unsigned long long)first,
+        (unsigned long long)(first + count - (count > 0)), (unsigned long long)matched, distinct);
+    printf("  memory writes %llu, faults %llu\n", (unsigned long long)writes, (unsigned long long)faults);
+    for (int reg = 0; reg < 4; reg++) {
+        printf("  %-2s changed %llu times\n", registerNames[reg], (unsigned long long)registers[reg]);
+    }
+    printf(HI_YELLOW "Opcodes\n" COL_RESET);
+    for (int opId = 0; opId < 256; opId++) {
+        if (opcodes[opId] == 0) { continue; }
+        const char* name = instructionName(opId);
+        printf("  %-10s  %12llu\n", name != NULL ? name : "invalid", (unsigned long long)opcodes[opId]);
+    }
+}
+
+// lol16 trace file [filters] [--last N] [--summary]
+int runTraceTool(int argc, char const *argv[]) {
+    const char* path = NULL;
+    TraceFilter filter = { -1, -1, -1, -1 };
+    uint64_t last = UINT64_MAX;
+    bool summary = false;
+    for (int i = 2; i < argc; i++) {
+        bool valid = true;
+        if (strcmp(argv[i], "--summary") == 0) {
+            summary = true;
+        } else if (i + 1 < argc && strcmp(argv[i], "--pc") == 0) {
+            valid = parseTraceAddress(argv[++i], &filter.pc);
+        } else if (i + 1 < argc && strcmp(argv[i], "--write") == 0) {
+            valid = parseTraceAddress(argv[++i], &filter.write);
+        } else if (i + 1 < argc && strcmp(argv[i], "--reg") == 0) {
+            valid = parseTraceRegister(argv[++i], &filter.reg);
+        } else if (i + 1 < argc && strcmp(argv[i], "--op") == 0) {
+            valid = parseTraceOpcode(argv[++i], &filter.opId);
+        } else if (i + 1 < argc && strcmp(argv[i], "--last") == 0) {
+            char* end;
+            last = strtoull(argv[++i], &end, 0);
+            valid = *end == '\0' && argv[i][0] != '-';
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            printTraceUsage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (path == NULL) {
+        printTraceUsage();
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        printf(HI_RED "Fatal error! Cannot read file %s\n" COL_RESET, path);
+        if (fd != -1) { close(fd); }
+        return EXIT_FAILURE;
+    }
+    size_t size = (size_t)info.st_size;
+    const uint8_t* map = size >= TRACE_HEADER_SIZE ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || memcmp(map, TRACE_MAGIC, 4) != 0) {
+        printf(HI_RED "Fatal error! %s is not a LOL16 trace!\n" COL_RESET, path);
+        if (map != MAP_FAILED) { munmap((void*)map, size); }
+        return EXIT_FAILURE;
+    }
+    uint32_t capacity = get32(map + 8);
+    uint64_t written = (uint64_t)get32(map + 16) << 32 | get32(map + 20);
+    if (get16(map + 4) != TRACE_VERSION || get16(map + 6) != TRACE_RECORD_SIZE || capacity == 0 ||
+        TRACE_HEADER_SIZE + (size_t)capacity * TRACE_RECORD_SIZE > size) {
+        printf(HI_RED "Fatal error! %s has an unsupported or truncated header!\n" COL_RESET, path);
+        munmap((void*)map, size);
+        return EXIT_FAILURE;
+    }
+
+    // The oldest kept record is at slot written % capacity once the ring wrapped
+    uint32_t count = written < capacity ? (uint32_t)written : capacity;
+    uint64_t first = written - count;
+    const uint8_t* records = map + TRACE_HEADER_SIZE;
+    if (summary) {
+        summarizeTrace(records, capacity, first, count, &filter);
+    } else {
+        uint64_t matching = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            matching += matchesFilter(&filter, records + (size_t)((first + i) % capacity) * TRACE_RECORD_SIZE);
+        }
+        uint64_t skip = matching > last ? matching - last : 0;
+        for (uint32_t i = 0; i < count; i++) {
+            const uint8_t* record = records + (size_t)((first + i) % capacity) * TRACE_RECORD_SIZE;
+            if (!matchesFilter(&filter, record)) { continue; }
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            printRecord(first + i, record);
+        }
+    }
+    munmap((void*)map, size);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "emulator.h"
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// LOL16 trace file, a ring of fixed size records in an mmap'd file, all fields
+// big endian:
+//   header  magic "L16T", u16 version, u16 record size, u32 capacity in
+//           records, u32 reserved, u64 records written in total
+//   record  u16 PC, u8 changed register or TRACE_NO_REGISTER, u8 TRACE_ flags,
+//           u32 raw instruction word, u16 new register value, u16 address and
+//           u16 value of the memory write, u16 reserved
+// Once more than capacity records were written, record n lives in slot
+// n % capacity and only the last capacity records are kept.
+#define TRACE_MAGIC "L16T"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 24
+#define TRACE_RECORD_SIZE 16
+#define TRACE_DEFAULT_CAPACITY (1u << 20)
+#define TRACE_NO_REGISTER 0xFF
+
+// Record flags
+#define TRACE_REGISTER 1
+#define TRACE_WRITE 2
+#define TRACE_FAULT 4
+
+struct TraceWriter {
+    uint8_t *map;
+    size_t size;
+    uint32_t capacity;
+    uint64_t written;
+}; typedef struct TraceWriter TraceWriter;
+
+TraceWriter *createTrace(const char *path, uint32_t capacity);
+
+int closeTrace(TraceWriter *trace);
+
+StopReason runTraced(CPU *cpu, TraceWriter *trace, uint64_t maxCycles);
+
+int runTraceTool(int argc, char const *argv[]);
+
+#endif
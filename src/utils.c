@@ -1,6 +1,5 @@
-#define PCRE2_CODE_UNIT_WIDTH 8
-#include <pcre2.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
@@ -75,8 +74,8 @@ void switchPtrEndianess(uint16_t* ptr) {
              ((ptr[0] & 0x00FF) << 8);
 }
 
-void printInstructionStruct(Instruction* instruction) {
-    printf(
+void printInstructionStruct(FILE* log, Instruction* instruction) {
+    fprintf(log,
         HI_GREEN 
         "Instruction:\n"
         "   |- r1 - %d\n"
@@ -89,58 +88,41 @@ void printInstructionStruct(Instruction* instruction) {
     );
 }
 
-char* matches(const char* input, const char* pattern) {
-    pcre2_code *re;
-    PCRE2_SPTR pattern_sptr = (PCRE2_SPTR)pattern;
-    PCRE2_SIZE error_offset;
-    int error_code;
-    int len;
-    char* matched = NULL;
-
-    // Compile the regular expression
-    re = pcre2_compile(pattern_sptr, PCRE2_ZERO_TERMINATED, 0, &error_code, &error_offset, NULL);
-    if (re == NULL) {
-        PCRE2_UCHAR buffer[256];
-        pcre2_get_error_message(error_code, buffer, sizeof(buffer));
-        fprintf(stderr, "Error compiling regex at offset %d: %s\n", (int)error_offset, buffer);
-        return NULL;
+// FNV-1a, chained by passing the previous hash (start from 2166136261u)
+uint32_t fnv1a(uint32_t hash, const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
     }
+    return hash;
+}
 
-    // Create matcher context
-    pcre2_match_context *match_context = pcre2_match_context_create(NULL);
+uint16_t get16(const uint8_t* bytes) {
+    return (uint16_t)(bytes[0] << 8 | bytes[1]);
+}
 
-    // Create match data
-    pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(re, NULL);
+uint32_t get32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
 
-    // Execute the regular expression
-    int rc = pcre2_match(re, (PCRE2_SPTR)input, strlen(input), 0, 0, match_data, match_context);
-    if (rc < 0) {
-        if (rc != PCRE2_ERROR_NOMATCH) {
-            fprintf(stderr, "Error executing regex: %d\n", rc);
-        }
-        pcre2_match_data_free(match_data);
-        pcre2_match_context_free(match_context);
-        pcre2_code_free(re);
-        return NULL; // No match or error
-    }
+void put16(uint8_t* bytes, uint16_t value) {
+    bytes[0] = value >> 8;
+    bytes[1] = value & 0xFF;
+}
 
-    // Get the matched substring
-    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-    len = (int)(ovector[1] - ovector[0]);
-    matched = (char*)malloc(len + 1);
-    if (matched == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        pcre2_match_data_free(match_data);
-        pcre2_match_context_free(match_context);
-        pcre2_code_free(re);
-        return NULL;
-    }
-    strncpy(matched, input + ovector[0], len);
-    matched[len] = '\0';
-
-    // Free memory and return
-    pcre2_match_data_free(match_data);
-    pcre2_match_context_free(match_context);
-    pcre2_code_free(re);
-    return matched;
+void put32(uint8_t* bytes, uint32_t value) {
+    put16(bytes, value >> 16);
+    put16(bytes + 2, value & 0xFFFF);
+}
+
+// Name of an Instructions value, or NULL outside the ISA
+const char* instructionName(int opId) {
+    static const char* names[] = {
+        "MOV_R_R", "MOV_R_V", "MOV_R_A", "MOV_A_R", "MOV_AR_R", "MOV_AR_V", "MOV_R_AR", "PUSH_R",
+        "PUSH_V", "POP_R", "CALL_A", "RET", "CMP_R_V", "CMP_V_R", "CMP_R_R", "JZ_A", "JNZ_A",
+        "JN_A", "JNN_A", "JMP_A", "JE_A", "JNE_A", "JL_A", "JLE_A", "JG_A", "JGE_A", "ADD_R_V_R",
+        "ADD_R_R_R", "ADC_R_V_R", "ADC_R_R_R", "SUB_R_V_R", "SUB_V_R_R", "SUB_R_R_R", "SBB_R_V_R",
+        "SBB_V_R_R", "SBB_R_R_R", "MUL_R_V_R", "MUL_R_R_R", "IMUL_R_V_R", "IMUL_R_R_R", "DIV_R_V_R",
+        "DIV_V_R_R", "DIV_R_R_R", "IDIV_R_V_R", "IDIV_V_R_R", "IDIV_R_R_R", "PASS_R", "HLT"
+    };
+    return opId >= 0 && opId < (int)(sizeof(names) / sizeof(names[0])) ? names[opId] : NULL;
 }
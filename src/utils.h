@@ -1,6 +1,10 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
 #define HI_PURPLE "\e[0;95m"
 #define HI_GREEN "\e[0;92m"
 #define HI_YELLOW "\e[0;93m"
@@ -23,7 +27,7 @@ struct Instruction {
     char opId;
 }; typedef struct Instruction Instruction;
 
-void printInstructionStruct(Instruction *instruction);
+void printInstructionStruct(FILE *log, Instruction *instruction);
 
 char lowByte(uint16_t num);
 
@@ -35,12 +39,22 @@ uint32_t toBigEndian(uint32_t value);
 
 void switchPtrEndianess(uint16_t *ptr);
 
-char *matches(const char *input, const char *pattern);
 
 unsigned int bin2dec(const char *binary);
 
 uint32_t hex2dec(const char *hex);
 
+uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t length);
+
+// Big endian field accessors for the image and object file formats
+uint16_t get16(const uint8_t *bytes);
+
+uint32_t get32(const uint8_t *bytes);
+
+void put16(uint8_t *bytes, uint16_t value);
+
+void put32(uint8_t *bytes, uint32_t value);
+
 enum Instructions {
     MOV_R_R,
     MOV_R_V,
@@ -92,4 +106,6 @@ enum Instructions {
     HLT
 }; typedef enum Instructions Instructions;
 
+const char *instructionName(int opId);
+
 #endif
\ No newline at end of file
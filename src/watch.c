@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "emulator.h"
+#include "assembler.h"
+#include "symbols.h"
+#include "watch.h"
+#include "utils.h"
+
+// The source is hashed line by line. When an edit keeps the line count and
+// only swaps one instruction for another on lines that define no label, every
+// other address stays put, so just those lines are re-encoded against the old
+// symbol table. Anything else is assembled from scratch and diffed against the
+// previous image. Either way only the words that actually differ are stored
+// into the CPU, which invalidates any decoded or translated code covering them.
+
+static char* readSource(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf(HI_RED "Fatal error! Cannot open %s!\n" COL_RESET, path);
+        return NULL;
+    }
+    size_t capacity = 4096;
+    char* buffer = malloc(capacity);
+    *size = 0;
+    size_t read;
+    while ((read = fread(buffer + *size, 1, capacity - *size, file)) > 0) {
+        *size += read;
+        if (*size == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    fclose(file);
+    return buffer;
+}
+
+// Splits source into lines the way getline would, without the newlines
+static int splitLines(char* source, size_t size, char*** lines) {
+    int count = 0;
+    int capacity = 256;
+    *lines = malloc(capacity * sizeof(char*));
+    size_t start = 0;
+    while (start < size) {
+        char* newline = memchr(source + start, '\n', size - start);
+        size_t end = newline != NULL ? (size_t)(newline - source) : size;
+        if (count == capacity) {
+            capacity *= 2;
+            *lines = realloc(*lines, capacity * sizeof(char*));
+        }
+        source[end] = '\0';
+        (*lines)[count++] = source + start;
+        start = end + 1;
+    }
+    return count;
+}
+
+// Assembles source into image (RAM_SIZE bytes), keeping its line records and
+// symbols on success
+static int assembleImage(const char* source, size_t size, uint16_t startVector, char* image, ObjectModule* module) {
+    memset(image, 0, RAM_SIZE);
+    image[0] = (char)(startVector >> 8);
+    image[1] = (char)(startVector & 0xFF);
+    *module = (ObjectModule){ .code = image + startVector, .capacity = RAM_SIZE - startVector, .recordLines = true };
+    FILE* stream = fmemopen((void*)source, size, "r");
+    int status = size == 0 ? EXIT_SUCCESS : assembleModule(stream, module, NULL);
+    if (stream != NULL) { fclose(stream); }
+    if (size == 0) { module->symbols = createSymbolTable(); }
+    if (status == EXIT_SUCCESS) {
+        status = relocateModule(module, startVector);
+    }
+    if (status != EXIT_SUCCESS) { freeObjectModule(module); }
+    return status;
+}
+
+static void adoptModule(WatchState* watch, ObjectModule* module) {
+    free(watch->lines);
+    if (watch->symbols != NULL) { freeSymbolTable(watch->symbols); }
+    watch->lines = module->lines;
+    watch->lineCount = module->lineCount;
+    watch->symbols = module->symbols;
+    free(module->relocations);
+}
+
+WatchState* createWatch(const char* path, char* ram, uint16_t startVector) {
+    size_t size;
+    char* source = readSource(path, &size);
+    if (source == NULL) { return NULL; }
+    WatchState* watch = calloc(1, sizeof(WatchState));
+    watch->fd = -1;
+    watch->image = malloc(RAM_SIZE);
+    watch->startVector = startVector;
+    ObjectModule module;
+    if (assembleImage(source, size, startVector, watch->image, &module) == EXIT_FAILURE) {
+        free(source);
+        freeWatch(watch);
+        return NULL;
+    }
+    free(source);
+    adoptModule(watch, &module);
+    memcpy(ram, watch->image, RAM_SIZE);
+
+    // Editors often replace the file rather than rewrite it, so watch its directory
+    watch->path = strdup(path);
+    char* directory = strdup(path);
+    watch->name = strdup(basename(watch->path));
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd == -1 || inotify_add_watch(watch->fd, dirname(directory), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        printf(HI_RED "Fatal error! Cannot watch %s!\n" COL_RESET, path);
+        free(directory);
+        freeWatch(watch);
+        return NULL;
+    }
+    free(directory);
+    return watch;
+}
+
+void freeWatch(WatchState* watch) {
+    if (watch->fd != -1) { close(watch->fd); }
+    if (watch->symbols != NULL) { freeSymbolTable(watch->symbols); }
+    free(watch->lines);
+    free(watch->image);
+    free(watch->path);
+    free(watch->name);
+    free(watch);
+}
+
+// Drains pending inotify events, returning true if any concerned the source
+bool watchChanged(WatchState* watch) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t length;
+    while ((length = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+        for (char* at = buffer; at < buffer + length; ) {
+            struct inotify_event* event = (struct inotify_event*)at;
+            if (event->len > 0 && strcmp(event->name, watch->name) == 0) {
+                changed = true;
+            }
+            at += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+
+// Re-encodes a changed instruction line in place, returning false if the edit
+// needs a full assembly instead
+static bool encodeChangedLine(WatchState* watch, const char* line, int number, int32_t offset, char* image, bool* failed) {
+    char text[MAX_LINE_LENGTH + 1];
+    size_t length = strcspn(line, ";");
+    if (length > MAX_LINE_LENGTH) { return false; }
+    memcpy(text, line, length);
+    text[length] = '\0';
+    if (strchr(text, ':') != NULL) { return false; }
+    Instruction instruction;
+    char label[MAX_LABEL_LENGTH + 1];
+    int parsed = parseLine(text, &instruction, number, label, stdout);
+    if (parsed == 3) { return false; }
+    if (parsed != 0) {
+        *failed = true;
+        return true;
+    }
+    if (label[0] != '\0') {
+        int index = findSymbol(watch->symbols, label);
+        if (index < 0 || !watch->symbols->symbols[index].defined) { return false; }
+        instruction.data = watch->startVector + watch->symbols->symbols[index].address;
+    }
+    uint32_t machineCode = toMachineCode(&instruction);
+    char* code = image + watch->startVector + offset;
+    code[0] = (char)(machineCode >> 24);
+    code[1] = (char)(machineCode >> 16);
+    code[2] = (char)(machineCode >> 8);
+    code[3] = (char)machineCode;
+    return true;
+}
+
+// Tries the incremental path. Returns EXIT_SUCCESS with image patched, or
+// EXIT_FAILURE if the edit is structural; *failed is set on a source error.
+static int patchLines(WatchState* watch, char** lines, int count, char* image, bool* failed) {
+    if (count != watch->lineCount) { return EXIT_FAILURE; }
+    for (int line = 0; line < count; line++) {
+        SourceLine* old = &watch->lines[line];
+        uint32_t hash = fnv1a(2166136261u, (const uint8_t*)lines[line], strlen(lines[line]));
+        if (hash == old->hash) { continue; }
+        if (old->label || old->offset < 0) { return EXIT_FAILURE; }
+        if (!encodeChangedLine(watch, lines[line], line, old->offset, image, failed)) { return EXIT_FAILURE; }
+        if (*failed) { return EXIT_SUCCESS; }
+    }
+    return EXIT_SUCCESS;
+}
+
+static void countChangedLines(WatchState* watch, char** lines, int count, WatchReport* report) {
+    for (int line = 0; line < count; line++) {
+        uint32_t hash = fnv1a(2166136261u, (const uint8_t*)lines[line], strlen(lines[line]));
+        if (line < watch->lineCount && hash == watch->lines[line].hash) { continue; }
+        if (report->changedLines++ == 0) { report->firstLine = line + 1; }
+        report->lastLine = line + 1;
+    }
+}
+
+// Reloads the source after a change and stores every word that differs from
+// the running image into the CPU. The CPU keeps running the old program if the
+// new source does not assemble.
+int reloadWatch(WatchState* watch, CPU* cpu, WatchReport* report) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *report = (WatchReport){0};
+
+    size_t size;
+    char* source = readSource(watch->path, &size);
+    if (source == NULL) { return EXIT_FAILURE; }
+    char* text = malloc(size + 1);
+    memcpy(text, source, size);
+    char** lines;
+    int count = splitLines(text, size, &lines);
+    countChangedLines(watch, lines, count, report);
+
+    char* image = malloc(RAM_SIZE);
+    memcpy(image, watch->image, RAM_SIZE);
+    bool failed = false;
+    int status = EXIT_SUCCESS;
+    report->incremental = patchLines(watch, lines, count, image, &failed) == EXIT_SUCCESS;
+    if (failed) {
+        status = EXIT_FAILURE;
+    } else if (!report->incremental) {
+        ObjectModule module;
+        status = assembleImage(source, size, watch->startVector, image, &module);
+        if (status == EXIT_SUCCESS) { adoptModule(watch, &module); }
+    } else {
+        for (int line = 0; line < count; line++) {
+            watch->lines[line].hash = fnv1a(2166136261u, (const uint8_t*)lines[line], strlen(lines[line]));
+        }
+    }
+
+    if (status == EXIT_SUCCESS) {
+        for (uint32_t address = 0; address < RAM_SIZE; address += 2) {
+            if (image[address] == watch->image[address] && image[address+1] == watch->image[address+1]) { continue; }
+            storeWord(cpu, (uint16_t)address, (uint16_t)((uint8_t)image[address] << 8 | (uint8_t)image[address+1]));
+            report->patchedWords++;
+        }
+        memcpy(watch->image, image, RAM_SIZE);
+    }
+
+    free(image);
+    free(lines);
+    free(text);
+    free(source);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->nanos = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t)(end.tv_nsec - start.tv_nsec);
+    return status;
+}
@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "emulator.h"
+#include "assembler.h"
+#include "symbols.h"
+
+#ifndef WATCH_H
+#define WATCH_H
+
+// A source file being watched for the REPL. image is what the running program
+// was last assembled to, lines and symbols describe the source it came from.
+struct WatchState {
+    char *path;
+    char *name;
+    int fd;
+    uint16_t startVector;
+    char *image;
+    SourceLine *lines;
+    int lineCount;
+    SymbolTable *symbols;
+}; typedef struct WatchState WatchState;
+
+// What one reload changed
+struct WatchReport {
+    int changedLines;
+    int firstLine;
+    int lastLine;
+    int patchedWords;
+    bool incremental;
+    uint64_t nanos;
+}; typedef struct WatchReport WatchReport;
+
+WatchState *createWatch(const char *path, char *ram, uint16_t startVector);
+
+void freeWatch(WatchState *watch);
+
+bool watchChanged(WatchState *watch);
+
+int reloadWatch(WatchState *watch, CPU *cpu, WatchReport *report);
+
+#endif